@@ -0,0 +1,275 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+/*
+
+Arena
+Frame buffers for one job, carved from large regions backed by huge pages and recycled
+by size class. A 1080x1920 frame is 3 MB and a 4K one 12 MB, so a buffer from av_malloc
+that the allocator had to map fresh costs hundreds of 4 KB page faults the first time it
+is written, and every frame after that walks its TLB entries again. Here a region is
+faulted in once, 2 MB at a time with huge pages, and a released buffer goes back on the
+free list of its size class for the next frame of the same size.
+
+Regions use explicit huge pages (MAP_HUGETLB, from the pool the admin reserved in
+/proc/sys/vm/nr_hugepages) when asked for and available, transparent huge pages through
+madvise otherwise, and are bound to a NUMA node when the job is placed on one
+(placement.hpp). Memory is only returned when the arena and every buffer it handed
+out are gone; a job's frame sizes do not change, so the free lists stay small.
+
+Buffers are AVBufferRefs like any other and may outlive the Arena object, each one keeps
+the regions alive until it is released.
+
+*/
+
+extern "C" {
+	#include <libavcodec/avcodec.h>
+	#include <libavutil/buffer.h>
+	#include <libavutil/frame.h>
+	#include <libavutil/imgutils.h>
+	#include <libavutil/pixdesc.h>
+}
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "placement.hpp"
+
+namespace arena {
+
+static constexpr size_t HugePage = 2 << 20;
+static constexpr int Align = 64;            // Rows and planes, enough for AVX-512 loads
+
+struct Options {
+	bool explicitHugePages = false;         // MAP_HUGETLB first, transparent huge pages when it fails
+	size_t regionBytes = 64 << 20;
+	int node = -1;                          // NUMA node for the regions, -1 for first touch
+};
+
+struct Stats {
+	size_t mappedBytes = 0;
+	uint64_t buffers = 0;                   // Handed out
+	uint64_t reused = 0;                    // Of those, from a free list
+	bool explicitHugePages = false;         // Every region came from the hugetlb pool
+};
+
+// Blocks round up to an eighth of their power of two, at least 64 KB, so frames of one
+// size share a class and padding differences between codecs do not split it
+inline size_t sizeClass(size_t bytes) {
+	size_t power = 1;
+	while (power * 2 <= bytes) {
+		power *= 2;
+	}
+	const size_t step = std::max<size_t>(64 << 10, power / 8);
+	return (bytes + step - 1) / step * step;
+}
+
+/*
+
+Frame Layout
+All planes of a frame in one block: linesizes for width rounded up to Align, every plane
+starting on an Align boundary, and Align bytes of slack at the end for SIMD overreads.
+
+*/
+
+inline size_t layout(AVPixelFormat format, int width, int height, int linesizes[4], size_t offsets[4]) {
+	if (av_image_fill_linesizes(linesizes, format, (width + Align - 1) / Align * Align) < 0) {
+		return 0;
+	}
+	ptrdiff_t strides[4];
+	for (int i = 0; i < 4; i++) {
+		linesizes[i] = (linesizes[i] + Align - 1) / Align * Align;
+		strides[i] = linesizes[i];
+	}
+	size_t sizes[4];
+	if (av_image_fill_plane_sizes(sizes, format, height, strides) < 0) {
+		return 0;
+	}
+	size_t total = 0;
+	for (int i = 0; i < 4; i++) {
+		offsets[i] = total;
+		total += (sizes[i] + Align - 1) / Align * Align;
+	}
+	return total + Align;
+}
+
+class Arena {
+public:
+	explicit Arena(const Options& options = {}) : state(std::make_shared<State>()) {
+		state->options = options;
+	}
+
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+
+	// Buffer for frame->format, width and height, like av_frame_get_buffer
+	bool allocate(AVFrame* frame) {
+		return allocate(frame, frame->width, frame->height);
+	}
+
+	// Same with the planes sized for paddedWidth x paddedHeight, which decoders ask for
+	bool allocate(AVFrame* frame, int paddedWidth, int paddedHeight) {
+		int linesizes[4];
+		size_t offsets[4];
+		const size_t bytes = layout((AVPixelFormat)frame->format, paddedWidth, paddedHeight, linesizes, offsets);
+		if (bytes == 0) {
+			return false;
+		}
+		const size_t blockBytes = sizeClass(bytes);
+		uint8_t* block = state->take(blockBytes);
+		if (!block) {
+			return false;
+		}
+
+		Lease* lease = new Lease{state, blockBytes};
+		frame->buf[0] = av_buffer_create(block, bytes, release, lease, 0);
+		if (!frame->buf[0]) {
+			release(lease, block);
+			return false;
+		}
+		const int planes = av_pix_fmt_count_planes((AVPixelFormat)frame->format);
+		for (int i = 0; i < 4; i++) {
+			frame->data[i] = i < planes ? block + offsets[i] : nullptr;
+			frame->linesize[i] = i < planes ? linesizes[i] : 0;
+		}
+		frame->extended_data = frame->data;
+		return true;
+	}
+
+	// Decoder frames from the arena where the decoder lets us provide them. The arena
+	// must outlive the decoder.
+	void attach(AVCodecContext* decoder) {
+		decoder->opaque = this;
+		decoder->get_buffer2 = getBuffer;
+	}
+
+	Stats stats() const {
+		std::lock_guard<std::mutex> lock(state->mutex);
+		return state->stats;
+	}
+
+private:
+	struct Region {
+		uint8_t* data;
+		size_t bytes;
+	};
+
+	struct State {
+		Options options;
+		std::mutex mutex;
+		std::vector<Region> regions;
+		uint8_t* cursor = nullptr;
+		size_t remaining = 0;
+		std::unordered_map<size_t, std::vector<uint8_t*>> free;
+		Stats stats;
+
+		~State() {
+			for (const Region& region : regions) {
+				munmap(region.data, region.bytes);
+			}
+		}
+
+		uint8_t* take(size_t bytes) {
+			std::lock_guard<std::mutex> lock(mutex);
+			stats.buffers++;
+			std::vector<uint8_t*>& list = free[bytes];
+			if (!list.empty()) {
+				uint8_t* block = list.back();
+				list.pop_back();
+				stats.reused++;
+				return block;
+			}
+			if (bytes > remaining && !grow(bytes)) {
+				stats.buffers--;
+				return nullptr;
+			}
+			uint8_t* block = cursor;
+			cursor += bytes;
+			remaining -= bytes;
+			return block;
+		}
+
+		void give(uint8_t* block, size_t bytes) {
+			std::lock_guard<std::mutex> lock(mutex);
+			free[bytes].push_back(block);
+		}
+
+		// The rest of the current region is left unused, blocks never straddle regions
+		bool grow(size_t bytes) {
+			const size_t regionBytes = (std::max(options.regionBytes, bytes) + HugePage - 1) / HugePage * HugePage;
+			void* data = MAP_FAILED;
+#ifdef MAP_HUGETLB
+			if (options.explicitHugePages) {
+				data = mmap(nullptr, regionBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			}
+#endif
+			const bool hugetlb = data != MAP_FAILED;
+			if (!hugetlb) {
+				// Over-map by a huge page and trim, so the region is huge page aligned
+				uint8_t* raw = (uint8_t*)mmap(nullptr, regionBytes + HugePage, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+				if (raw == (uint8_t*)MAP_FAILED) {
+					return false;
+				}
+				uint8_t* aligned = (uint8_t*)(((uintptr_t)raw + HugePage - 1) & ~(uintptr_t)(HugePage - 1));
+				if (aligned > raw) {
+					munmap(raw, aligned - raw);
+				}
+				munmap(aligned + regionBytes, raw + HugePage - aligned);
+				data = aligned;
+#ifdef MADV_HUGEPAGE
+				madvise(data, regionBytes, MADV_HUGEPAGE);
+#endif
+			}
+
+			// Before the first touch, which is when the pages are placed
+			if (options.node >= 0) {
+				placement::preferNode(data, regionBytes, options.node);
+			}
+
+			stats.explicitHugePages = hugetlb && (regions.empty() || stats.explicitHugePages);
+			stats.mappedBytes += regionBytes;
+			regions.push_back({(uint8_t*)data, regionBytes});
+			cursor = (uint8_t*)data;
+			remaining = regionBytes;
+			return true;
+		}
+	};
+
+	struct Lease {
+		std::shared_ptr<State> state;
+		size_t bytes;
+	};
+
+	std::shared_ptr<State> state;
+
+	static void release(void* opaque, uint8_t* data) {
+		Lease* lease = (Lease*)opaque;
+		lease->state->give(data, lease->bytes);
+		delete lease;
+	}
+
+	static int getBuffer(AVCodecContext* decoder, AVFrame* frame, int flags) {
+		Arena* self = (Arena*)decoder->opaque;
+		if (!self || !decoder->codec || !(decoder->codec->capabilities & AV_CODEC_CAP_DR1)) {
+			return avcodec_default_get_buffer2(decoder, frame, flags);
+		}
+		int width = frame->width;
+		int height = frame->height;
+		int linesizeAlign[AV_NUM_DATA_POINTERS];
+		avcodec_align_dimensions2(decoder, &width, &height, linesizeAlign);
+		if (self->allocate(frame, width, height)) {
+			return 0;
+		}
+		return avcodec_default_get_buffer2(decoder, frame, flags);  // Formats without a plain layout
+	}
+};
+
+} // namespace arena
+
+#endif // ARENA_HPP
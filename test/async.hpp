@@ -0,0 +1,518 @@
+#ifndef ASYNC_HPP
+#define ASYNC_HPP
+
+/*
+
+Async
+Coroutine plumbing for running conversions without a dedicated OS thread per job.
+
+	async::Task<bool> handle(VideoConverter& converter, async::ConversionJob& job) {
+		bool ok = co_await converter.run(job);
+		co_return ok;
+	}
+
+The blocking work runs on the shared worker pool, the awaiting coroutine is resumed
+on the pool thread once the conversion is done. Progress is published through atomic
+counters on the job, cancellation is cooperative and checked between frames.
+
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "scores.hpp"
+
+namespace async {
+
+/*
+
+Worker Pool
+Fixed set of threads consuming a FIFO of tasks. onStart runs first on every thread, to
+pin it to CPUs for example.
+
+*/
+
+class WorkerPool {
+public:
+	explicit WorkerPool(unsigned threadCount = std::thread::hardware_concurrency(), std::function<void()> onStart = nullptr) {
+		if (threadCount == 0) {
+			threadCount = 1;
+		}
+		for (unsigned i = 0; i < threadCount; i++) {
+			workers.emplace_back([this, onStart] {
+				if (onStart) {
+					onStart();
+				}
+				run();
+			});
+		}
+	}
+
+	~WorkerPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		available.notify_all();
+		for (auto& worker : workers) {
+			worker.join();
+		}
+	}
+
+	WorkerPool(const WorkerPool&) = delete;
+	WorkerPool& operator=(const WorkerPool&) = delete;
+
+	static WorkerPool& shared() {
+		static WorkerPool pool;
+		return pool;
+	}
+
+	void post(std::function<void()> task) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			tasks.push_back(std::move(task));
+		}
+		available.notify_one();
+	}
+
+	size_t size() const {
+		return workers.size();
+	}
+
+private:
+	std::mutex mutex;
+	std::condition_variable available;
+	std::deque<std::function<void()>> tasks;
+	std::vector<std::thread> workers;
+	bool stopping = false;
+
+	void run() {
+		while (true) {
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				available.wait(lock, [this] { return stopping || !tasks.empty(); });
+				if (tasks.empty()) {
+					return;
+				}
+				task = std::move(tasks.front());
+				tasks.pop_front();
+			}
+			task();
+		}
+	}
+};
+
+/*
+
+Parallel For
+Runs body(i) for every i in [0, count) on the pool and the calling thread and returns
+when all of them are done. The caller takes indices too and only waits for the ones a
+helper already started, so it makes progress even when every pool thread is busy with
+other conversions, and calling it from a pool thread cannot deadlock.
+
+*/
+
+inline void parallelFor(WorkerPool& pool, int count, const std::function<void(int)>& body, int helpers = -1) {
+	if (count <= 0) {
+		return;
+	}
+	if (helpers < 0) {
+		helpers = (int)pool.size();
+	}
+	helpers = std::min(helpers, count - 1);
+	if (helpers <= 0) {
+		for (int i = 0; i < count; i++) {
+			body(i);
+		}
+		return;
+	}
+
+	// Shared with helpers that may only get to run after the call has returned,
+	// those find no index left and never touch body
+	struct State {
+		std::atomic<int> next{0};
+		std::atomic<int> finished{0};
+		int count = 0;
+		const std::function<void(int)>* body = nullptr;
+		std::mutex mutex;
+		std::condition_variable done;
+	};
+	auto state = std::make_shared<State>();
+	state->count = count;
+	state->body = &body;
+
+	auto work = [](State& shared) {
+		int i;
+		while ((i = shared.next.fetch_add(1, std::memory_order_relaxed)) < shared.count) {
+			(*shared.body)(i);
+			if (shared.finished.fetch_add(1, std::memory_order_acq_rel) + 1 == shared.count) {
+				std::lock_guard<std::mutex> lock(shared.mutex);
+				shared.done.notify_all();
+			}
+		}
+	};
+
+	for (int i = 0; i < helpers; i++) {
+		pool.post([state, work] { work(*state); });
+	}
+	work(*state);
+
+	std::unique_lock<std::mutex> lock(state->mutex);
+	state->done.wait(lock, [&] { return state->finished.load(std::memory_order_acquire) == count; });
+}
+
+/*
+
+Conversion Job
+Shared between the converter and the caller, written by the pipeline and read from anywhere.
+
+*/
+
+class ConversionJob {
+public:
+	// Pipeline side
+	void start(int64_t expectedFrames) {
+		totalFrames.store(expectedFrames, std::memory_order_relaxed);
+		framesDone.store(0, std::memory_order_relaxed);
+		startTime.store(now(), std::memory_order_relaxed);
+		std::lock_guard<std::mutex> lock(qualityMutex);
+		segments.clear();
+	}
+
+	void frameDone() {
+		framesDone.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// Sampled quality of one finished output segment, with inline metrics on
+	void segmentQuality(const metrics::Average& segment) {
+		std::lock_guard<std::mutex> lock(qualityMutex);
+		segments.push_back(segment);
+	}
+
+	// Caller side
+	void cancel() {
+		cancelRequested.store(true, std::memory_order_relaxed);
+	}
+
+	bool cancelled() const {
+		return cancelRequested.load(std::memory_order_relaxed);
+	}
+
+	int64_t frames() const {
+		return framesDone.load(std::memory_order_relaxed);
+	}
+
+	int64_t expectedFrames() const {
+		return totalFrames.load(std::memory_order_relaxed);
+	}
+
+	// Encoded frames per second since start
+	double fps() const {
+		const double elapsed = (now() - startTime.load(std::memory_order_relaxed)) / 1e9;
+		return elapsed > 0 ? frames() / elapsed : 0.0;
+	}
+
+	// Seconds left at the current rate, negative when unknown
+	double eta() const {
+		const int64_t total = expectedFrames();
+		const double rate = fps();
+		if (total <= 0 || rate <= 0) {
+			return -1.0;
+		}
+		return std::max<int64_t>(total - frames(), 0) / rate;
+	}
+
+	// Mean over every sampled frame of the finished segments, frames is 0 without samples
+	metrics::Average quality() const {
+		std::lock_guard<std::mutex> lock(qualityMutex);
+		metrics::Average total;
+		for (const metrics::Average& segment : segments) {
+			total.add(segment);
+		}
+		return total;
+	}
+
+	// One entry per output segment in encode order: a chunk in resumable mode, else the file
+	std::vector<metrics::Average> segmentQuality() const {
+		std::lock_guard<std::mutex> lock(qualityMutex);
+		return segments;
+	}
+
+private:
+	std::atomic<int64_t> framesDone{0};
+	std::atomic<int64_t> totalFrames{0};
+	std::atomic<int64_t> startTime{0};
+	std::atomic<bool> cancelRequested{false};
+	mutable std::mutex qualityMutex;
+	std::vector<metrics::Average> segments;
+
+	static int64_t now() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+};
+
+/*
+
+Run Awaitable
+Suspends the awaiting coroutine, runs `work` on the pool and resumes with its result.
+
+*/
+
+template <typename T>
+class RunAwaitable {
+public:
+	RunAwaitable(WorkerPool& pool, std::function<T()> work)
+		: pool(pool), work(std::move(work)) {}
+
+	bool await_ready() const noexcept {
+		return false;
+	}
+
+	void await_suspend(std::coroutine_handle<> awaiting) {
+		pool.post([this, awaiting] {
+			try {
+				result.emplace(work());
+			} catch (...) {
+				error = std::current_exception();
+			}
+			awaiting.resume();
+		});
+	}
+
+	T await_resume() {
+		if (error) {
+			std::rethrow_exception(error);
+		}
+		return std::move(*result);
+	}
+
+private:
+	WorkerPool& pool;
+	std::function<T()> work;
+	std::optional<T> result;
+	std::exception_ptr error;
+};
+
+/*
+
+Background
+Like RunAwaitable, but `work` is posted as soon as it is constructed rather than when
+awaited, so several of them run side by side. Awaiting one that already finished does
+not suspend.
+
+*/
+
+template <typename T>
+class Background {
+public:
+	Background(WorkerPool& pool, std::function<T()> work) : state(std::make_shared<State>()) {
+		// The task owns a reference, the awaitable may be gone before it ends
+		pool.post([state = state, work = std::move(work)] {
+			std::optional<T> result;
+			std::exception_ptr error;
+			try {
+				result.emplace(work());
+			} catch (...) {
+				error = std::current_exception();
+			}
+
+			std::coroutine_handle<> continuation;
+			{
+				std::lock_guard<std::mutex> lock(state->mutex);
+				state->result = std::move(result);
+				state->error = error;
+				state->finished = true;
+				continuation = state->continuation;
+			}
+			if (continuation) {
+				continuation.resume();
+			}
+		});
+	}
+
+	bool await_ready() const {
+		std::lock_guard<std::mutex> lock(state->mutex);
+		return state->finished;
+	}
+
+	// False resumes right away, the work finished between await_ready and here
+	bool await_suspend(std::coroutine_handle<> awaiting) {
+		std::lock_guard<std::mutex> lock(state->mutex);
+		if (state->finished) {
+			return false;
+		}
+		state->continuation = awaiting;
+		return true;
+	}
+
+	T await_resume() {
+		if (state->error) {
+			std::rethrow_exception(state->error);
+		}
+		return std::move(*state->result);
+	}
+
+private:
+	struct State {
+		std::mutex mutex;
+		bool finished = false;
+		std::optional<T> result;
+		std::exception_ptr error;
+		std::coroutine_handle<> continuation;
+	};
+
+	std::shared_ptr<State> state;
+};
+
+/*
+
+Task
+Lazy coroutine returning T, started when awaited or passed to syncWait.
+
+*/
+
+template <typename T>
+class Task {
+public:
+	struct promise_type {
+		std::optional<T> value;
+		std::exception_ptr error;
+		std::coroutine_handle<> continuation;
+
+		Task get_return_object() {
+			return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+
+		std::suspend_always initial_suspend() noexcept {
+			return {};
+		}
+
+		struct FinalAwaiter {
+			bool await_ready() const noexcept {
+				return false;
+			}
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+				if (handle.promise().continuation) {
+					return handle.promise().continuation;
+				}
+				return std::noop_coroutine();
+			}
+			void await_resume() noexcept {}
+		};
+
+		FinalAwaiter final_suspend() noexcept {
+			return {};
+		}
+
+		void return_value(T v) {
+			value.emplace(std::move(v));
+		}
+
+		void unhandled_exception() {
+			error = std::current_exception();
+		}
+	};
+
+	explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+	Task(Task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+	Task(const Task&) = delete;
+
+	~Task() {
+		if (handle) {
+			handle.destroy();
+		}
+	}
+
+	bool await_ready() const noexcept {
+		return false;
+	}
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) {
+		handle.promise().continuation = awaiting;
+		return handle;
+	}
+
+	T await_resume() {
+		return result();
+	}
+
+	// Starts the task and blocks the calling thread until it completes
+	friend T syncWait(Task task) {
+		std::mutex mutex;
+		std::condition_variable done;
+		bool finished = false;
+		std::optional<T> value;
+		std::exception_ptr error;
+
+		// Signals from inside await_suspend, so the waiter is already suspended when
+		// syncWait wakes up and destroys it
+		struct Signal {
+			std::mutex& mutex;
+			std::condition_variable& done;
+			bool& finished;
+
+			bool await_ready() const noexcept {
+				return false;
+			}
+			void await_suspend(std::coroutine_handle<>) noexcept {
+				std::lock_guard<std::mutex> lock(mutex);
+				finished = true;
+				done.notify_one();
+			}
+			void await_resume() noexcept {}
+		};
+
+		auto waiter = [&]() -> Task<bool> {
+			try {
+				value.emplace(co_await std::move(task));
+			} catch (...) {
+				error = std::current_exception();
+			}
+			co_await Signal{mutex, done, finished};
+			co_return true;
+		};
+
+		Task<bool> wrapper = waiter();
+		wrapper.handle.resume();
+
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [&] { return finished; });
+		lock.unlock();
+
+		if (error) {
+			std::rethrow_exception(error);
+		}
+		return std::move(*value);
+	}
+
+private:
+	template <typename> friend class Task;
+
+	std::coroutine_handle<promise_type> handle;
+
+	T result() {
+		if (handle.promise().error) {
+			std::rethrow_exception(handle.promise().error);
+		}
+		return std::move(*handle.promise().value);
+	}
+};
+
+} // namespace async
+
+#endif // ASYNC_HPP
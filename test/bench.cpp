@@ -0,0 +1,1137 @@
+/*
+
+g++ bench.cpp -o bench.app --std=c++20 -O2 -lavfilter -lavcodec -lavutil -lswscale
+
+Needs FFmpeg 6.1 or newer, like the converter.
+
+Benchmarks for the pixel path, in the spirit of Google Benchmark: every kernel is a
+registered case, all of them run by default and a substring on the command line picks
+a subset (./bench.app 1080p, ./bench.app tonemap, ./bench.app threads, ./bench.app buffers).
+
+For each source (4K, 1080p and 720p, landscape and phone portrait stored with a 90
+degree display rotation, and 8K, which shrinks past 2:1 onto the area filter) the
+1080x1920 output is produced by
+
+	native      geometry::Scaler, our scale + crop + rotation
+	swscale     sws_scale to the cover size as draft.cpp uses it, cropped by pointer offset
+	avfilter    transpose + scale + crop in a filter graph, the chain initFilters used to build
+
+and the 10-bit HDR output goes through tonemap::ToneMapper once per ISA variant the CPU
+has. Duplicate detection (dedup.hpp) is timed per source frame, SSIM and PSNR
+(metrics.hpp) per frame against a noisy copy. Frame buffer allocation is timed with
+av_frame_get_buffer and with the huge page arena (arena.hpp), page faults included. Every result is compared against a plain
+reference: bilinear sampling or, past 2:1, the area average computed from the orientation
+directly for the scaler, the
+full color math per pixel for the tone mapper, one loop per window for the metrics. Native kernels fail the check past their tolerance,
+the libraries use other filters and chroma siting so their difference is only reported.
+
+Encoders (./bench.app encoders, only when asked for, it takes minutes) encodes the same
+clip with every encoder in encoders.hpp at every speed and plots CPU-seconds against
+output size, to pick a codec and preset from measurements.
+
+Cycles are TSC ticks, which run at the nominal clock whatever the core does.
+
+*/
+
+extern "C" {
+	#include <libavcodec/avcodec.h>
+	#include <libavfilter/avfilter.h>
+	#include <libavfilter/buffersink.h>
+	#include <libavfilter/buffersrc.h>
+	#include <libavutil/frame.h>
+	#include <libavutil/mem.h>
+	#include <libavutil/pixdesc.h>
+	#include <libswscale/swscale.h>
+}
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <sys/resource.h>
+
+#include "arena.hpp"
+#include "async.hpp"
+#include "dedup.hpp"
+#include "encoders.hpp"
+#include "geometry.hpp"
+#include "handles.hpp"
+#include "metrics.hpp"
+#include "tonemap.hpp"
+
+/*
+
+Helpers
+
+*/
+
+using Frame = std::shared_ptr<AVFrame>;
+
+static Frame makeFrame(AVPixelFormat format, int width, int height) {
+	AVFrame* frame = av_frame_alloc();
+	frame->format = format;
+	frame->width = width;
+	frame->height = height;
+	if (av_frame_get_buffer(frame, 0) < 0) {
+		av_frame_free(&frame);
+		return nullptr;
+	}
+	return Frame(frame, [](AVFrame* f) { av_frame_free(&f); });
+}
+
+static int planeWidth(const AVFrame* frame, const AVPixFmtDescriptor* desc, int plane) {
+	return plane == 0 ? frame->width : -((-frame->width) >> desc->log2_chroma_w);
+}
+
+static int planeHeight(const AVFrame* frame, const AVPixFmtDescriptor* desc, int plane) {
+	return plane == 0 ? frame->height : -((-frame->height) >> desc->log2_chroma_h);
+}
+
+static int sample(const AVFrame* frame, int plane, int x, int y, bool wide) {
+	const uint8_t* row = frame->data[plane] + (ptrdiff_t)y * frame->linesize[plane];
+	return wide ? ((const uint16_t*)row)[x] : row[x];
+}
+
+// Deterministic content with detail in both directions, so a wrong tap shows up
+static void fillPattern(AVFrame* frame) {
+	const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+	const int bytes = desc->comp[0].depth > 8 ? 2 : 1;
+	const int maxValue = (1 << desc->comp[0].depth) - 1;
+	for (int plane = 0; plane < 3; plane++) {
+		const int width = planeWidth(frame, desc, plane);
+		const int height = planeHeight(frame, desc, plane);
+		for (int y = 0; y < height; y++) {
+			uint8_t* row = frame->data[plane] + (ptrdiff_t)y * frame->linesize[plane];
+			for (int x = 0; x < width; x++) {
+				const int value = ((x * 7 + y * 13 + plane * 31) ^ (x * y)) & maxValue;
+				if (bytes == 2) {
+					((uint16_t*)row)[x] = (uint16_t)value;
+				} else {
+					row[x] = (uint8_t)value;
+				}
+			}
+		}
+	}
+}
+
+// Smooth limited range content, like graded footage rather than noise. The 3D LUT is only
+// accurate where neighbouring grid nodes are, out of gamut corners are clipped hard.
+static void fillGradient(AVFrame* frame) {
+	const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+	const int shift = desc->comp[0].depth - 8;
+	for (int plane = 0; plane < 3; plane++) {
+		const int width = planeWidth(frame, desc, plane);
+		const int height = planeHeight(frame, desc, plane);
+		for (int y = 0; y < height; y++) {
+			uint8_t* row = frame->data[plane] + (ptrdiff_t)y * frame->linesize[plane];
+			for (int x = 0; x < width; x++) {
+				int value;
+				if (plane == 0) {
+					value = 16 + 219 * x / std::max(width - 1, 1);
+				} else {
+					const double angle = 6.2832 * (plane == 1 ? x : y) / (plane == 1 ? width : height);
+					value = 128 + (int)std::lround(48 * std::sin(angle));
+				}
+				value <<= shift;
+				if (shift > 0) {
+					((uint16_t*)row)[x] = (uint16_t)value;
+				} else {
+					row[x] = (uint8_t)value;
+				}
+			}
+		}
+	}
+}
+
+// Per-sample difference over all planes, max is -1 when the frames do not match in shape
+struct Difference {
+	int max = -1;
+	double mean = 0;
+
+	std::string describe() const {
+		char text[64];
+		snprintf(text, sizeof(text), "max diff %d, mean %.2f", max, mean);
+		return max < 0 ? "shape differs" : text;
+	}
+};
+
+static Difference difference(const AVFrame* a, const AVFrame* b) {
+	Difference result;
+	if (a->format != b->format || a->width != b->width || a->height != b->height) {
+		return result;
+	}
+	const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)a->format);
+	const bool wide = desc->comp[0].depth > 8;
+	int64_t total = 0, count = 0;
+	result.max = 0;
+	for (int plane = 0; plane < 3; plane++) {
+		for (int y = 0; y < planeHeight(a, desc, plane); y++) {
+			for (int x = 0; x < planeWidth(a, desc, plane); x++) {
+				const int delta = std::abs(sample(a, plane, x, y, wide) - sample(b, plane, x, y, wide));
+				result.max = std::max(result.max, delta);
+				total += delta;
+				count++;
+			}
+		}
+	}
+	result.mean = count ? (double)total / count : 0;
+	return result;
+}
+
+static bool samePixels(const AVFrame* a, const AVFrame* b) {
+	return difference(a, b).max == 0;
+}
+
+static uint64_t cycleCounter() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+struct Timing {
+	double seconds = 0;   // Per call
+	double cycles = 0;    // Per call, 0 where there is no counter
+};
+
+// Runs fn until at least minSeconds have passed
+template <typename Fn>
+static Timing measure(Fn&& fn, double minSeconds = 0.5) {
+	fn();  // Warm up caches and lazily built tables
+	int iterations = 0;
+	const auto start = std::chrono::steady_clock::now();
+	const uint64_t startCycles = cycleCounter();
+	double elapsed = 0;
+	do {
+		fn();
+		iterations++;
+		elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	} while (elapsed < minSeconds);
+	return {elapsed / iterations, (double)(cycleCounter() - startCycles) / iterations};
+}
+
+/*
+
+Reference Scaler
+What geometry::Scaler computes, written the obvious way: for every output sample find its
+position in the displayed picture, turn that back into the stored frame and sample it
+bilinearly in double precision. A plane that shrinks past 2:1 on either axis instead
+averages the source pixels under the output pixel, on each axis past 2:1, weighted by
+how much of them it covers. Shares nothing with the scaler but the definition.
+
+*/
+
+// Source pixels under [start, end) with their weights: the bilinear pair at the center
+// up to 2 pixels, every covered pixel past that
+static std::vector<std::pair<int, double>> referenceFootprint(double start, double end, int size, bool area) {
+	std::vector<std::pair<int, double>> weights;
+	if (!area || end - start <= 2) {
+		const double p = std::clamp((start + end) / 2 - 0.5, 0.0, (double)(size - 1));
+		const int p0 = (int)p;
+		const int p1 = std::min(p0 + 1, size - 1);
+		weights.push_back({p0, 1 - (p - p0)});
+		weights.push_back({p1, p - p0});
+		return weights;
+	}
+	for (int i = (int)start; i < end; i++) {
+		const double covered = std::min(end, i + 1.0) - std::max(start, (double)i);
+		weights.push_back({std::min(i, size - 1), covered / (end - start)});
+	}
+	return weights;
+}
+
+static void referenceScale(const AVFrame* in, const geometry::Transform& transform, AVFrame* out) {
+	const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)in->format);
+	const bool wide = desc->comp[0].depth > 8;
+	const double displayWidth = transform.swapsAxes() ? in->height : in->width;
+	const double displayHeight = transform.swapsAxes() ? in->width : in->height;
+	const double scale = std::max(out->width / displayWidth, out->height / displayHeight);
+	const double cropX = (displayWidth * scale - out->width) / 2;
+	const double cropY = (displayHeight * scale - out->height) / 2;
+
+	for (int plane = 0; plane < 3; plane++) {
+		const int srcWidth = planeWidth(in, desc, plane);
+		const int srcHeight = planeHeight(in, desc, plane);
+		const int width = plane == 0 ? out->width : (out->width + 1) / 2;
+		const int height = plane == 0 ? out->height : (out->height + 1) / 2;
+
+		// Stored pixels per output pixel along the stored axes
+		const double stepX = srcWidth / (transform.swapsAxes() ? displayHeight * scale * height / out->height
+		                                                       : displayWidth * scale * width / out->width);
+		const double stepY = srcHeight / (transform.swapsAxes() ? displayWidth * scale * width / out->width
+		                                                        : displayHeight * scale * height / out->height);
+		const bool area = stepX > 2 || stepY > 2;
+
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++) {
+				// Normalized display edges of the output pixel
+				double u0 = (cropX + x * out->width / (double)width) / (displayWidth * scale);
+				double u1 = (cropX + (x + 1) * out->width / (double)width) / (displayWidth * scale);
+				const double v0 = (cropY + y * out->height / (double)height) / (displayHeight * scale);
+				const double v1 = (cropY + (y + 1) * out->height / (double)height) / (displayHeight * scale);
+				if (transform.hflip) {
+					u0 = 1 - u0;
+					u1 = 1 - u1;
+				}
+
+				// Undo the clockwise rotation
+				double s0 = u0, s1 = u1, t0 = v0, t1 = v1;
+				if (transform.rotation == 90) {
+					s0 = v0, s1 = v1;
+					t0 = 1 - u0, t1 = 1 - u1;
+				} else if (transform.rotation == 180) {
+					s0 = 1 - u0, s1 = 1 - u1;
+					t0 = 1 - v0, t1 = 1 - v1;
+				} else if (transform.rotation == 270) {
+					s0 = 1 - v0, s1 = 1 - v1;
+					t0 = u0, t1 = u1;
+				}
+
+				const auto columns = referenceFootprint(std::min(s0, s1) * srcWidth, std::max(s0, s1) * srcWidth, srcWidth, area);
+				const auto rows = referenceFootprint(std::min(t0, t1) * srcHeight, std::max(t0, t1) * srcHeight, srcHeight, area);
+				double sum = 0;
+				for (const auto& row : rows) {
+					for (const auto& column : columns) {
+						sum += sample(in, plane, column.first, row.first, wide) * column.second * row.second;
+					}
+				}
+				const int value = (int)std::lround(sum);
+
+				uint8_t* row = out->data[plane] + (ptrdiff_t)y * out->linesize[plane];
+				if (wide) {
+					((uint16_t*)row)[x] = (uint16_t)value;
+				} else {
+					row[x] = (uint8_t)value;
+				}
+			}
+		}
+	}
+}
+
+/*
+
+Registry
+
+*/
+
+struct Benchmark {
+	std::string name;
+	std::string variant;       // ISA or library
+	int64_t pixels = 0;        // Output pixels per call
+	std::function<bool()> setup;         // false when the variant is not available here
+	std::function<void()> run;
+	std::function<std::string()> check;  // Against the reference, after the timed runs
+};
+
+static std::vector<Benchmark>& registry() {
+	static std::vector<Benchmark> benchmarks;
+	return benchmarks;
+}
+
+struct ScaleCase {
+	const char* name;
+	int width;
+	int height;
+	AVPixelFormat format;
+	geometry::Transform transform;
+};
+
+static const int OutputWidth = 1080;
+static const int OutputHeight = 1920;
+
+static const ScaleCase ScaleCases[] = {
+	{"4k landscape", 3840, 2160, AV_PIX_FMT_YUV420P, {0, false}},
+	{"4k portrait", 3840, 2160, AV_PIX_FMT_YUV420P, {90, false}},
+	{"4k hdr portrait", 3840, 2160, AV_PIX_FMT_YUV420P10LE, {90, false}},
+	{"1080p landscape", 1920, 1080, AV_PIX_FMT_YUV420P, {0, false}},
+	{"1080p portrait", 1920, 1080, AV_PIX_FMT_YUV420P, {90, false}},
+	{"720p landscape", 1280, 720, AV_PIX_FMT_YUV420P, {0, false}},
+	{"720p portrait", 1280, 720, AV_PIX_FMT_YUV420P, {90, false}},
+	{"8k landscape", 7680, 4320, AV_PIX_FMT_YUV420P, {0, false}},
+	{"8k portrait", 7680, 4320, AV_PIX_FMT_YUV420P, {90, false}},
+};
+
+// Source and reference shared by the variants of one case, built on first use
+struct ScaleFixture {
+	ScaleCase test;
+	Frame in;
+	Frame reference;
+	int tolerance = 0;
+
+	bool prepare() {
+		if (reference) {
+			return true;
+		}
+		const AVPixelFormat outputFormat = geometry::Scaler::highBitDepth(test.format) ? AV_PIX_FMT_YUV420P10LE : AV_PIX_FMT_YUV420P;
+		in = makeFrame(test.format, test.width, test.height);
+		Frame out = makeFrame(outputFormat, OutputWidth, OutputHeight);
+		if (!in || !out) {
+			return false;
+		}
+		fillPattern(in.get());
+		referenceScale(in.get(), test.transform, out.get());
+		reference = out;
+
+		// 8-bit tap weights put each axis up to half a step of the pattern off, plus rounding
+		tolerance = 2 << (av_pix_fmt_desc_get(test.format)->comp[0].depth - 8);
+		return true;
+	}
+
+	std::string compare(const AVFrame* out, bool enforce) const {
+		const Difference result = difference(reference.get(), out);
+		std::string text = result.describe();
+		if (enforce) {
+			text += result.max >= 0 && result.max <= tolerance ? " ok" : " FAIL (tolerance " + std::to_string(tolerance) + ")";
+		}
+		return text;
+	}
+};
+
+static void registerNativeScaler(const std::shared_ptr<ScaleFixture>& fixture) {
+	struct State {
+		geometry::Scaler scaler;
+		Frame out;
+	};
+	auto state = std::make_shared<State>();
+	registry().push_back({
+		std::string("scale ") + fixture->test.name, "native", (int64_t)OutputWidth * OutputHeight,
+		[=] {
+			const ScaleCase& test = fixture->test;
+			if (!fixture->prepare() ||
+			    !state->scaler.configure(test.width, test.height, test.format, test.transform, OutputWidth, OutputHeight)) {
+				return false;
+			}
+			state->out = makeFrame(state->scaler.outputFormat(), OutputWidth, OutputHeight);
+			return state->out != nullptr;
+		},
+		[=] { state->scaler.process(fixture->in.get(), state->out.get()); },
+		[=] { return fixture->compare(state->out.get(), true); },
+	});
+}
+
+// Cover size of the displayed picture, even so the crop stays on chroma boundaries
+static std::pair<int, int> coverSize(int displayWidth, int displayHeight) {
+	const double scale = std::max((double)OutputWidth / displayWidth, (double)OutputHeight / displayHeight);
+	return {std::max(OutputWidth, (int)std::lround(displayWidth * scale / 2) * 2),
+	        std::max(OutputHeight, (int)std::lround(displayHeight * scale / 2) * 2)};
+}
+
+// What the crop filter does: no copy, the planes are offset into the full frame
+static void cropView(const AVFrame* full, int x, int y, AVFrame* view) {
+	const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)full->format);
+	const int bytes = desc->comp[0].depth > 8 ? 2 : 1;
+	view->format = full->format;
+	view->width = OutputWidth;
+	view->height = OutputHeight;
+	for (int plane = 0; plane < 3; plane++) {
+		const int px = plane == 0 ? x : x >> desc->log2_chroma_w;
+		const int py = plane == 0 ? y : y >> desc->log2_chroma_h;
+		view->data[plane] = full->data[plane] + (ptrdiff_t)py * full->linesize[plane] + px * bytes;
+		view->linesize[plane] = full->linesize[plane];
+	}
+}
+
+static void registerSwscale(const std::shared_ptr<ScaleFixture>& fixture) {
+	// swscale does not rotate, a portrait source would need a transpose pass first
+	if (!fixture->test.transform.identity()) {
+		return;
+	}
+	struct State {
+		SwsContext* context = nullptr;
+		Frame scaled;
+		AVFrame view = {};
+		~State() {
+			sws_freeContext(context);
+		}
+	};
+	auto state = std::make_shared<State>();
+	registry().push_back({
+		std::string("scale ") + fixture->test.name, "swscale", (int64_t)OutputWidth * OutputHeight,
+		[=] {
+			if (!fixture->prepare()) {
+				return false;
+			}
+			const ScaleCase& test = fixture->test;
+			const auto cover = coverSize(test.width, test.height);
+			state->scaled = makeFrame(test.format, cover.first, cover.second);
+			state->context = sws_getContext(test.width, test.height, test.format, cover.first, cover.second, test.format,
+			                                SWS_BILINEAR, nullptr, nullptr, nullptr);
+			if (!state->scaled || !state->context) {
+				return false;
+			}
+			cropView(state->scaled.get(), ((cover.first - OutputWidth) / 2) & ~1, ((cover.second - OutputHeight) / 2) & ~1, &state->view);
+			return true;
+		},
+		[=] {
+			const AVFrame* in = fixture->in.get();
+			AVFrame* scaled = state->scaled.get();
+			sws_scale(state->context, in->data, in->linesize, 0, in->height, scaled->data, scaled->linesize);
+		},
+		[=] { return fixture->compare(&state->view, false); },
+	});
+}
+
+static void registerFilterGraph(const std::shared_ptr<ScaleFixture>& fixture) {
+	struct State {
+		AVFilterGraph* graph = nullptr;
+		AVFilterContext* source = nullptr;
+		AVFilterContext* sink = nullptr;
+		Frame out;
+		~State() {
+			avfilter_graph_free(&graph);
+		}
+	};
+	auto state = std::make_shared<State>();
+	registry().push_back({
+		std::string("scale ") + fixture->test.name, "avfilter", (int64_t)OutputWidth * OutputHeight,
+		[=] {
+			if (!fixture->prepare()) {
+				return false;
+			}
+			const ScaleCase& test = fixture->test;
+			state->graph = avfilter_graph_alloc();
+			AVFrame* frame = av_frame_alloc();
+			state->out = Frame(frame, [](AVFrame* f) { av_frame_free(&f); });
+			if (!state->graph || !frame) {
+				return false;
+			}
+
+			char args[512];
+			snprintf(args, sizeof(args), "video_size=%dx%d:pix_fmt=%d:time_base=1/30:pixel_aspect=1/1",
+			         test.width, test.height, test.format);
+			if (avfilter_graph_create_filter(&state->source, avfilter_get_by_name("buffer"), "in", args, nullptr, state->graph) < 0 ||
+			    avfilter_graph_create_filter(&state->sink, avfilter_get_by_name("buffersink"), "out", nullptr, nullptr, state->graph) < 0) {
+				return false;
+			}
+
+			// Autorotate inserts the transpose, the scale covers the output like the native scaler
+			const char* rotate = test.transform.rotation == 90 ? "transpose=clock," : "";
+			snprintf(args, sizeof(args), "%sscale=%d:%d:force_original_aspect_ratio=increase:flags=bilinear,crop=%d:%d",
+			         rotate, OutputWidth, OutputHeight, OutputWidth, OutputHeight);
+
+			AVFilterInOut* outputs = avfilter_inout_alloc();
+			AVFilterInOut* inputs = avfilter_inout_alloc();
+			if (!outputs || !inputs) {
+				avfilter_inout_free(&outputs);
+				avfilter_inout_free(&inputs);
+				return false;
+			}
+			outputs->name = av_strdup("in");
+			outputs->filter_ctx = state->source;
+			inputs->name = av_strdup("out");
+			inputs->filter_ctx = state->sink;
+			const int parsed = avfilter_graph_parse_ptr(state->graph, args, &inputs, &outputs, nullptr);
+			avfilter_inout_free(&outputs);
+			avfilter_inout_free(&inputs);
+			return parsed >= 0 && avfilter_graph_config(state->graph, nullptr) >= 0;
+		},
+		[=] {
+			av_frame_unref(state->out.get());
+			av_buffersrc_add_frame_flags(state->source, fixture->in.get(), AV_BUFFERSRC_FLAG_KEEP_REF);
+			av_buffersink_get_frame(state->sink, state->out.get());
+		},
+		[=] { return fixture->compare(state->out.get(), false); },
+	});
+}
+
+/*
+
+Tone Mapper
+A 10-bit frame at output size mapped down to 8 bits once per ISA variant.
+
+*/
+
+struct ToneMapCase {
+	const char* name;
+	tonemap::Source source;
+};
+
+static void registerToneMap(const ToneMapCase& test, tonemap::Isa isa) {
+	struct State {
+		tonemap::ToneMapper mapper;
+		Frame in;
+		Frame out;
+	};
+	auto state = std::make_shared<State>();
+	registry().push_back({
+		std::string("tonemap ") + test.name, tonemap::isaName(isa), (int64_t)OutputWidth * OutputHeight,
+		[=] {
+			state->mapper.configure(test.source);
+			if (!state->mapper.setIsa(isa)) {
+				return false;
+			}
+			state->in = makeFrame(AV_PIX_FMT_YUV420P10LE, OutputWidth, OutputHeight);
+			state->out = makeFrame(AV_PIX_FMT_YUV420P, OutputWidth, OutputHeight);
+			if (!state->in || !state->out) {
+				return false;
+			}
+			fillGradient(state->in.get());
+			return true;
+		},
+		[=] { state->mapper.process(state->in.get(), state->out.get()); },
+		[=] {
+			// Every variant must match the scalar kernel exactly. Against the exact math the LUT is
+			// close on average but clips differently at the gamut boundary, where single samples
+			// can be tens of codes off, so only the mean is held to a bound.
+			Frame scalarOut = makeFrame(AV_PIX_FMT_YUV420P, OutputWidth, OutputHeight);
+			Frame reference = makeFrame(AV_PIX_FMT_YUV420P, OutputWidth, OutputHeight);
+			tonemap::ToneMapper scalar = state->mapper;
+			scalar.setIsa(tonemap::Isa::Scalar);
+			scalar.process(state->in.get(), scalarOut.get());
+			state->mapper.reference(state->in.get(), reference.get());
+
+			const Difference result = difference(reference.get(), state->out.get());
+			const bool exact = samePixels(scalarOut.get(), state->out.get());
+			const double tolerance = 2;
+			return result.describe() + (exact ? ", = scalar" : ", != scalar") +
+			       (exact && result.max >= 0 && result.mean <= tolerance ? " ok" : " FAIL");
+		},
+	});
+}
+
+/*
+
+Duplicate Detection
+Signature of a source frame plus the comparison with the last kept one, what every
+frame costs with duplicate dropping on. Checked against 4x4 means summed the plain way.
+
+*/
+
+static void registerDedup(const ScaleCase& test) {
+	struct State {
+		Frame in;
+		dedup::Signature kept;
+		dedup::Signature current;
+		double difference = 0;
+	};
+	auto state = std::make_shared<State>();
+	registry().push_back({
+		std::string("dedup ") + test.name, "sse2", (int64_t)test.width * test.height,
+		[=] {
+			state->in = makeFrame(test.format, test.width, test.height);
+			if (!state->in) {
+				return false;
+			}
+			fillPattern(state->in.get());
+			state->kept.compute(state->in.get());
+			return true;
+		},
+		[=] {
+			state->current.compute(state->in.get());
+			state->difference = dedup::maxBlockDifference(state->kept, state->current);
+		},
+		[=] {
+			const AVFrame* in = state->in.get();
+			const bool wide = test.format == AV_PIX_FMT_YUV420P10LE;
+			const int shift = wide ? 2 : 0;
+			int mismatches = 0;
+			for (int y = 0; y < state->current.height; y++) {
+				for (int x = 0; x < state->current.width; x++) {
+					int sum = 0;
+					for (int i = 0; i < 4; i++) {
+						for (int j = 0; j < 4; j++) {
+							sum += sample(in, 0, x * 4 + j, y * 4 + i, wide);
+						}
+					}
+					const int mean = std::min(255, (sum + (8 << shift)) >> (4 + shift));
+					mismatches += state->current.means[(size_t)y * state->current.width + x] != mean;
+				}
+			}
+			const bool ok = mismatches == 0 && state->difference == 0;
+			return std::to_string(mismatches) + " mismatched means" + (ok ? " ok" : " FAIL");
+		},
+	});
+}
+
+// SSIM and PSNR of a frame against a copy with small noise, as an encode would leave it
+static void registerMetrics(int width, int height, const char* name) {
+	struct State {
+		Frame a;
+		Frame b;
+		metrics::Score score;
+	};
+	auto state = std::make_shared<State>();
+	registry().push_back({
+		std::string("metrics ") + name, "sse2", (int64_t)width * height,
+		[=] {
+			state->a = makeFrame(AV_PIX_FMT_YUV420P, width, height);
+			state->b = makeFrame(AV_PIX_FMT_YUV420P, width, height);
+			if (!state->a || !state->b) {
+				return false;
+			}
+			fillPattern(state->a.get());
+			uint32_t seed = 1;
+			for (int plane = 0; plane < 3; plane++) {
+				const int planeW = plane ? (width + 1) / 2 : width;
+				const int planeH = plane ? (height + 1) / 2 : height;
+				for (int y = 0; y < planeH; y++) {
+					const uint8_t* in = state->a->data[plane] + (ptrdiff_t)y * state->a->linesize[plane];
+					uint8_t* out = state->b->data[plane] + (ptrdiff_t)y * state->b->linesize[plane];
+					for (int x = 0; x < planeW; x++) {
+						seed = seed * 1664525 + 1013904223;
+						out[x] = (uint8_t)std::clamp(in[x] + (int)(seed >> 29) - 3, 0, 255);
+					}
+				}
+			}
+			return true;
+		},
+		[=] {
+			state->score = metrics::compare(state->a.get(), state->b.get());
+		},
+		[=] {
+			// Every 8x8 window summed directly, in steps of 4
+			const int64_t c1 = (int64_t)(.01 * .01 * 255 * 255 * 64 + .5);
+			const int64_t c2 = (int64_t)(.03 * .03 * 255 * 255 * 64 * 63 + .5);
+			double ssim = 0;
+			int64_t windows = 0;
+			uint64_t error = 0;
+			int64_t samples = 0;
+			for (int plane = 0; plane < 3; plane++) {
+				const int planeW = plane ? (width + 1) / 2 : width;
+				const int planeH = plane ? (height + 1) / 2 : height;
+				for (int y = 0; y < planeH; y++) {
+					for (int x = 0; x < planeW; x++) {
+						const int d = sample(state->a.get(), plane, x, y, false) - sample(state->b.get(), plane, x, y, false);
+						error += d * d;
+						samples++;
+					}
+				}
+				for (int y = 0; y + 8 <= planeH / 4 * 4; y += 4) {
+					for (int x = 0; x + 8 <= planeW / 4 * 4; x += 4) {
+						int64_t sa = 0, sb = 0, squares = 0, cross = 0;
+						for (int i = 0; i < 8; i++) {
+							for (int j = 0; j < 8; j++) {
+								const int64_t pa = sample(state->a.get(), plane, x + j, y + i, false);
+								const int64_t pb = sample(state->b.get(), plane, x + j, y + i, false);
+								sa += pa;
+								sb += pb;
+								squares += pa * pa + pb * pb;
+								cross += pa * pb;
+							}
+						}
+						const int64_t variance = squares * 64 - sa * sa - sb * sb;
+						const int64_t covariance = cross * 64 - sa * sb;
+						ssim += (double)(2 * sa * sb + c1) * (double)(2 * covariance + c2) /
+						        ((double)(sa * sa + sb * sb + c1) * (double)(variance + c2));
+						windows++;
+					}
+				}
+			}
+			const double psnr = metrics::psnrFromMse((double)error / samples);
+			ssim /= windows;
+			const bool ok = std::fabs(psnr - state->score.psnr) < 1e-9 && std::fabs(ssim - state->score.ssim) < 1e-9;
+			char text[96];
+			snprintf(text, sizeof(text), "ssim %.6f psnr %.2f dB%s", state->score.ssim, state->score.psnr, ok ? " ok" : " FAIL");
+			return std::string(text);
+		},
+	});
+}
+
+static void registerAll() {
+	for (const ScaleCase& test : ScaleCases) {
+		auto fixture = std::make_shared<ScaleFixture>();
+		fixture->test = test;
+		registerNativeScaler(fixture);
+		registerSwscale(fixture);
+		registerFilterGraph(fixture);
+	}
+
+	const ToneMapCase toneMapCases[] = {
+		{"pq 1000 nits", {tonemap::Transfer::PQ, true, 1000}},
+		{"hlg", {tonemap::Transfer::HLG, true, 1000}},
+	};
+	for (const ToneMapCase& test : toneMapCases) {
+		registerToneMap(test, tonemap::Isa::Scalar);
+		registerToneMap(test, tonemap::Isa::Avx2);
+	}
+
+	registerDedup(ScaleCases[0]);
+	registerDedup(ScaleCases[2]);
+	registerDedup(ScaleCases[3]);
+
+	registerMetrics(OutputWidth, OutputHeight, "1080x1920");
+	registerMetrics(OutputWidth / 3 & ~1, OutputHeight / 3 & ~1, "preview");
+}
+
+static bool runBenchmarks(const std::string& filter) {
+	printf("\nkernels, output %dx%d\n", OutputWidth, OutputHeight);
+	printf("%-26s %-9s %10s %10s %10s  %s\n", "benchmark", "variant", "ms/frame", "Mpx/s", "cycles/px", "check");
+
+	bool passed = true;
+	for (Benchmark& benchmark : registry()) {
+		const std::string label = benchmark.name + " " + benchmark.variant;
+		if (!filter.empty() && label.find(filter) == std::string::npos) {
+			continue;
+		}
+		if (!benchmark.setup()) {
+			printf("%-26s %-9s %10s\n", benchmark.name.c_str(), benchmark.variant.c_str(), "unavailable");
+			continue;
+		}
+		const Timing timing = measure(benchmark.run);
+		const std::string check = benchmark.check();
+		passed = passed && check.find("FAIL") == std::string::npos;
+		printf("%-26s %-9s %10.2f %10.1f %10.2f  %s\n", benchmark.name.c_str(), benchmark.variant.c_str(),
+		       timing.seconds * 1e3, benchmark.pixels / timing.seconds / 1e6, timing.cycles / benchmark.pixels, check.c_str());
+	}
+	return passed;
+}
+
+/*
+
+Slice-Parallel Scaling
+The same frame scaled in 1, 2, 4, ... bands on a pool, every result compared against
+the single-threaded output.
+
+*/
+
+static bool benchScaleThreads() {
+	const ScaleCase cases[] = {ScaleCases[0], ScaleCases[1], ScaleCases[2], ScaleCases[3]};
+
+	// Up to 8 threads even on smaller machines, past the hardware count it shows the overhead
+	const unsigned hardware = std::max(1u, std::thread::hardware_concurrency());
+	const unsigned maxThreads = std::max(8u, hardware);
+	async::WorkerPool pool(maxThreads);
+
+	printf("\nslice-parallel scaling to %dx%d, %u hardware threads\n", OutputWidth, OutputHeight, hardware);
+	printf("%-26s %8s %10s %10s %8s %s\n", "case", "threads", "ms/frame", "Mpx/s", "speedup", "identical");
+
+	bool passed = true;
+	for (const ScaleCase& test : cases) {
+		Frame in = makeFrame(test.format, test.width, test.height);
+		fillPattern(in.get());
+
+		geometry::Scaler scaler;
+		scaler.configure(test.width, test.height, test.format, test.transform, OutputWidth, OutputHeight);
+		Frame reference = makeFrame(scaler.outputFormat(), OutputWidth, OutputHeight);
+		Frame out = makeFrame(scaler.outputFormat(), OutputWidth, OutputHeight);
+		scaler.process(in.get(), reference.get());
+
+		double single = 0;
+		for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+			const int bands = (int)threads;
+			const double seconds = measure([&] {
+				async::parallelFor(pool, bands, [&](int i) {
+					const auto rows = geometry::Scaler::band(OutputHeight, i, bands);
+					scaler.process(in.get(), out.get(), rows.first, rows.second);
+				}, bands - 1);
+			}).seconds;
+			if (threads == 1) {
+				single = seconds;
+			}
+			const bool identical = samePixels(reference.get(), out.get());
+			passed = passed && identical;
+			printf("%-26s %8u %10.2f %10.1f %7.2fx %s\n", test.name, threads, seconds * 1e3,
+			       (double)OutputWidth * OutputHeight / seconds / 1e6, single / seconds, identical ? "yes" : "NO");
+		}
+	}
+	return passed;
+}
+
+/*
+
+Frame Buffers
+Output frames as the converter allocates them: a fresh frame per output frame with
+Depth of them in flight, like the encoder's lookahead, every row written once and the
+oldest released. Minor page faults come from getrusage and include the first frames,
+which is where a short job pays for fresh memory.
+
+*/
+
+static bool benchFrameBuffers() {
+	struct Case {
+		const char* name;
+		int width;
+		int height;
+	};
+	const Case cases[] = {{"1080x1920", OutputWidth, OutputHeight}, {"3840x2160", 3840, 2160}};
+	const int Depth = 8;
+	const int Frames = 240;
+
+	printf("\nframe buffers, %d in flight, %d frames\n", Depth, Frames);
+	printf("%-26s %-14s %10s %10s %12s %10s %s\n", "case", "allocator", "ms/frame", "fps", "faults/frame", "mapped MB", "pages");
+
+	for (const Case& test : cases) {
+		for (int variant = 0; variant < 3; variant++) {
+			std::unique_ptr<arena::Arena> pool;
+			if (variant > 0) {
+				arena::Options options;
+				options.explicitHugePages = variant == 2;
+				pool = std::make_unique<arena::Arena>(options);
+			}
+			auto allocate = [&]() -> Frame {
+				if (!pool) {
+					return makeFrame(AV_PIX_FMT_YUV420P, test.width, test.height);
+				}
+				AVFrame* frame = av_frame_alloc();
+				frame->format = AV_PIX_FMT_YUV420P;
+				frame->width = test.width;
+				frame->height = test.height;
+				if (!pool->allocate(frame)) {
+					av_frame_free(&frame);
+					return nullptr;
+				}
+				return Frame(frame, [](AVFrame* f) { av_frame_free(&f); });
+			};
+
+			std::vector<Frame> inFlight(Depth);
+			rusage before;
+			getrusage(RUSAGE_SELF, &before);
+			const auto start = std::chrono::steady_clock::now();
+			for (int i = 0; i < Frames; i++) {
+				Frame frame = allocate();
+				if (!frame) {
+					printf("%-26s %-14s %10s\n", test.name, "arena", "failed");
+					return false;
+				}
+				for (int plane = 0; plane < 3; plane++) {
+					const int rows = plane ? (test.height + 1) / 2 : test.height;
+					const int bytes = plane ? (test.width + 1) / 2 : test.width;
+					for (int y = 0; y < rows; y++) {
+						memset(frame->data[plane] + (ptrdiff_t)y * frame->linesize[plane], (uint8_t)i, bytes);
+					}
+				}
+				inFlight[i % Depth] = std::move(frame);
+			}
+			const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			rusage after;
+			getrusage(RUSAGE_SELF, &after);
+			inFlight.clear();
+
+			const char* names[] = {"av_malloc", "arena thp", "arena hugetlb"};
+			const arena::Stats stats = pool ? pool->stats() : arena::Stats();
+			const char* pages = !pool ? "4k" : stats.explicitHugePages ? "hugetlb" : "thp";
+			printf("%-26s %-14s %10.3f %10.0f %12.1f %10.1f %s\n", test.name, names[variant], seconds / Frames * 1e3,
+			       Frames / seconds, (double)(after.ru_minflt - before.ru_minflt) / Frames, stats.mappedBytes / 1048576.0, pages);
+		}
+	}
+	return true;
+}
+
+/*
+
+Encoders
+A synthetic clip, detail panning under a moving block, encoded at Quality::Medium with
+every encoder and speed. CPU-seconds are user plus system time of the whole process
+during the encode, every encoder thread included, so the numbers hold whatever the
+thread count; the packets are decoded and scored afterwards, outside the measurement.
+Encoders FFmpeg was built without are skipped.
+
+*/
+
+struct EncodeResult {
+	std::string label;
+	std::string native;
+	double cpuSeconds = 0;
+	double wallSeconds = 0;
+	int64_t bytes = 0;
+	metrics::Average quality;
+};
+
+static double cpuSeconds() {
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static void fillClip(AVFrame* frame, int index) {
+	for (int plane = 0; plane < 3; plane++) {
+		const int width = plane ? (frame->width + 1) / 2 : frame->width;
+		const int height = plane ? (frame->height + 1) / 2 : frame->height;
+		const int scale = plane ? 2 : 1;
+		for (int y = 0; y < height; y++) {
+			uint8_t* row = frame->data[plane] + (ptrdiff_t)y * frame->linesize[plane];
+			for (int x = 0; x < width; x++) {
+				const int px = x * scale + index * 3;
+				const int py = y * scale + index;
+				int value = plane ? 128 + ((px + py) >> 4) % 32 - 16 : 64 + (py >> 3) % 64 + (((px * 7) ^ (py * 5)) & 31);
+				const int block = frame->width / 4;
+				const int bx = (index * 8) % (frame->width - block);
+				if (!plane && x >= bx && x < bx + block && y >= frame->height / 3 && y < frame->height / 3 + block) {
+					value = 220 - ((x - bx) & 15);
+				}
+				row[x] = (uint8_t)std::clamp(value, 0, 255);
+			}
+		}
+	}
+}
+
+static bool encodeClip(const encoders::Info& info, Speed speed, const std::vector<Frame>& clip, int frameRate,
+                       EncodeResult& result) {
+	const AVCodec* encoder = avcodec_find_encoder_by_name(info.encoder);
+	const AVCodec* decoder = encoder ? avcodec_find_decoder(encoder->id) : nullptr;
+	handles::CodecContext encodeCtx(encoder ? avcodec_alloc_context3(encoder) : nullptr);
+	handles::Packet packet = handles::allocPacket();
+	if (!encodeCtx || !packet) {
+		return false;
+	}
+	encodeCtx->width = clip[0]->width;
+	encodeCtx->height = clip[0]->height;
+	encodeCtx->pix_fmt = AV_PIX_FMT_YUV420P;
+	encodeCtx->time_base = {1, frameRate};
+	encodeCtx->thread_count = (int)std::max(1u, std::thread::hardware_concurrency());
+
+	encoders::Options options;
+	options.crf = encoders::crf(info, encoders::Quality::Medium);
+	options.speed = speed;
+	if (!encoders::configure(encodeCtx, options, &result.native) || avcodec_open2(encodeCtx, encoder, nullptr) < 0) {
+		return false;
+	}
+
+	std::vector<handles::Packet> packets;
+	auto drain = [&] {
+		while (avcodec_receive_packet(encodeCtx, packet) >= 0) {
+			result.bytes += packet->size;
+			packets.emplace_back(av_packet_clone(packet));
+			av_packet_unref(packet);
+		}
+	};
+	const double cpuStart = cpuSeconds();
+	const auto wallStart = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < clip.size(); i++) {
+		clip[i]->pts = (int64_t)i;
+		if (avcodec_send_frame(encodeCtx, clip[i].get()) < 0) {
+			return false;
+		}
+		drain();
+	}
+	avcodec_send_frame(encodeCtx, nullptr);
+	drain();
+	result.cpuSeconds = cpuSeconds() - cpuStart;
+	result.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+
+	// Decoded frames come out in order, scored against the clip
+	handles::CodecContext decodeCtx(decoder ? avcodec_alloc_context3(decoder) : nullptr);
+	handles::Frame decoded = handles::allocFrame();
+	if (!decodeCtx || !decoded || avcodec_open2(decodeCtx, decoder, nullptr) < 0) {
+		return true;  // Size and time still stand
+	}
+	size_t compared = 0;
+	auto receive = [&] {
+		while (avcodec_receive_frame(decodeCtx, decoded) >= 0) {
+			if (compared < clip.size()) {
+				result.quality.add(metrics::compare(clip[compared++].get(), decoded));
+			}
+			av_frame_unref(decoded);
+		}
+	};
+	for (const handles::Packet& encoded : packets) {
+		avcodec_send_packet(decodeCtx, encoded);
+		receive();
+	}
+	avcodec_send_packet(decodeCtx, nullptr);
+	receive();
+	return true;
+}
+
+// Log scale CPU-seconds across, size up, one mark per encode: the encoder's first letter
+// and the speed, 0 slowest to 4 fastest
+static void plotEncodes(const std::vector<EncodeResult>& results) {
+	const int Columns = 64;
+	const int Rows = 16;
+	double minCpu = 1e30, maxCpu = 0;
+	int64_t minBytes = INT64_MAX, maxBytes = 0;
+	for (const EncodeResult& result : results) {
+		minCpu = std::min(minCpu, std::max(1e-3, result.cpuSeconds));
+		maxCpu = std::max(maxCpu, std::max(1e-3, result.cpuSeconds));
+		minBytes = std::min(minBytes, result.bytes);
+		maxBytes = std::max(maxBytes, result.bytes);
+	}
+	if (results.empty()) {
+		return;
+	}
+	const double cpuSpan = std::max(1e-9, std::log10(maxCpu) - std::log10(minCpu));
+	const double byteSpan = (double)std::max<int64_t>(1, maxBytes - minBytes);
+
+	std::vector<std::string> grid(Rows, std::string(Columns + 2, ' '));
+	for (const EncodeResult& result : results) {
+		const int column = (int)std::lround((std::log10(std::max(1e-3, result.cpuSeconds)) - std::log10(minCpu)) / cpuSpan * (Columns - 1));
+		const int row = Rows - 1 - (int)std::lround((result.bytes - minBytes) / byteSpan * (Rows - 1));
+		grid[row][column] = result.label[0];
+		grid[row][column + 1] = result.label.back();
+	}
+
+	printf("\n%10.1f kB |\n", maxBytes / 1e3);
+	for (const std::string& line : grid) {
+		printf("%13s |%s\n", "", line.c_str());
+	}
+	printf("%10.1f kB +%s\n", minBytes / 1e3, std::string(Columns + 2, '-').c_str());
+	printf("%15s%-*.2f%.2f CPU-seconds, log scale\n", "", Columns - 4, minCpu, maxCpu);
+}
+
+static bool benchEncoders() {
+	const int Width = OutputWidth / 2;
+	const int Height = OutputHeight / 2;
+	const int Frames = 60;
+	const int FrameRate = 30;
+
+	std::vector<Frame> clip;
+	for (int i = 0; i < Frames; i++) {
+		Frame frame = makeFrame(AV_PIX_FMT_YUV420P, Width, Height);
+		if (!frame) {
+			return false;
+		}
+		fillClip(frame.get(), i);
+		clip.push_back(frame);
+	}
+
+	printf("\nencoders, %dx%d, %d frames at %d fps, quality medium, %u threads\n", Width, Height, Frames, FrameRate,
+	       std::max(1u, std::thread::hardware_concurrency()));
+	printf("%-6s %-8s %-34s %9s %8s %8s %10s %9s %9s\n", "mark", "speed", "native", "cpu s", "wall s", "fps", "kB", "kb/s", "ssim dB");
+
+	bool passed = true;
+	std::vector<EncodeResult> results;
+	for (const encoders::Info& info : encoders::Backends) {
+		if (!avcodec_find_encoder_by_name(info.encoder)) {
+			printf("%-6s %s not available in this FFmpeg build\n", info.name, info.encoder);
+			continue;
+		}
+		for (int speed = (int)Speed::Slowest; speed <= (int)Speed::Fastest; speed++) {
+			EncodeResult result;
+			result.label = std::string(1, info.name[0]) + std::to_string(speed);
+			if (!encodeClip(info, (Speed)speed, clip, FrameRate, result)) {
+				printf("%-6s %-8s %s failed\n", result.label.c_str(), speedName((Speed)speed), info.encoder);
+				passed = false;
+				continue;
+			}
+			const double kbps = result.bytes * 8.0 / Frames * FrameRate / 1000;
+			const std::string ssim = result.quality.frames > 0 ? std::to_string(result.quality.mean().ssimDb()).substr(0, 5) : "-";
+			printf("%-6s %-8s %-34s %9.2f %8.2f %8.1f %10.1f %9.0f %9s\n", result.label.c_str(), speedName((Speed)speed),
+			       result.native.c_str(), result.cpuSeconds, result.wallSeconds, Frames / result.wallSeconds,
+			       result.bytes / 1e3, kbps, ssim.c_str());
+			results.push_back(result);
+		}
+	}
+	plotEncodes(results);
+	return passed;
+}
+
+// ./bench.app [filter], exits non-zero when a check fails
+int main(int argc, char* argv[]) {
+	const std::string filter = argc > 1 ? argv[1] : "";
+	registerAll();
+
+	bool passed = runBenchmarks(filter);
+	if (filter.empty() || std::string("threads").find(filter) != std::string::npos) {
+		passed = benchScaleThreads() && passed;
+	}
+	if (filter.empty() || std::string("buffers").find(filter) != std::string::npos) {
+		passed = benchFrameBuffers() && passed;
+	}
+	if (filter == "encoders") {
+		passed = benchEncoders() && passed;
+	}
+	return passed ? 0 : 1;
+}
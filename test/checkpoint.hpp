@@ -0,0 +1,153 @@
+#ifndef CHECKPOINT_HPP
+#define CHECKPOINT_HPP
+
+/*
+
+Checkpoint
+Manifest of the chunks a resumable conversion has finished so far.
+
+Lives in the work directory next to the chunk files and is rewritten atomically
+(temp file + rename) every time a chunk is completed, so after a crash it always
+describes chunks that are fully written:
+
+	video-converter-manifest 1
+	input input.mov
+	fingerprint 73400320:1716283172
+	settings codec=libvpx-vp9;crf=20;bitrate=1000000;speed=fast;vf=scale=1080:-1,crop=1080:1920,fps=29;scaler=bilinear-area-autorotate;dedup=off
+	chunk 0 0 290 0 120120 chunk.00000.webm 9f1c0e4d2b7a6a01
+	chunk 1 290 580 120120 240240 chunk.00001.webm 03be55c1d9e8f712
+	complete
+
+A chunk line is: index, first and end (exclusive) output pts in the encoder time base,
+the source keyframe pts the chunk starts at and the keyframe it was cut at in the
+input stream time base (AV_NOPTS_VALUE for the last chunk), the chunk file and the
+hash of the source packets it was encoded from (see incremental.hpp).
+
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+namespace checkpoint {
+
+struct Chunk {
+	int index = 0;
+	int64_t startPts = 0;     // First encoded frame, encoder time base
+	int64_t endPts = 0;       // Exclusive, encoder time base
+	int64_t sourceStart = 0;  // Source keyframe the chunk starts at, input stream time base
+	int64_t sourceEnd = 0;    // Source keyframe of the next chunk, input stream time base
+	std::string file;         // Relative to the work directory
+	uint64_t sourceHash = 0;  // Source packets in [sourceStart, sourceEnd)
+};
+
+class Manifest {
+public:
+	std::string input;
+	std::string fingerprint;
+	std::string settings;     // OutputSettings::normalized() the chunks were encoded with
+	std::vector<Chunk> chunks;
+	bool complete = false;
+
+	static std::string fileName() {
+		return "manifest.txt";
+	}
+
+	static std::string chunkFileName(int index, const std::string& extension) {
+		char name[64];
+		snprintf(name, sizeof(name), "chunk.%05d%s", index, extension.c_str());
+		return name;
+	}
+
+	// Cheap identity of the input, a changed file invalidates the checkpoint
+	static std::string fingerprintOf(const std::string& path) {
+		std::error_code error;
+		auto size = std::filesystem::file_size(path, error);
+		if (error) {
+			return "";
+		}
+		auto modified = std::filesystem::last_write_time(path, error);
+		if (error) {
+			return "";
+		}
+		return std::to_string(size) + ":" + std::to_string(modified.time_since_epoch().count());
+	}
+
+	bool load(const std::string& workDir) {
+		std::ifstream file(std::filesystem::path(workDir) / fileName());
+		if (!file) {
+			return false;
+		}
+
+		std::string line;
+		if (!std::getline(file, line) || line != "video-converter-manifest 1") {
+			return false;
+		}
+
+		chunks.clear();
+		complete = false;
+		while (std::getline(file, line)) {
+			std::istringstream fields(line);
+			std::string key;
+			fields >> key;
+			if (key == "input") {
+				std::getline(fields >> std::ws, input);
+			} else if (key == "fingerprint") {
+				fields >> fingerprint;
+			} else if (key == "settings") {
+				std::getline(fields >> std::ws, settings);
+			} else if (key == "chunk") {
+				Chunk chunk;
+				fields >> chunk.index >> chunk.startPts >> chunk.endPts >> chunk.sourceStart >> chunk.sourceEnd >> chunk.file;
+				if (!fields || chunk.index != (int)chunks.size()) {
+					return false;
+				}
+				fields >> std::hex >> chunk.sourceHash;
+				chunks.push_back(chunk);
+			} else if (key == "complete") {
+				complete = true;
+			}
+		}
+		return true;
+	}
+
+	bool save(const std::string& workDir) const {
+		const std::filesystem::path dir(workDir);
+		const std::filesystem::path temp = dir / (fileName() + ".tmp");
+		{
+			std::ofstream file(temp, std::ios::trunc);
+			if (!file) {
+				return false;
+			}
+			file << "video-converter-manifest 1\n";
+			file << "input " << input << "\n";
+			file << "fingerprint " << fingerprint << "\n";
+			file << "settings " << settings << "\n";
+			for (const Chunk& chunk : chunks) {
+				file << "chunk " << chunk.index << " " << chunk.startPts << " " << chunk.endPts << " "
+				     << chunk.sourceStart << " " << chunk.sourceEnd << " " << chunk.file << " "
+				     << std::hex << chunk.sourceHash << std::dec << "\n";
+			}
+			if (complete) {
+				file << "complete\n";
+			}
+			file.flush();
+			if (!file) {
+				return false;
+			}
+		}
+
+		std::error_code error;
+		std::filesystem::rename(temp, dir / fileName(), error);
+		return !error;
+	}
+};
+
+} // namespace checkpoint
+
+#endif // CHECKPOINT_HPP
@@ -0,0 +1,229 @@
+#ifndef DEDUP_HPP
+#define DEDUP_HPP
+
+/*
+
+Dedup
+Finds frames that look the same as the last one we kept, so screen recordings and
+slideshows do not spend encoder time on a picture that did not change.
+
+Every frame is reduced to a signature, the mean of each 4x4 block of luma: 1/16 of the
+plane, and averaging 16 samples hides most of the noise a lossy source adds to a still
+picture. Two signatures are compared in blocks of 8x8 signature samples, 32x32 source
+pixels, by their sum of absolute differences. A frame is a duplicate when no block moved
+by more than the threshold on average per sample, so a moving mouse pointer still counts
+as a change however small it is against the whole frame.
+
+Frames are compared against the last kept frame, not the previous one, so a slow fade
+adds up until it is kept. Both the signature and the SAD use SSE2 on x86.
+
+*/
+
+extern "C" {
+	#include <libavutil/frame.h>
+	#include <libavutil/pixdesc.h>
+}
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <emmintrin.h>
+#define DEDUP_SSE2 1
+#endif
+
+namespace dedup {
+
+/*
+
+Signature
+Mean of every 4x4 block of luma, 8-bit whatever the source depth. Partial blocks at the
+right and bottom edge are left out.
+
+*/
+
+struct Signature {
+	static constexpr int Block = 4;
+
+	int width = 0;
+	int height = 0;
+	std::vector<uint8_t> means;
+
+	bool empty() const {
+		return means.empty();
+	}
+
+	void clear() {
+		width = 0;
+		height = 0;
+		means.clear();
+	}
+
+	void compute(const AVFrame* frame) {
+		const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+		const bool wide = desc && desc->comp[0].depth > 8;
+		const int shift = wide ? desc->comp[0].depth - 8 : 0;
+		width = frame->width / Block;
+		height = frame->height / Block;
+		means.resize((size_t)width * height);
+
+		for (int y = 0; y < height; y++) {
+			const uint8_t* rows[Block];
+			for (int i = 0; i < Block; i++) {
+				rows[i] = frame->data[0] + (ptrdiff_t)(y * Block + i) * frame->linesize[0];
+			}
+			uint8_t* out = means.data() + (size_t)y * width;
+			int x = 0;
+			if (!wide) {
+#ifdef DEDUP_SSE2
+				x = rowSse2(rows, out, width);
+#endif
+				for (; x < width; x++) {
+					int sum = 0;
+					for (int i = 0; i < Block; i++) {
+						for (int j = 0; j < Block; j++) {
+							sum += rows[i][x * Block + j];
+						}
+					}
+					out[x] = (uint8_t)((sum + 8) >> 4);
+				}
+			} else {
+				for (; x < width; x++) {
+					int sum = 0;
+					for (int i = 0; i < Block; i++) {
+						const uint16_t* row = (const uint16_t*)rows[i];
+						for (int j = 0; j < Block; j++) {
+							sum += row[x * Block + j];
+						}
+					}
+					out[x] = (uint8_t)std::min(255, (sum + (8 << shift)) >> (4 + shift));
+				}
+			}
+		}
+	}
+
+private:
+#ifdef DEDUP_SSE2
+	// Four output means per 16 source columns, returns how many it did
+	static int rowSse2(const uint8_t* const rows[Block], uint8_t* out, int width) {
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i ones = _mm_set1_epi16(1);
+		const __m128i round = _mm_set1_epi32(8);
+		int x = 0;
+		for (; x + 4 <= width; x += 4) {
+			__m128i low = zero, high = zero;
+			for (int i = 0; i < Block; i++) {
+				const __m128i pixels = _mm_loadu_si128((const __m128i*)(rows[i] + x * Block));
+				low = _mm_add_epi16(low, _mm_unpacklo_epi8(pixels, zero));
+				high = _mm_add_epi16(high, _mm_unpackhi_epi8(pixels, zero));
+			}
+			// Column sums of four rows, added in pairs and then pairs of pairs
+			const __m128i pairs = _mm_packs_epi32(_mm_madd_epi16(low, ones), _mm_madd_epi16(high, ones));
+			const __m128i sums = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(pairs, ones), round), 4);
+			const __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(sums, zero), zero);
+			const int packed = _mm_cvtsi128_si32(bytes);
+			std::copy((const uint8_t*)&packed, (const uint8_t*)&packed + 4, out + x);
+		}
+		return x;
+	}
+#endif
+};
+
+/*
+
+Compare
+Largest mean absolute difference per sample over the 8x8 blocks of two signatures of
+the same size.
+
+*/
+
+static constexpr int CompareBlock = 8;
+
+inline int blockSad(const uint8_t* a, const uint8_t* b, int stride, int width, int height) {
+	int sad = 0;
+	int y = 0;
+#ifdef DEDUP_SSE2
+	if (width == CompareBlock) {
+		__m128i sum = _mm_setzero_si128();
+		for (; y < height; y++) {
+			const __m128i rowA = _mm_loadl_epi64((const __m128i*)(a + (ptrdiff_t)y * stride));
+			const __m128i rowB = _mm_loadl_epi64((const __m128i*)(b + (ptrdiff_t)y * stride));
+			sum = _mm_add_epi64(sum, _mm_sad_epu8(rowA, rowB));
+		}
+		sad = _mm_cvtsi128_si32(sum);
+	}
+#endif
+	for (; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			sad += std::abs(a[(ptrdiff_t)y * stride + x] - b[(ptrdiff_t)y * stride + x]);
+		}
+	}
+	return sad;
+}
+
+inline double maxBlockDifference(const Signature& a, const Signature& b) {
+	double largest = 0;
+	for (int y = 0; y < a.height; y += CompareBlock) {
+		const int height = std::min(CompareBlock, a.height - y);
+		for (int x = 0; x < a.width; x += CompareBlock) {
+			const int width = std::min(CompareBlock, a.width - x);
+			const size_t offset = (size_t)y * a.width + x;
+			const int sad = blockSad(a.means.data() + offset, b.means.data() + offset, a.width, width, height);
+			largest = std::max(largest, (double)sad / (width * height));
+		}
+	}
+	return largest;
+}
+
+/*
+
+Detector
+threshold is the mean absolute difference per signature sample, in 8-bit codes, that a
+32x32 block may change by and still count as the same picture. maxRun caps how many
+frames in a row are dropped, so the output still gets a frame every so often.
+
+*/
+
+class Detector {
+public:
+	Detector(int threshold, int64_t maxRun) : threshold(threshold), maxRun(maxRun) {}
+
+	// True when the frame can be dropped, otherwise it becomes the frame the next ones are compared with
+	bool duplicate(const AVFrame* frame) {
+		current.compute(frame);
+		if (!kept.empty() && run < maxRun && current.width == kept.width && current.height == kept.height &&
+		    maxBlockDifference(kept, current) <= threshold) {
+			run++;
+			dropped++;
+			return true;
+		}
+		std::swap(kept, current);
+		run = 0;
+		return false;
+	}
+
+	// The next frame is kept whatever it looks like
+	void reset() {
+		kept.clear();
+		run = 0;
+	}
+
+	int64_t droppedFrames() const {
+		return dropped;
+	}
+
+private:
+	int threshold;
+	int64_t maxRun;
+	int64_t run = 0;
+	int64_t dropped = 0;
+	Signature kept;
+	Signature current;
+};
+
+} // namespace dedup
+
+#endif // DEDUP_HPP
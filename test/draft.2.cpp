@@ -19,11 +19,13 @@ extern "C" {
 #include <string>
 #include <stdexcept>
 
+#include "encoders.hpp"
+#include "handles.hpp"
+
 class Converter {
 public:
 	Converter(const std::string& inputFilePath, const std::string& outputFilePath)
-		: inputFilePath(inputFilePath), outputFilePath(outputFilePath), crf(20), cpuUsage(6), threadCount(6),
-		  inputFormatContext(nullptr), videoDecoderContext(nullptr), audioDecoderContext(nullptr),
+		: inputFilePath(inputFilePath), outputFilePath(outputFilePath), crf(20), speed(Speed::Fast), threadCount(6),
 		  videoStreamIndex(-1), audioStreamIndex(-1) {
 		init();
 	}
@@ -52,8 +54,8 @@ public:
 		// audioEncCtx->bit_rate = avutil_parse_bitrate(audioBitrate.c_str());
 	}
 	
-	void setCpuUsage(int usage) {
-		cpuUsage = usage;
+	void setSpeed(Speed speed) {
+		this->speed = speed;
 	}
 	
 	void setThreads(int threadCount) {
@@ -61,36 +63,36 @@ public:
 	}
 	
 	void convert() {
-		AVPacket *packet = av_packet_alloc();
+		handles::Packet packet = handles::allocPacket();
 		if (!packet)
 			throw std::runtime_error("Failed to allocate packet.");
 
-		AVFrame *frame = av_frame_alloc();
+		handles::Frame frame = handles::allocFrame();
 		if (!frame)
 			throw std::runtime_error("Failed to allocate frame.");
 
-		AVFrame *filt_frame = av_frame_alloc();
+		handles::Frame filt_frame = handles::allocFrame();
 		if (!filt_frame)
 			throw std::runtime_error("Failed to allocate filtered frame.");
 
 		int ret;
 		// Open output file
-		AVFormatContext *outputFormatContext = nullptr;
-		avformat_alloc_output_context2(&outputFormatContext, nullptr, nullptr, outputFilePath.c_str());
+		handles::OutputFormat outputFormatContext;
+		avformat_alloc_output_context2(outputFormatContext.address(), nullptr, nullptr, outputFilePath.c_str());
 		if (!outputFormatContext)
 			throw std::runtime_error("Could not create output format context.");
 
 		// Create and open the codec contexts for the encoder
-		AVCodec *videoEncoder = avcodec_find_encoder_by_name(videoCodec.c_str());
-		AVCodec *audioEncoder = avcodec_find_encoder_by_name(audioCodec.c_str());
+		const AVCodec *videoEncoder = avcodec_find_encoder_by_name(videoCodec.c_str());
+		const AVCodec *audioEncoder = avcodec_find_encoder_by_name(audioCodec.c_str());
 
 		if (!videoEncoder)
 			throw std::runtime_error("Video encoder not found.");
 		if (!audioEncoder)
 			throw std::runtime_error("Audio encoder not found.");
 
-		AVCodecContext *videoEncCtx = avcodec_alloc_context3(videoEncoder);
-		AVCodecContext *audioEncCtx = avcodec_alloc_context3(audioEncoder);
+		handles::CodecContext videoEncCtx(avcodec_alloc_context3(videoEncoder));
+		handles::CodecContext audioEncCtx(avcodec_alloc_context3(audioEncoder));
 		if (!videoEncCtx || !audioEncCtx)
 			throw std::runtime_error("Failed to allocate codec contexts.");
 
@@ -102,13 +104,19 @@ public:
 		videoEncCtx->framerate = av_guess_frame_rate(inputFormatContext, inputFormatContext->streams[videoStreamIndex], nullptr);
 		videoEncCtx->time_base = av_inv_q(videoEncCtx->framerate);
 		videoEncCtx->pix_fmt = videoEncoder->pix_fmts[0];
-		videoEncCtx->bit_rate = std::stoi(videoBitrate);
+		// crf and bitrate cap in the encoder's own options, any of libvpx-vp9, libx264, libsvtav1
+		encoders::Options videoOptions;
+		videoOptions.crf = crf;
+		videoOptions.maxBitrate = parseBitrate(videoBitrate);
+		videoOptions.speed = speed;
+		if (!encoders::configure(videoEncCtx, videoOptions))
+			throw std::runtime_error("No encoder backend for " + videoCodec + ".");
 
 		audioEncCtx->sample_rate = audioDecoderContext->sample_rate;
-		audioEncCtx->channel_layout = audioDecoderContext->channel_layout;
-		audioEncCtx->channels = av_get_channel_layout_nb_channels(audioEncCtx->channel_layout);
+		if (av_channel_layout_copy(&audioEncCtx->ch_layout, &audioDecoderContext->ch_layout) < 0)
+			throw std::runtime_error("Failed to copy the audio channel layout.");
 		audioEncCtx->sample_fmt = audioEncoder->sample_fmts[0];
-		audioEncCtx->bit_rate = std::stoi(audioBitrate);
+		audioEncCtx->bit_rate = parseBitrate(audioBitrate);
 		// audioEncCtx->bit_rate = avutil_parse_bitrate(audioBitrate.c_str());
 
 		audioEncCtx->time_base = { 1, audioEncCtx->sample_rate };
@@ -161,35 +169,8 @@ public:
 		if (av_write_trailer(outputFormatContext) < 0)
 			throw std::runtime_error("Error writing AV trailer to output file.");
 
-		// Cleanup local allocs
-		av_packet_free(&packet);
-		av_frame_free(&frame);
-		av_frame_free(&filt_frame);
-
-	    // Close input and output codecs
-	    avcodec_close(videoDecoderContext);
-	    avcodec_close(audioDecoderContext);
-	    avcodec_close(videoEncCtx);
-	    avcodec_close(audioEncCtx);
-
-	    // Close input and output files
-	    if (inputFormatContext) {
-	        avformat_close_input(&inputFormatContext);
-	    }
-	    if (outputFormatContext && !(outputFormatContext->oformat->flags & AVFMT_NOFILE)) {
-	        avio_closep(&outputFormatContext->pb);
-	    }
-
-	    // Free the context
-	    avformat_free_context(outputFormatContext);
-
-	    // Final cleanup
-	    avcodec_free_context(&videoEncCtx);
-	    avcodec_free_context(&audioEncCtx);
-	}
-	
-	~Converter() {
-		cleanup();
+		// The handles close the output file and free the encoders, packet and frames, here
+		// or when any of the checks above throws. The input and decoders go with the Converter.
 	}
 
 private:
@@ -201,23 +182,37 @@ private:
 	std::string videoBitrate;
 	std::string audioCodec;
 	std::string audioBitrate;
-	int cpuUsage;
+	Speed speed;
 	int threadCount;
 
-	AVFormatContext* inputFormatContext;
-	AVCodecContext* videoDecoderContext;
-	AVCodecContext* audioDecoderContext;
-	AVCodec* videoDecoder;
-	AVCodec* audioDecoder;
+	handles::InputFormat inputFormatContext;
+	handles::CodecContext videoDecoderContext;
+	handles::CodecContext audioDecoderContext;
+	const AVCodec* videoDecoder;
+	const AVCodec* audioDecoder;
 	int videoStreamIndex;
 	int audioStreamIndex;
 
+	// Bits per second from "128000", "1000k" or "2.5M", like ffmpeg's -b
+	static int64_t parseBitrate(const std::string& bitrate) {
+		size_t end = 0;
+		const double value = std::stod(bitrate, &end);
+		const std::string suffix = bitrate.substr(end);
+		if (suffix == "k" || suffix == "K")
+			return (int64_t)(value * 1000);
+		if (suffix == "M")
+			return (int64_t)(value * 1000000);
+		if (!suffix.empty())
+			throw std::runtime_error("Bad bitrate " + bitrate + ".");
+		return (int64_t)value;
+	}
+
 	void init() {
 		// Initialize FFmpeg library
 		avformat_network_init();
 
 		// Open input file and allocate format context
-		if (avformat_open_input(&inputFormatContext, inputFilePath.c_str(), nullptr, nullptr) < 0) {
+		if (avformat_open_input(inputFormatContext.address(), inputFilePath.c_str(), nullptr, nullptr) < 0) {
 			throw std::runtime_error("Could not open input file.");
 		}
 
@@ -242,11 +237,11 @@ private:
 		}
 
 		// Allocate codec contexts
-		videoDecoderContext = avcodec_alloc_context3(videoDecoder);
+		videoDecoderContext.reset(avcodec_alloc_context3(videoDecoder));
 		if (!videoDecoderContext) {
 			throw std::runtime_error("Could not allocate video codec context.");
 		}
-		audioDecoderContext = avcodec_alloc_context3(audioDecoder);
+		audioDecoderContext.reset(avcodec_alloc_context3(audioDecoder));
 		if (!audioDecoderContext) {
 			throw std::runtime_error("Could not allocate audio codec context.");
 		}
@@ -268,24 +263,6 @@ private:
 			throw std::runtime_error("Could not open audio decoder.");
 		}
 	}
-	
-	void cleanup() {
-		// Close the codec contexts if they have been opened
-	    if (videoDecoderContext) {
-	        avcodec_free_context(&videoDecoderContext);
-	    }
-	    if (audioDecoderContext) {
-	        avcodec_free_context(&audioDecoderContext);
-	    }
-
-	    // Close the format context
-	    if (inputFormatContext) {
-	        avformat_close_input(&inputFormatContext);
-	    }
-
-	    // Free the format context itself
-	    avformat_free_context(inputFormatContext);
-	}
 };
 
 
@@ -308,9 +285,9 @@ int main(int argc, char* argv[]) {
         converter.setVideoCodec("libvpx-vp9", 20, "1000k");
         converter.setAudioCodec("libvorbis", "128000");
 
-        // Set additional processing settings like video filter, CPU usage, and thread count
+        // Set additional processing settings like video filter, speed preset, and thread count
         converter.setVideoFilter("scale=1080:-1, crop=1080:1920, fps=29");
-        converter.setCpuUsage(6);
+        converter.setSpeed(Speed::Fast);
         converter.setThreads(6);
 
         // Perform the conversion
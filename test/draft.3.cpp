@@ -8,6 +8,7 @@ extern "C" {
 	#include <libavformat/avformat.h>
 	#include <libavfilter/avfilter.h>
 	#include <libavutil/avutil.h>
+	#include <libavutil/imgutils.h>
 	#include <libavutil/opt.h>
 	#include <libswscale/swscale.h>
 	#include <libswresample/swresample.h>
@@ -15,7 +16,43 @@ extern "C" {
 	#include <libavfilter/buffersink.h>
 }
 
+// FFmpeg 6.1 or newer: stream side data is read from codecpar->coded_side_data, and
+// frames carry AVFrame::duration
+#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(60, 31, 102)
+#error "FFmpeg 6.1 or newer is required"
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <optional>
 #include <string>
+#include <vector>
+
+#include "logger.hpp"
+#include "async.hpp"
+#include "checkpoint.hpp"
+#include "dedup.hpp"
+#include "scenes.hpp"
+#include "settings.hpp"
+#include "result_cache.hpp"
+#include "frame_cache.hpp"
+#include "incremental.hpp"
+#include "thumbnails.hpp"
+#include "tensors.hpp"
+#include "geometry.hpp"
+#include "tonemap.hpp"
+#include "formats.hpp"
+#include "quality.hpp"
+#include "seeking.hpp"
+#include "memory.hpp"
+#include "arena.hpp"
+#include "placement.hpp"
+#include "handles.hpp"
+#include "encoders.hpp"
 
 class VideoConverter {
 public:
@@ -27,50 +64,267 @@ public:
 	bool configureFilters();
 	bool performConversion();
 
+	// Target quality mode: settings.crf from trial encodes when settings.targetSsim is set
+	bool chooseCrf();
+
 	bool flushEncoder();
     bool finalizeOutputFile();
     void cleanupFFmpeg();
 
+	// Whole conversion, blocking
+	bool convert();
+
+	// Whole conversion on the shared worker pool: `co_await converter.run(job)`
+	async::RunAwaitable<bool> run(async::ConversionJob& job);
+
+	// Same, but started right away so it runs next to other work until awaited
+	async::Background<bool> start(async::ConversionJob& job);
+
+	// Resumable mode: encode keyframe-aligned chunks of about chunkSeconds into workDir,
+	// pick up after the last completed chunk on restart and assemble the output at the end
+	void setResumable(const std::string& workDir, int chunkSeconds = 10);
+
+	// Convert only [startSeconds, endSeconds) of the source, a negative end means to the end
+	void setSourceRange(double startSeconds, double endSeconds = -1);
+
+	// Trims stream-copy the whole source GOPs inside the range and encode only the partial
+	// GOPs at its edges, when the source already has the output's codec, size, pixel format
+	// and frame rate. On by default, the copied part keeps the source's quality.
+	void setStreamCopy(bool enabled) { streamCopy = enabled; }
+
+	// Resumable mode only: reuse the chunks of an earlier conversion of the same source in
+	// previousWorkDir and re-encode just the parts of the range they do not cover
+	void setIncremental(const std::string& previousWorkDir);
+
+	// Poster, thumbnails and sprite sheet from the frames the conversion decodes anyway
+	void setSideOutputs(const thumbnails::Options& options) { sideOutputOptions = options; }
+
+	// Sampled upright frames as RGB tensors in a shared-memory ring for a local consumer,
+	// see tensors.hpp. Taken from the same decode.
+	void setTensorExport(const tensors::Options& options) { tensorOptions = options; }
+
+	void setSettings(const OutputSettings& outputSettings) { requested = outputSettings; settings = outputSettings; }
+	const OutputSettings& getSettings() const { return requested; }
+
+	// Skip the conversion when the same input bytes were already converted with the same settings
+	void setResultCache(cache::ResultCache* resultCache) { this->resultCache = resultCache; }
+
+	// Keep the encoder-ready frames of this source, or encode from them when an earlier run
+	// with the same frame settings kept them. Whole-file conversions without side outputs
+	// or tensor export only.
+	void setFrameCache(cache::FrameCache* frameCache) { this->frameCache = frameCache; }
+
+	// Decoded and scaled frames from a per-job huge page arena instead of av_malloc, see
+	// arena.hpp. Output bytes are the same.
+	void setFrameArena(const arena::Options& options) { arenaOptions = options; }
+
+	// Run each conversion on one NUMA node, the one with the fewest jobs, see placement.hpp.
+	// Implies a frame arena bound to that node.
+	void setNumaPlacement(bool enabled) { numaPlacement = enabled; }
+
+	// Bands each frame is scaled in on the shared worker pool, 0 for one per pool thread.
+	// The output is the same for any value.
+	void setScaleThreads(int threads) { scaleThreads = threads; }
+
+	// Score every interval-th encoded frame against its decoded output while encoding, see
+	// quality::Monitor. Per segment and per job SSIM/PSNR land in the job, 0 turns it off.
+	void setQualityMetrics(int interval) { qualityInterval = interval; }
+
+	// Output times in seconds of the keyframes placed at scene cuts, for segmenters and
+	// chunked encoders to split at. Filled while encoding with settings.sceneThreshold >= 0.
+	const std::vector<double>& sceneCuts() const { return cutList; }
+
+	// Most frames each stage held at once during the last conversion, see memory.hpp
+	const memory::Usage& memoryUsage() const { return usage; }
+
+	void setJobId(uint64_t id) { jobId = id; }
+	uint64_t getJobId() const { return jobId; }
+
 private:
 	std::string inputFilename;
 	std::string outputFilename;
 
-	AVFormatContext* inputFormatCtx = nullptr;
-	AVFormatContext* outputFormatCtx = nullptr;
-	AVCodecContext* inputCodecCtx = nullptr;
-	AVCodecContext* outputCodecCtx = nullptr;
-	AVFilterGraph* filterGraph = nullptr;
+	// Logging context, every record carries the job and the current frame
+	uint64_t jobId;
+	int64_t frameNumber = 0;
+
+	// Progress and cancellation, set while running through run()
+	async::ConversionJob* job = nullptr;
+
+	// As set by the caller, and this job's copy of them, which chooseCrf may change.
+	// Keys and manifests use the requested ones, so a searched crf does not leak into them.
+	OutputSettings requested;
+	OutputSettings settings;
+	cache::ResultCache* resultCache = nullptr;
+
+	// Frame cache, either a hit to replay or the entry this run writes
+	cache::FrameCache* frameCache = nullptr;
+	std::string frameCacheKey;
+	std::unique_ptr<cache::FrameReader> cachedFrames;
+	std::unique_ptr<cache::FrameWriter> frameWriter;
+	int videoStreamIndex = -1;
+
+	// Owned, freed by the handles whichever way the conversion ends, see handles.hpp
+	handles::InputFormat inputFormatCtx;
+	handles::OutputFormat outputFormatCtx;
+	handles::CodecContext inputCodecCtx;
+	handles::CodecContext outputCodecCtx;
+	handles::FilterGraph filterGraph;
+
+	// Fast start reservation of outputFormatCtx, see seeking.hpp
+	seeking::FrontIndex frontIndex;
 
 	AVFilterContext* buffersrc_ctx = nullptr;
     AVFilterContext* buffersink_ctx = nullptr;
 
+	// Scale, crop and display rotation after the filter graph, see geometry.hpp
+	geometry::Transform orientation;
+	geometry::Scaler scaler;
+	int scaleThreads = 0;
+
+	// 10-bit sources are scaled at 10 bits into wideFrame and tone mapped down to 8
+	tonemap::Source colorSource;
+	tonemap::ToneMapper toneMapper;
+	handles::Frame wideFrame;
+
+	// Pixel format of every stage, decided once in configureInput
+	formats::Plan pixelPlan;
+	handles::Frame nativeFrame;                // Our output when the encoder wants another format
+	handles::Sws encoderSws;
+
+	// Resumable mode
+	std::string workDir;
+	int chunkSeconds = 10;
+	checkpoint::Manifest manifest;
+	int64_t chunkStartPts = AV_NOPTS_VALUE;    // Encoder time base
+	int64_t chunkSourceStart = AV_NOPTS_VALUE; // Input stream time base
+	int64_t cutPts = AV_NOPTS_VALUE;           // Next chunk boundary, encoder time base
+	int64_t cutSourcePts = AV_NOPTS_VALUE;     // Source keyframe at that boundary
+	int64_t resumePts = AV_NOPTS_VALUE;        // Frames before it are in completed chunks
+	int64_t lastFramePts = AV_NOPTS_VALUE;
+	incremental::PacketHashes packetHashes;
+
+	// Source range and incremental mode
+	double rangeStartSeconds = 0;
+	double rangeEndSeconds = -1;
+	std::string previousWorkDir;
+	std::vector<incremental::SourceRange> encodeRanges; // Source ranges this run decodes, in order
+	std::vector<checkpoint::Chunk> reusedChunks;        // From previousWorkDir, linked in at the end
+	incremental::SourceRange activeRange;
+	int64_t rangeStartPts = AV_NOPTS_VALUE;    // Active range in the encoder time base
+	int64_t rangeEndPts = AV_NOPTS_VALUE;
+	int64_t outputOffsetPts = 0;               // Subtracted when muxing so the output starts at 0
+
+	// Trims: source keyframe to keyframe, stream-copied between the encoded edge ranges
+	bool streamCopy = true;
+	std::optional<incremental::SourceRange> copyRange;
+
+	// Duplicate frames, with settings.duplicateThreshold >= 0. Each kept frame waits in
+	// heldFrame until the next one arrives, which decides its duration.
+	std::unique_ptr<dedup::Detector> duplicates;
+	handles::Frame heldFrame;
+	int64_t lastFilteredPts = AV_NOPTS_VALUE;
+
+	// Scene cuts, with settings.sceneThreshold >= 0. Detected on decoded frames, queued in
+	// the encoder time base until the encoder gets there.
+	std::unique_ptr<scenes::Detector> sceneDetector;
+	std::deque<int64_t> pendingCuts;
+	int64_t framesSinceKey = -1;               // -1 until the current encoder got its first frame
+	std::vector<double> cutList;
+
+	// Side outputs
+	std::optional<thumbnails::Options> sideOutputOptions;
+	std::unique_ptr<thumbnails::Extractor> sideOutputs;
+	std::optional<tensors::Options> tensorOptions;
+	std::unique_ptr<tensors::Exporter> tensorExport;
+
+	// Inline metrics, one segment per encoder instance
+	int qualityInterval = 0;
+	std::unique_ptr<quality::Monitor> qualityMonitor;
+	int qualitySegments = 0;
+
+	// Frame buffers, with setFrameArena. Created per job before the decoder, released after it.
+	std::optional<arena::Options> arenaOptions;
+	std::unique_ptr<arena::Arena> frameArena;
+
+	// NUMA placement, the node this conversion holds while it runs
+	bool numaPlacement = false;
+	placement::Scheduler::Lease nodeLease;
+
+	// Memory budget, settings.memoryBudget > 0, and what the stages held
+	memory::Limits memoryLimits;
+	memory::Usage usage;
+
 	bool initFFmpeg();
 	bool openInput();
-	bool openOutput();
-	bool setupDecoder(AVCodecContext*& codecCtx, AVStream* stream);
-	bool setupEncoder(AVCodecContext*& codecCtx, AVStream* stream);
+	bool openOutput(const std::string& filename);
+	bool openOutputFile(const std::string& filename);
+	void closeOutputFile();
+	bool prepareResume();
+	bool startChunk();
+	bool finishChunk(int64_t endPts, int64_t sourceEnd);
+	bool assembleChunks();
+	void checkChunkCut(const AVFrame* frame, bool sceneCut);
+	bool detectScene(const AVFrame* frame);
+	bool reachedSceneCut(int64_t pts);
+	void placeKeyframe(AVFrame* frame, bool sceneCut);
+	incremental::SourceRange requestedRange() const;
+	int64_t toOutputPts(int64_t sourcePts) const;
+	bool beginRange(size_t index);
+	bool planIncremental();
+	bool canStreamCopy() const;
+	bool planStreamCopy();
+	bool copySourceRange();
+	geometry::Transform sourceOrientation() const;
+	bool hashSourceRanges(const std::vector<checkpoint::Chunk>& chunks, std::vector<uint64_t>& hashes);
+	bool writePacket(AVPacket* pkt);
+	bool setupDecoder(handles::CodecContext& codecCtx, AVStream* stream);
+	bool setupEncoder(handles::CodecContext& codecCtx, AVStream* stream);
 	bool initFilters();
+	bool planFormats();
+	void planMemory();
+	async::WorkerPool& pool();
+	bool applyGeometry(const AVFrame* in, AVFrame* out);
+	static bool reuseFrame(handles::Frame& frame, AVPixelFormat format, int width, int height);
 	bool encodeAndWrite(AVFrame* frame);
-	bool decodeAndFilter(AVFrame* frame);
+	bool skipDuplicate(const AVFrame* frame);
+	bool queueFrame(AVFrame* frame);
+	bool sendHeldFrame(int64_t endPts);
+	int decodeAndFilter(AVFrame* frame);
 	bool processFrame(AVFrame* frame);
-	void logError(const std::string& error);
+	bool startSideOutputs();
+	bool offerSideOutputs(const AVFrame* frame);
+	void startQualitySegment();
+	bool openFrameCache();
+	bool encodeCachedFrames();
+	void storeFrames(bool ok);
+	void finishQualitySegment();
+	double durationSeconds() const;
+	int64_t expectedFrames() const;
+	AVDictionary* muxerOptions(const AVFormatContext* output, int64_t frames, seeking::FrontIndex& index);
+	bool writeTrailer(AVFormatContext* output, seeking::FrontIndex& index);
+	void logError(logger::Stage stage, const std::string& error);
 };
 
 VideoConverter::VideoConverter(const std::string& inputFilename, const std::string& outputFilename)
     : inputFilename(inputFilename), outputFilename(outputFilename) {
+    static std::atomic<uint64_t> nextJobId{1};
+    jobId = nextJobId.fetch_add(1, std::memory_order_relaxed);
+
     // Initialize FFmpeg components without deprecated calls
     initFFmpeg();
 }
 
 VideoConverter::~VideoConverter() {
-    // Perform any necessary clean-up that isn't already handled
+    // The FFmpeg objects are handles, a conversion that never reached cleanupFFmpeg or was
+    // never run still frees them here
 }
 
 bool VideoConverter::initFFmpeg() {
-    inputFormatCtx = avformat_alloc_context();
-    outputFormatCtx = avformat_alloc_context();
-    if (!inputFormatCtx || !outputFormatCtx) {
-        logError("Failed to allocate format context");
+    // The output context is created per output file by openOutput
+    inputFormatCtx.reset(avformat_alloc_context());
+    if (!inputFormatCtx) {
+        logError(logger::Stage::Job, "Failed to allocate format context");
         return false;
     }
     return true;
@@ -78,14 +332,31 @@ bool VideoConverter::initFFmpeg() {
 
 bool VideoConverter::configureInput() {
     if (!openInput()) {
-        logError("Failed to open input file");
+        logError(logger::Stage::Demux, "Failed to open input file");
         return false;
     }
 
-    // Assume video stream is always the first stream
-    AVStream* inputStream = inputFormatCtx->streams[0];
+    AVStream* inputStream = inputFormatCtx->streams[videoStreamIndex];
+    planMemory();
+    if (arenaOptions || nodeLease) {
+        arena::Options options = arenaOptions.value_or(arena::Options());
+        if (nodeLease && !nodeLease.simulated()) {
+            options.node = nodeLease.node().id;
+        }
+        frameArena = std::make_unique<arena::Arena>(options);
+    }
     if (!setupDecoder(inputCodecCtx, inputStream)) {
-        logError("Failed to set up decoder for input stream");
+        logError(logger::Stage::Decode, "Failed to set up decoder for input stream");
+        return false;
+    }
+
+    colorSource = tonemap::Source::of(inputCodecCtx, inputStream);
+    if (colorSource.transfer != tonemap::Transfer::Sdr) {
+        logger::info(logger::Stage::Decode, jobId, logger::NoFrame, "HDR input, %s %s peak %.0f nits, tone mapping to BT.709",
+                     tonemap::transferName(colorSource.transfer), colorSource.bt2020 ? "bt2020" : "bt709", colorSource.peakNits);
+    }
+
+    if (!planFormats()) {
         return false;
     }
 
@@ -93,110 +364,419 @@ bool VideoConverter::configureInput() {
 }
 
 bool VideoConverter::configureOutput() {
-    if (!openOutput()) {
-        logError("Failed to open output file");
+    const incremental::SourceRange range = requestedRange();
+    encodeRanges = {range};
+    if (range.start > 0) {
+        outputOffsetPts = toOutputPts(range.start);
+    }
+    if (qualityInterval > 0) {
+        const size_t pending = memoryLimits.qualityPending > 0 ? memoryLimits.qualityPending : memory::MaxQualityPending;
+        qualityMonitor = std::make_unique<quality::Monitor>(pool(), qualityInterval, pending);
+        qualitySegments = 0;
+    }
+
+    if (!workDir.empty()) {
+        return prepareResume();
+    }
+
+    if (!openOutputFile(outputFilename)) {
+        logError(logger::Stage::Mux, "Failed to open output file");
+        return false;
+    }
+
+    return planStreamCopy();
+}
+
+/*
+
+Open Output File
+Creates the muxer, stream and encoder for one output file and writes its header.
+
+*/
+
+bool VideoConverter::openOutputFile(const std::string& filename) {
+    if (!openOutput(filename)) {
         return false;
     }
 
     AVStream* outputStream = avformat_new_stream(outputFormatCtx, nullptr);
     if (!outputStream) {
-        logError("Failed to create a new stream for output");
+        logError(logger::Stage::Mux, "Failed to create a new stream for output");
         return false;
     }
 
     if (!setupEncoder(outputCodecCtx, outputStream)) {
-        logError("Failed to set up encoder for output stream");
+        logError(logger::Stage::Encode, "Failed to set up encoder for output stream");
+        return false;
+    }
+    startQualitySegment();
+    framesSinceKey = -1;
+
+    if (avcodec_parameters_from_context(outputStream->codecpar, outputCodecCtx) < 0) {
+        logError(logger::Stage::Mux, "Failed to copy encoder parameters to output stream");
+        return false;
+    }
+    outputStream->time_base = outputCodecCtx->time_base;
+
+    if (!(outputFormatCtx->oformat->flags & AVFMT_NOFILE)) {
+        if (avio_open(&outputFormatCtx->pb, filename.c_str(), AVIO_FLAG_WRITE) < 0) {
+            logError(logger::Stage::Mux, "Could not open output file " + filename);
+            return false;
+        }
+    }
+
+    // Chunks are stream-copied into the final file, only that one needs the index up front
+    frontIndex = seeking::FrontIndex();
+    AVDictionary* options = workDir.empty() ? muxerOptions(outputFormatCtx, expectedFrames(), frontIndex) : nullptr;
+    const int written = avformat_write_header(outputFormatCtx, &options);
+    av_dict_free(&options);
+    if (written < 0) {
+        logError(logger::Stage::Mux, "Error writing output file header");
         return false;
     }
+    frontIndex.opened(outputFormatCtx);
 
     return true;
 }
 
+void VideoConverter::closeOutputFile() {
+    outputCodecCtx.reset();
+    outputFormatCtx.reset();
+}
+
 bool VideoConverter::configureFilters() {
     if (!initFilters()) {
-        logError("Failed to initialize filters");
+        logError(logger::Stage::Filter, "Failed to initialize filters");
         return false;
     }
+
+    if (settings.duplicateThreshold >= 0) {
+        const int64_t maxRun = std::max<int64_t>(0, (int64_t)(settings.maxDuplicateSeconds * settings.frameRate) - 1);
+        duplicates = std::make_unique<dedup::Detector>(settings.duplicateThreshold, maxRun);
+    }
+    if (settings.sceneThreshold >= 0) {
+        scenes::Options options;
+        options.threshold = settings.sceneThreshold;
+        sceneDetector = std::make_unique<scenes::Detector>(options);
+    }
     return true;
 }
 
 bool VideoConverter::performConversion() {
-    AVFrame* frame = av_frame_alloc();
+    handles::Frame frame = handles::allocFrame();
     if (!frame) {
-        logError("Failed to allocate frame");
+        logError(logger::Stage::Pipeline, "Failed to allocate frame");
         return false;
     }
 
-    int ret;
-    while (true) {
-        ret = decodeAndFilter(frame);
-        if (ret < 0) {  // decodeAndFilter should return an FFmpeg error code on failure
-            if (ret == AVERROR_EOF) {  // Check for end of file
+    if (job) {
+        job->start(expectedFrames());
+    }
+
+    if (!startSideOutputs()) {
+        return false;
+    }
+
+    if (!workDir.empty() && manifest.complete) {
+        return true; // Every chunk is already encoded, finalizeOutputFile assembles them
+    }
+
+    for (size_t i = 0; i < encodeRanges.size(); i++) {
+        if (copyRange && copyRange->start <= encodeRanges[i].start && !copySourceRange()) {
+            return false;
+        }
+        if (!beginRange(i)) {
+            return false;
+        }
+
+        int ret;
+        while (true) {
+            ret = decodeAndFilter(frame);
+            if (ret < 0) {  // decodeAndFilter should return an FFmpeg error code on failure
+                if (ret == AVERROR_EOF) {  // Check for end of file or of the range
+                    break;
+                }
+                if (ret == AVERROR_EXIT) {
+                    logger::info(logger::Stage::Job, jobId, frameNumber, "Conversion cancelled");
+                    return false;
+                }
+                char error_buf[AV_ERROR_MAX_STRING_SIZE];
+                av_strerror(ret, error_buf, AV_ERROR_MAX_STRING_SIZE);  // Get the error message
+                logError(logger::Stage::Pipeline, "Error during frame processing: " + std::string(error_buf));
+                return false;
+            }
+        }
+
+        // Drain the decoder and the filter graph so the tail frames get encoded
+        ret = avcodec_send_packet(inputCodecCtx, nullptr);
+        while (ret >= 0) {
+            ret = avcodec_receive_frame(inputCodecCtx, frame);
+            if (ret < 0) {
                 break;
             }
-            char error_buf[AV_ERROR_MAX_STRING_SIZE];
-            av_strerror(ret, error_buf, AV_ERROR_MAX_STRING_SIZE);  // Get the error message
-            logError("Error during frame processing: " + std::string(error_buf));
-            av_frame_free(&frame);
+            usage[memory::Stage::Decode].leave();
+            frameNumber++;
+            checkChunkCut(frame, detectScene(frame));
+            if (!offerSideOutputs(frame) || !processFrame(frame)) {
+                return false;
+            }
+        }
+        if (!processFrame(nullptr)) {
             return false;
         }
+
+        // Ranges are not contiguous, each one after the first starts a new chunk
+        if (!workDir.empty() && i + 1 < encodeRanges.size()) {
+            if (!flushEncoder() || !finishChunk(rangeEndPts, activeRange.end) || !startChunk()) {
+                return false;
+            }
+        }
     }
 
-    av_frame_free(&frame); // Clean up the allocated frame after processing
+    if (copyRange && !copySourceRange()) {
+        return false;
+    }
+
+    if (sceneDetector) {
+        logger::info(logger::Stage::Encode, jobId, frameNumber, "Placed %zu keyframes at scene cuts", cutList.size());
+    }
+    if (duplicates) {
+        logger::info(logger::Stage::Filter, jobId, frameNumber, "Dropped %lld duplicate frames",
+                     (long long)duplicates->droppedFrames());
+    }
+
+    if (tensorExport) {
+        tensorExport->finish();
+        logger::info(logger::Stage::Pipeline, jobId, logger::NoFrame, "Exported %llu tensors to %s, %llu dropped on a full ring",
+                     (unsigned long long)tensorExport->exported(), tensorExport->path().c_str(),
+                     (unsigned long long)tensorExport->droppedFrames());
+        tensorExport.reset();
+    }
+    if (sideOutputs) {
+        const bool ok = sideOutputs->finish();
+        sideOutputs.reset();
+        return ok;
+    }
     return true;
 }
 
+bool VideoConverter::chooseCrf() {
+    if (settings.targetSsim <= 0) {
+        return true;
+    }
 
+    quality::Options options;
+    options.target = settings.targetSsim;
+    const quality::Result result = quality::search(inputFilename, settings, options, pool(), jobId);
+    if (!result.ok) {
+        logger::warning(logger::Stage::Encode, jobId, logger::NoFrame, "Quality search failed, keeping crf %d", settings.crf);
+        return true;
+    }
 
+    // Constant quality, a bitrate cap would undo the search on hard scenes
+    settings.crf = result.crf;
+    settings.bitrate = 0;
+    logger::info(logger::Stage::Encode, jobId, logger::NoFrame, "Crf %d for ssim %.4f, %.1f s sampled, search took %.1f s",
+                 settings.crf, settings.targetSsim, result.sampledSeconds, result.searchSeconds);
+    return true;
+}
 
+bool VideoConverter::convert() {
+    settings = requested;
+
+    std::string cacheKey;
+    if (resultCache) {
+        // A trim may copy its whole GOPs from the source instead of encoding them, see Stream Copy
+        const std::string range = rangeStartSeconds > 0 || rangeEndSeconds >= 0 ?
+                                  ";range=" + std::to_string(rangeStartSeconds) + "-" + std::to_string(rangeEndSeconds) +
+                                  ";copy=" + (streamCopy ? "1" : "0") : "";
+        cacheKey = resultCache->key(inputFilename, requested.normalized() + range);
+
+        // The entry is the video alone. Side outputs and tensors need the decoded frames,
+        // so such a job converts and only stores; they do not change the video it stores.
+        const bool needsFrames = sideOutputOptions || tensorOptions;
+        if (!needsFrames && resultCache->fetch(cacheKey, outputFilename)) {
+            logger::info(logger::Stage::Job, jobId, logger::NoFrame, "Result cache hit %s", cacheKey.c_str());
+            return true;
+        }
+    }
 
+    // Pinned before any decoder or encoder thread exists, they inherit the mask
+    std::optional<placement::Pin> pin;
+    if (numaPlacement) {
+        nodeLease = placement::Scheduler::shared().acquire();
+        pin.emplace(nodeLease.node().cpus);
+        logger::info(logger::Stage::Job, jobId, logger::NoFrame, "Placed on node %d%s, %zu cpus%s", nodeLease.node().id,
+                     nodeLease.simulated() ? " (simulated)" : "", nodeLease.node().cpus.size(), pin->ok() ? "" : ", pinning failed");
+    }
 
-bool VideoConverter::openInput() {
-    if (avformat_open_input(&inputFormatCtx, inputFilename.c_str(), nullptr, nullptr) != 0) {
-        logError("Could not open input file");
-        return false;
+    bool ok = configureInput() && chooseCrf() && openFrameCache() && configureOutput();
+    if (ok && cachedFrames) {
+        ok = encodeCachedFrames() && flushEncoder() && finalizeOutputFile();
+    } else if (ok) {
+        ok = configureFilters() && performConversion() && flushEncoder() && finalizeOutputFile();
     }
+    storeFrames(ok);
+    cleanupFFmpeg();
+    nodeLease = placement::Scheduler::Lease();
+    logger::endJob(jobId);
 
-    if (avformat_find_stream_info(inputFormatCtx, nullptr) < 0) {
-        logError("Failed to find stream information");
-        return false;
+    if (ok && resultCache && !resultCache->insert(cacheKey, outputFilename)) {
+        logger::warning(logger::Stage::Job, jobId, logger::NoFrame, "Could not store output in the result cache");
     }
+    return ok;
+}
 
-    // Find the primary video stream
-    int videoStreamIndex = -1;
-    for (unsigned i = 0; i < inputFormatCtx->nb_streams; i++) {
-        if (inputFormatCtx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
-            videoStreamIndex = i;
-            break;
-        }
+async::RunAwaitable<bool> VideoConverter::run(async::ConversionJob& conversionJob) {
+    return async::RunAwaitable<bool>(async::WorkerPool::shared(), [this, &conversionJob] {
+        job = &conversionJob;
+        bool ok = convert();
+        job = nullptr;
+        return ok;
+    });
+}
+
+async::Background<bool> VideoConverter::start(async::ConversionJob& conversionJob) {
+    return async::Background<bool>(async::WorkerPool::shared(), [this, &conversionJob] {
+        job = &conversionJob;
+        bool ok = convert();
+        job = nullptr;
+        return ok;
+    });
+}
+
+/*
+
+Expected Frames
+Output frame count estimate for progress, ETA and the fast start reservation, 0 when the
+duration is unknown. Only the requested range is counted.
+
+*/
+
+double VideoConverter::durationSeconds() const {
+    if (!inputFormatCtx || videoStreamIndex < 0) {
+        return 0;
     }
 
-    if (videoStreamIndex == -1) {
-        logError("Could not find a video stream in the file");
-        return false;
+    const AVStream* stream = inputFormatCtx->streams[videoStreamIndex];
+    if (stream->duration != AV_NOPTS_VALUE) {
+        return stream->duration * av_q2d(stream->time_base);
+    }
+    if (inputFormatCtx->duration != AV_NOPTS_VALUE) {
+        return inputFormatCtx->duration / (double)AV_TIME_BASE;
+    }
+    return 0;
+}
+
+int64_t VideoConverter::expectedFrames() const {
+    double end = durationSeconds();
+    if (rangeEndSeconds >= 0) {
+        end = end > 0 ? std::min(end, rangeEndSeconds) : rangeEndSeconds;
     }
+    const double seconds = end - std::max(0.0, rangeStartSeconds);
+    return seconds > 0 ? (int64_t)std::ceil(seconds * settings.frameRate) : 0;
+}
+
+/*
+
+Memory Budget
+See memory.hpp. Planned once the source is open, before the decoder is: the output side
+is sized at the source's pixel format, which only overestimates for tone mapped input.
+
+*/
+
+void VideoConverter::planMemory() {
+    const AVCodecParameters* source = inputFormatCtx->streams[videoStreamIndex]->codecpar;
+    memory::Sizes sizes;
+    sizes.sourceFrame = std::max(0, av_image_get_buffer_size((AVPixelFormat)source->format, source->width, source->height, 1));
+    sizes.outputFrame = std::max(0, av_image_get_buffer_size((AVPixelFormat)source->format, settings.width, settings.height, 1));
+    usage = memory::Usage();
+    usage.configure(sizes);
+    memoryLimits = memory::Limits();
+    if (settings.memoryBudget <= 0) {
+        return;
+    }
+
+    memoryLimits = memory::plan(settings.memoryBudget, sizes, std::max(1, settings.threads),
+                                settings.realtime ? 0 : memory::MaxLag, qualityInterval);
+    if (!memoryLimits.fits(settings.memoryBudget)) {
+        logger::warning(logger::Stage::Job, jobId, logger::NoFrame, "Memory budget %.1f MB is below the %.1f MB this input needs, running at the minimum",
+                        settings.memoryBudget / 1048576.0, memoryLimits.minimumBytes / 1048576.0);
+    }
+    logger::info(logger::Stage::Job, jobId, logger::NoFrame, "Memory plan %.1f MB: %d decoder threads, lag %d, %d quality frames",
+                 memoryLimits.plannedBytes / 1048576.0, memoryLimits.decoderThreads, memoryLimits.lagInFrames,
+                 memoryLimits.qualityPending);
+}
+
+// Worker threads of the job's node when placed, the shared pool otherwise
+async::WorkerPool& VideoConverter::pool() {
+    return nodeLease ? nodeLease.pool() : async::WorkerPool::shared();
+}
+
+// Fast start reservation for the final output, see seeking.hpp. Keyframes are bounded by
+// the shortest distance we allow between them: minGopSeconds with scene cuts, else the GOP.
+AVDictionary* VideoConverter::muxerOptions(const AVFormatContext* output, int64_t frames, seeking::FrontIndex& index) {
+    if (!settings.fastStart) {
+        return nullptr;
+    }
+    if (seeking::container(output->oformat) == seeking::Container::Other) {
+        logger::warning(logger::Stage::Mux, jobId, logger::NoFrame, "Fast start is not supported for %s, index left at the end",
+                        output->oformat->name);
+        return nullptr;
+    }
+    if (frames <= 0) {
+        logger::warning(logger::Stage::Mux, jobId, logger::NoFrame, "Unknown duration, index left at the end");
+        return nullptr;
+    }
+
+    const double keySeconds = settings.sceneThreshold >= 0 ? settings.minGopSeconds : settings.maxKeyframeSeconds();
+    const int64_t distance = std::max<int64_t>(1, std::lround(keySeconds * settings.frameRate));
+    std::string summary;
+    AVDictionary* options = index.options(output->oformat, frames, frames / distance + 1, settings.seekIntervalSeconds, summary);
+    logger::info(logger::Stage::Mux, jobId, logger::NoFrame, "Fast start, %s for %lld frames", summary.c_str(), (long long)frames);
+    return options;
+}
 
-    // Set up the codec context for the video stream
-    AVStream* stream = inputFormatCtx->streams[videoStreamIndex];
-    inputCodecCtx = avcodec_alloc_context3(nullptr);
-    if (!inputCodecCtx) {
-        logError("Failed to allocate codec context");
+// Without the reservation when the file outgrew it, the trailer would fail with it
+bool VideoConverter::writeTrailer(AVFormatContext* output, seeking::FrontIndex& index) {
+    if (index.writeTrailer(output) < 0) {
+        logError(logger::Stage::Mux, "Error writing output file trailer");
         return false;
     }
+    if (index.droppedReservation()) {
+        logger::warning(logger::Stage::Mux, jobId, logger::NoFrame, "Index outgrew the %lld bytes reserved, left at the end",
+                        (long long)index.reservedBytes());
+    }
+    return true;
+}
+
+
 
-    if (avcodec_parameters_to_context(inputCodecCtx, stream->codecpar) < 0) {
-        logError("Failed to copy codec parameters to codec context");
+
+
+
+bool VideoConverter::openInput() {
+    if (avformat_open_input(inputFormatCtx.address(), inputFilename.c_str(), nullptr, nullptr) != 0) {
+        logError(logger::Stage::Demux, "Could not open input file");
         return false;
     }
 
-    AVCodec* codec = avcodec_find_decoder(inputCodecCtx->codec_id);
-    if (!codec) {
-        logError("Failed to find the codec");
+    if (avformat_find_stream_info(inputFormatCtx, nullptr) < 0) {
+        logError(logger::Stage::Demux, "Failed to find stream information");
         return false;
     }
 
-    if (avcodec_open2(inputCodecCtx, codec, nullptr) < 0) {
-        logError("Failed to open codec");
+    // Find the primary video stream, the decoder is opened by setupDecoder
+    videoStreamIndex = -1;
+    for (unsigned i = 0; i < inputFormatCtx->nb_streams; i++) {
+        if (inputFormatCtx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+            videoStreamIndex = i;
+            break;
+        }
+    }
+
+    if (videoStreamIndex == -1) {
+        logError(logger::Stage::Demux, "Could not find a video stream in the file");
         return false;
     }
 
@@ -204,36 +784,62 @@ bool VideoConverter::openInput() {
 }
 
 
-bool VideoConverter::openOutput() {
-    avformat_alloc_output_context2(&outputFormatCtx, nullptr, nullptr, outputFilename.c_str());
+bool VideoConverter::openOutput(const std::string& filename) {
+    outputFormatCtx.reset();
+    avformat_alloc_output_context2(outputFormatCtx.address(), nullptr, nullptr, filename.c_str());
     if (!outputFormatCtx) {
-        logError("Could not create output context");
+        logError(logger::Stage::Mux, "Could not create output context");
         return false;
     }
 
     return true;
 }
 
-bool VideoConverter::setupDecoder(AVCodecContext*& codecCtx, AVStream* stream) {
-    AVCodec* decoder = avcodec_find_decoder(stream->codecpar->codec_id);
+bool VideoConverter::setupDecoder(handles::CodecContext& codecCtx, AVStream* stream) {
+    const AVCodec* decoder = avcodec_find_decoder(stream->codecpar->codec_id);
     if (!decoder) {
-        logError("Decoder not found");
+        logError(logger::Stage::Decode, "Decoder not found");
         return false;
     }
 
-    codecCtx = avcodec_alloc_context3(decoder);
+    codecCtx.reset(avcodec_alloc_context3(decoder));
     if (!codecCtx) {
-        logError("Failed to allocate the codec context");
+        logError(logger::Stage::Decode, "Failed to allocate the codec context");
         return false;
     }
 
     if (avcodec_parameters_to_context(codecCtx, stream->codecpar) < 0) {
-        logError("Failed to copy codec parameters to codec context");
+        logError(logger::Stage::Decode, "Failed to copy codec parameters to codec context");
         return false;
     }
 
+    // Preview tier: decode at a power of two reduction where the codec can, as long as the
+    // short side still covers the longest output side whatever the rotation, and skip the
+    // loop filter, whose work a downscale to preview size throws away anyway
+    if (settings.fastDecode) {
+        const int shortSide = std::min(stream->codecpar->width, stream->codecpar->height);
+        const int needed = std::max(settings.width, settings.height);
+        int lowres = 0;
+        while (lowres < decoder->max_lowres && (shortSide >> (lowres + 1)) >= needed) {
+            lowres++;
+        }
+        codecCtx->lowres = lowres;
+        codecCtx->skip_loop_filter = AVDISCARD_ALL;
+        codecCtx->flags2 |= AV_CODEC_FLAG2_FAST;
+        logger::info(logger::Stage::Decode, jobId, logger::NoFrame, "Fast decode, lowres %d, loop filter off", lowres);
+    }
+
+    // Every frame thread holds a frame of its own
+    if (settings.memoryBudget > 0) {
+        codecCtx->thread_count = memoryLimits.decoderThreads;
+        codecCtx->thread_type = FF_THREAD_FRAME;
+    }
+    if (frameArena) {
+        frameArena->attach(codecCtx);
+    }
+
     if (avcodec_open2(codecCtx, decoder, nullptr) < 0) {
-        logError("Failed to open codec");
+        logError(logger::Stage::Decode, "Failed to open codec");
         return false;
     }
 
@@ -247,150 +853,223 @@ Configures the encoder for the output stream.
 
 */
 
-bool VideoConverter::setupEncoder(AVCodecContext*& codecCtx, AVStream* stream) {
-    AVCodec* encoder = avcodec_find_encoder(AV_CODEC_ID_VP9);
+bool VideoConverter::setupEncoder(handles::CodecContext& codecCtx, AVStream* stream) {
+    const AVCodec* encoder = avcodec_find_encoder_by_name(settings.codec.c_str());
     if (!encoder) {
-        logError("Encoder not found");
+        logError(logger::Stage::Encode, "Encoder not found");
+        return false;
+    }
+
+    if (avformat_query_codec(outputFormatCtx->oformat, encoder->id, FF_COMPLIANCE_NORMAL) == 0) {
+        logError(logger::Stage::Encode, settings.codec + " output cannot be stored in " + outputFormatCtx->oformat->name);
         return false;
     }
 
-    codecCtx = avcodec_alloc_context3(encoder);
+    codecCtx.reset(avcodec_alloc_context3(encoder));
     if (!codecCtx) {
-        logError("Failed to allocate the codec context");
+        logError(logger::Stage::Encode, "Failed to allocate the codec context");
         return false;
     }
 
-    codecCtx->height = 1920;
-    codecCtx->width = 1080;
+    codecCtx->height = settings.height;
+    codecCtx->width = settings.width;
     codecCtx->sample_aspect_ratio = stream->sample_aspect_ratio; // Keep original aspect ratio
-    codecCtx->bit_rate = 1000000;  // Set bitrate to 1 Mbit/s or
-    codecCtx->pix_fmt = encoder->pix_fmts[0];
-    codecCtx->time_base = {1, 29};
-    codecCtx->global_quality = av_q2d({20, 1}); // Set CRF to 20 using a quality scale
+    codecCtx->pix_fmt = pixelPlan.encoder;
+    codecCtx->time_base = {1, settings.frameRate};
+    codecCtx->thread_count = settings.threads;
+
+    // Scene cuts get their keyframes from us, the encoder only keeps to the same limits.
+    // Fast start bounds the GOP too, every keyframe is a seek point.
+    if (settings.maxKeyframeSeconds() > 0) {
+        codecCtx->gop_size = std::max(1, (int)std::lround(settings.maxKeyframeSeconds() * settings.frameRate));
+    }
+    if (settings.sceneThreshold >= 0) {
+        codecCtx->keyint_min = std::max(1, (int)std::lround(settings.minGopSeconds * settings.frameRate));
+    }
+
+    // The tone mapper always produces BT.709, say so instead of leaving the player to guess
+    if (pixelPlan.toneMap) {
+        codecCtx->color_primaries = AVCOL_PRI_BT709;
+        codecCtx->color_trc = AVCOL_TRC_BT709;
+        codecCtx->colorspace = AVCOL_SPC_BT709;
+        codecCtx->color_range = AVCOL_RANGE_MPEG;
+    }
+
+    // Rate control, speed preset and lookahead in the encoder's own options, see encoders.hpp
+    std::string native;
+    if (!encoders::configure(codecCtx, encoders::options(settings, settings.memoryBudget > 0 ? memoryLimits.lagInFrames : -1), &native)) {
+        logError(logger::Stage::Encode, "No encoder backend for " + settings.codec + ", use libvpx-vp9, libx264 or libsvtav1");
+        return false;
+    }
+
+    if (outputFormatCtx->oformat->flags & AVFMT_GLOBALHEADER) {
+        codecCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
 
 
     if (avcodec_open2(codecCtx, encoder, nullptr) < 0) {
-        logError("Failed to open encoder");
+        logError(logger::Stage::Encode, "Failed to open encoder");
         return false;
     }
+    logger::info(logger::Stage::Encode, jobId, logger::NoFrame, "Encoder %s", native.c_str());
 
     return true;
 }
 
 bool VideoConverter::initFilters() {
     char args[512];
-    filterGraph = avfilter_graph_alloc();
+    filterGraph.reset(avfilter_graph_alloc());
     if (!filterGraph) {
-        logError("Unable to create filter graph");
+        logError(logger::Stage::Filter, "Unable to create filter graph");
         return false;
     }
 
-    AVFilterContext* scale_ctx = nullptr;
-    AVFilterContext* crop_ctx = nullptr;
     AVFilterContext* fps_ctx = nullptr;
 
     const AVFilter* buffersrc = avfilter_get_by_name("buffer");
     const AVFilter* buffersink = avfilter_get_by_name("buffersink");
-    const AVFilter* scale = avfilter_get_by_name("scale");
-    const AVFilter* crop = avfilter_get_by_name("crop");
     const AVFilter* fps = avfilter_get_by_name("fps");
 
     if (inputCodecCtx->width <= 0 || inputCodecCtx->height <= 0 || inputCodecCtx->pix_fmt == AV_PIX_FMT_NONE) {
-	    logError("Invalid or uninitialized codec context parameters");
+	    logError(logger::Stage::Filter, "Invalid or uninitialized codec context parameters");
 	    return false;
 	}
 
+    // Decoded frames carry stream timestamps
+    const AVRational streamTimeBase = inputFormatCtx->streams[videoStreamIndex]->time_base;
     snprintf(args, sizeof(args),
              "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d",
              inputCodecCtx->width, inputCodecCtx->height, inputCodecCtx->pix_fmt,
-             inputCodecCtx->time_base.num, inputCodecCtx->time_base.den);
+             streamTimeBase.num, streamTimeBase.den);
 
     if (avfilter_graph_create_filter(&buffersrc_ctx, buffersrc, "in", args, nullptr, filterGraph) < 0) {
-        logError("Cannot create buffer source");
+        logError(logger::Stage::Filter, "Cannot create buffer source");
         return false;
     }
 
     if (avfilter_graph_create_filter(&buffersink_ctx, buffersink, "out", nullptr, nullptr, filterGraph) < 0) {
-        logError("Cannot create buffer sink");
-        return false;
-    }
-
-    snprintf(args, sizeof(args), "scale=1080:-1");
-    if (avfilter_graph_create_filter(&scale_ctx, scale, "scale", args, nullptr, filterGraph) < 0) {
-        logError("Cannot create scale filter");
+        logError(logger::Stage::Filter, "Cannot create buffer sink");
         return false;
     }
 
-    snprintf(args, sizeof(args), "crop=1080:1920:0:0");
-    if (avfilter_graph_create_filter(&crop_ctx, crop, "crop", args, nullptr, filterGraph) < 0) {
-        logError("Cannot create crop filter");
+    // Without a constraint the sink takes anything and conversions happen wherever libavfilter likes
+    const AVPixelFormat sinkFormats[] = {pixelPlan.graph, AV_PIX_FMT_NONE};
+    if (av_opt_set_int_list(buffersink_ctx, "pix_fmts", sinkFormats, AV_PIX_FMT_NONE, AV_OPT_SEARCH_CHILDREN) < 0) {
+        logError(logger::Stage::Filter, "Cannot set output pixel format");
         return false;
     }
 
-    snprintf(args, sizeof(args), "fps=fps=29");
+    // Scale and crop happen after the graph, so fps drops frames before anyone scales them
+    snprintf(args, sizeof(args), "fps=%d", settings.frameRate);
     if (avfilter_graph_create_filter(&fps_ctx, fps, "fps", args, nullptr, filterGraph) < 0) {
-        logError("Cannot create fps filter");
+        logError(logger::Stage::Filter, "Cannot create fps filter");
         return false;
     }
 
-    if (avfilter_link(buffersrc_ctx, 0, scale_ctx, 0) < 0 ||
-        avfilter_link(scale_ctx, 0, crop_ctx, 0) < 0 ||
-        avfilter_link(crop_ctx, 0, fps_ctx, 0) < 0 ||
+    if (avfilter_link(buffersrc_ctx, 0, fps_ctx, 0) < 0 ||
         avfilter_link(fps_ctx, 0, buffersink_ctx, 0) < 0) {
-        logError("Error connecting filters");
+        logError(logger::Stage::Filter, "Error connecting filters");
         return false;
     }
 
+    orientation = sourceOrientation();
+    if (!orientation.identity()) {
+        logger::info(logger::Stage::Filter, jobId, logger::NoFrame, "Display rotation %d%s", orientation.rotation,
+                     orientation.hflip ? " mirrored" : "");
+    }
+
     if (avfilter_graph_config(filterGraph, nullptr) < 0) {
-        logError("Error configuring the filter graph");
+        logError(logger::Stage::Filter, "Error configuring the filter graph");
         return false;
     }
 
+    // Anything libavfilter inserted on its own is a conversion, planned or not
+    for (unsigned i = 0; i < filterGraph->nb_filters; i++) {
+        const char* name = filterGraph->filters[i]->name;
+        if (name && strncmp(name, "auto_scale", 10) == 0) {
+            const bool planned = pixelPlan.graph != inputCodecCtx->pix_fmt;
+            logger::write(planned ? logger::Level::Info : logger::Level::Warning, logger::Stage::Filter, jobId, logger::NoFrame, 0,
+                          "Filter graph inserted %s%s", name, planned ? "" : " that the format plan did not expect");
+        }
+    }
+
     return true;
 }
 
-bool VideoConverter::decodeAndFilter(AVFrame* frame) {
-    AVPacket packet;
+int VideoConverter::decodeAndFilter(AVFrame* frame) {
+    handles::Packet packet = handles::allocPacket();
+    if (!packet) {
+        return AVERROR(ENOMEM);
+    }
     int response;
 
-    while (av_read_frame(inputFormatCtx, &packet) >= 0) {
-        response = avcodec_send_packet(inputCodecCtx, &packet);
+    while ((response = av_read_frame(inputFormatCtx, packet)) >= 0) {
+        if (packet->stream_index != videoStreamIndex) {
+            av_packet_unref(packet);
+            continue;
+        }
+
+        if (!workDir.empty() && packet->pts != AV_NOPTS_VALUE) {
+            packetHashes.add(packet->pts, packet->data, packet->size);
+        }
+
+        response = avcodec_send_packet(inputCodecCtx, packet);
+        av_packet_unref(packet);
         if (response < 0) {
-            logError("Failed to send packet to decoder");
-            av_packet_unref(&packet); // Ensure packet is unreferenced even on failure
-            return false;
+            LOG_FRAME_ERROR(logger::Stage::Decode, jobId, frameNumber, "Failed to send packet to decoder");
+            return response;
         }
+        usage[memory::Stage::Decode].enter();
 
         while (response >= 0) {
             response = avcodec_receive_frame(inputCodecCtx, frame);
             if (response == AVERROR(EAGAIN) || response == AVERROR_EOF) {
                 break;
             } else if (response < 0) {
-                logError("Failed to receive frame from decoder");
-                av_packet_unref(&packet); // Ensure packet is unreferenced even on failure
-                return false;
+                LOG_FRAME_ERROR(logger::Stage::Decode, jobId, frameNumber, "Failed to receive frame from decoder");
+                return response;
             }
+            usage[memory::Stage::Decode].leave();
 
-            if (!processFrame(frame)) {
-                av_packet_unref(&packet); // Ensure packet is unreferenced even on failure
-                return false;
+            // Past the end of the range, everything after it decodes in later pts
+            if (activeRange.end != incremental::OpenEnd && frame->best_effort_timestamp >= activeRange.end) {
+                return AVERROR_EOF;
+            }
+
+            frameNumber++;
+            checkChunkCut(frame, detectScene(frame));
+            if (!offerSideOutputs(frame) || !processFrame(frame)) {
+                return AVERROR_EXTERNAL;
+            }
+
+            // Cooperative cancellation point between frames
+            if (job && job->cancelled()) {
+                return AVERROR_EXIT;
             }
         }
-        av_packet_unref(&packet);
     }
-    return true;
+    return response;
 }
 
 
+// A null frame signals end of stream to the filter graph and drains it
 bool VideoConverter::processFrame(AVFrame* frame) {
+    if (frame) {
+        frame->pts = frame->best_effort_timestamp;
+    }
+
     if (av_buffersrc_add_frame_flags(buffersrc_ctx, frame, AV_BUFFERSRC_FLAG_KEEP_REF) < 0) {
-        logError("Error adding frame to buffer source");
+        LOG_FRAME_ERROR(logger::Stage::Filter, jobId, frameNumber, "Error adding frame to buffer source");
         return false;
     }
+    if (frame) {
+        usage[memory::Stage::Filter].enter();
+    }
 
-    AVFrame *filt_frame = av_frame_alloc();
-    if (!filt_frame) {
-        logError("Could not allocate filtered frame");
+    handles::Frame filt_frame = handles::allocFrame();
+    handles::Frame scaled_frame = handles::allocFrame();
+    if (!filt_frame || !scaled_frame) {
+        LOG_FRAME_ERROR(logger::Stage::Filter, jobId, frameNumber, "Could not allocate filtered frame");
         return false;
     }
 
@@ -400,134 +1079,1291 @@ bool VideoConverter::processFrame(AVFrame* frame) {
             break; // No more frames to process, exit loop
         }
         if (ret < 0) {
-            av_frame_free(&filt_frame);
-            logError("Error during filtering");
+            LOG_FRAME_ERROR(logger::Stage::Filter, jobId, frameNumber, "Error during filtering");
             return false;
         }
+        usage[memory::Stage::Filter].leave();
+
+        // Duplicates are dropped before they cost a scale or an encode
+        if (skipDuplicate(filt_frame)) {
+            av_frame_unref(filt_frame);
+            continue;
+        }
 
-        if (!encodeAndWrite(filt_frame)) {
-            av_frame_free(&filt_frame);
+        if (!applyGeometry(filt_frame, scaled_frame) || !queueFrame(scaled_frame)) {
             return false;
         }
         av_frame_unref(filt_frame);
+        av_frame_unref(scaled_frame);
+    }
+
+    // End of the range, the last kept frame lasts until the last frame the graph produced
+    if (!frame && lastFilteredPts != AV_NOPTS_VALUE && !sendHeldFrame(lastFilteredPts + 1)) {
+        return false;
     }
-    av_frame_free(&filt_frame); // Clean up the allocated frame
     return true;
 }
 
 
-bool VideoConverter::encodeAndWrite(AVFrame* frame) {
-    AVPacket pkt;
-    // av_init_packet(&pkt);
-    pkt.data = nullptr;    // Packet data will be allocated by the encoder
-    pkt.size = 0;
+/*
 
-    int response = avcodec_send_frame(outputCodecCtx, frame);
-    if (response < 0) {
-        logError("Failed to send frame for encoding");
+Duplicate Frames
+See dedup.hpp. The first frame at or after a range start, a chunk cut or the resume
+point is always kept, so every chunk starts with a picture of its own.
+
+*/
+
+bool VideoConverter::skipDuplicate(const AVFrame* frame) {
+    if (!duplicates) {
         return false;
     }
 
-    while (response >= 0) {
-        response = avcodec_receive_packet(outputCodecCtx, &pkt);
-        if (response == AVERROR(EAGAIN) || response == AVERROR_EOF) {
-            break; // No more packets to process from the encoder
-        } else if (response < 0) {
-            logError("Error during encoding");
-            return false;
-        }
+    const int64_t previous = lastFilteredPts;
+    lastFilteredPts = frame->pts;
+    auto crosses = [&](int64_t boundary) {
+        return boundary != AV_NOPTS_VALUE && frame->pts >= boundary && (previous == AV_NOPTS_VALUE || previous < boundary);
+    };
+    if (crosses(rangeStartPts) || crosses(cutPts) || crosses(resumePts)) {
+        duplicates->reset();
+    }
 
-        if (av_interleaved_write_frame(outputFormatCtx, &pkt) < 0) {
-            av_packet_unref(&pkt);
-            logError("Error while writing frame to output");
-            return false;
-        }
-        av_packet_unref(&pkt);
+    if (!duplicates->duplicate(frame)) {
+        return false;
+    }
+    if (job) {
+        job->frameDone();  // Progress counts output frames, dropped ones included
     }
     return true;
 }
 
-bool VideoConverter::flushEncoder() {
-    AVPacket pkt;
-    // av_init_packet(&pkt);
-    pkt.data = nullptr;
-    pkt.size = 0;
-
-    // Send a NULL frame to the encoder to flush remaining frames
-    int response = avcodec_send_frame(outputCodecCtx, nullptr);
-    if (response < 0) {
-        logError("Failed to send flush frame");
+bool VideoConverter::queueFrame(AVFrame* frame) {
+    if (!duplicates) {
+        return encodeAndWrite(frame);
+    }
+    if (!heldFrame && !(heldFrame = handles::allocFrame())) {
+        LOG_FRAME_ERROR(logger::Stage::Encode, jobId, frameNumber, "Could not allocate held frame");
         return false;
     }
-
-    while (response >= 0) {
-        response = avcodec_receive_packet(outputCodecCtx, &pkt);
-        if (response == AVERROR(EAGAIN) || response == AVERROR_EOF) {
-            break;  // No more packets to flush
-        } else if (response < 0) {
-            logError("Error during flushing encoder");
-            return false;
-        }
-
-        if (av_interleaved_write_frame(outputFormatCtx, &pkt) < 0) {
-            av_packet_unref(&pkt);
-            logError("Error while writing flushed frame");
-            return false;
-        }
-        av_packet_unref(&pkt);
+    if (!sendHeldFrame(frame->pts)) {
+        return false;
     }
+    av_frame_move_ref(heldFrame, frame);
     return true;
 }
 
-
-bool VideoConverter::finalizeOutputFile() {
-    if (av_write_trailer(outputFormatCtx) < 0) {
-        logError("Error writing output file trailer");
-        return false;
+// Encodes the held frame stretched up to endPts, over the duplicates dropped after it
+bool VideoConverter::sendHeldFrame(int64_t endPts) {
+    if (!heldFrame || !heldFrame->buf[0]) {
+        return true;
     }
-    return true;
+    heldFrame->duration = std::max<int64_t>(1, endPts - heldFrame->pts);
+    const bool ok = encodeAndWrite(heldFrame);
+    av_frame_unref(heldFrame);
+    return ok;
 }
 
 
-void VideoConverter::cleanupFFmpeg() {
-    if (inputCodecCtx) {
-        avcodec_free_context(&inputCodecCtx);
-    }
-    if (outputCodecCtx) {
-        avcodec_free_context(&outputCodecCtx);
-    }
-    if (inputFormatCtx) {
-        avformat_close_input(&inputFormatCtx);
-    }
-    if (outputFormatCtx) {
-        if (!(outputFormatCtx->oformat->flags & AVFMT_NOFILE)) {
-            avio_closep(&outputFormatCtx->pb);
-        }
-        avformat_free_context(outputFormatCtx);
+/*
+
+Plan Formats
+Chooses the format of every stage from the decoder output and the encoder's list,
+see formats.hpp. Every conversion it has to make is logged once here.
+
+*/
+
+bool VideoConverter::planFormats() {
+    const AVCodec* encoder = avcodec_find_encoder_by_name(settings.codec.c_str());
+    if (!encoder) {
+        logError(logger::Stage::Encode, "Encoder not found");
+        return false;
+    }
+
+    AVPixelFormat decoderFormat = inputCodecCtx->pix_fmt;
+    if (decoderFormat == AV_PIX_FMT_NONE) {
+        decoderFormat = (AVPixelFormat)inputFormatCtx->streams[videoStreamIndex]->codecpar->format;
+    }
+
+    pixelPlan = formats::plan(decoderFormat, encoder->pix_fmts);
+    for (const formats::Conversion& conversion : pixelPlan.conversions) {
+        logger::write(conversion.folded ? logger::Level::Info : logger::Level::Warning, logger::Stage::Pipeline, jobId,
+                      logger::NoFrame, 0, "Pixel format conversion: %s", conversion.describe().c_str());
+    }
+    logger::info(logger::Stage::Pipeline, jobId, logger::NoFrame, "Pixel formats %s -> %s -> %s, %d extra passes",
+                 formats::Conversion::name(pixelPlan.decoder).c_str(), formats::Conversion::name(pixelPlan.graph).c_str(),
+                 formats::Conversion::name(pixelPlan.encoder).c_str(), pixelPlan.extraPasses());
+    return true;
+}
+
+// Buffers that never reach the encoder are allocated once and reused
+bool VideoConverter::reuseFrame(handles::Frame& frame, AVPixelFormat format, int width, int height) {
+    if (frame && frame->format == format && frame->width == width && frame->height == height) {
+        return true;
+    }
+    frame = handles::allocFrame();
+    if (!frame) {
+        return false;
+    }
+    frame->format = format;
+    frame->width = width;
+    frame->height = height;
+    if (av_frame_get_buffer(frame, 0) < 0) {
+        frame.reset();
+        return false;
+    }
+    return true;
+}
+
+// Scale to cover the output size, center crop and display rotation in one pass
+bool VideoConverter::applyGeometry(const AVFrame* in, AVFrame* out) {
+    if (!scaler.configured(in->width, in->height, in->format) &&
+        !scaler.configure(in->width, in->height, in->format, orientation, settings.width, settings.height)) {
+        LOG_FRAME_ERROR(logger::Stage::Filter, jobId, frameNumber, "Unsupported frame for scaling: %dx%d %s",
+                        in->width, in->height, av_get_pix_fmt_name((AVPixelFormat)in->format));
+        return false;
+    }
+
+    out->format = pixelPlan.encoder;
+    out->width = scaler.width();
+    out->height = scaler.height();
+    if (frameArena ? !frameArena->allocate(out) : av_frame_get_buffer(out, 0) < 0) {
+        LOG_FRAME_ERROR(logger::Stage::Filter, jobId, frameNumber, "Could not allocate scaled frame");
+        return false;
+    }
+    av_frame_copy_props(out, in);
+
+    // Our stages write yuv420p, straight into the encoder frame when that is what it takes
+    AVFrame* native = out;
+    if (pixelPlan.encoder != AV_PIX_FMT_YUV420P) {
+        if (!reuseFrame(nativeFrame, AV_PIX_FMT_YUV420P, out->width, out->height)) {
+            LOG_FRAME_ERROR(logger::Stage::Filter, jobId, frameNumber, "Could not allocate native frame");
+            return false;
+        }
+        native = nativeFrame;
+    }
+
+    // Bands of output rows on the shared pool, a 10-bit band is tone mapped right after
+    // it is scaled while it is still in cache
+    async::WorkerPool& bandPool = pool();
+    const int bands = std::max(1, std::min(scaleThreads > 0 ? scaleThreads : (int)bandPool.size(), out->height / 64));
+
+    if (scaler.outputFormat() == AV_PIX_FMT_YUV420P) {
+        async::parallelFor(bandPool, bands, [&](int i) {
+            const auto rows = geometry::Scaler::band(out->height, i, bands);
+            scaler.process(in, native, rows.first, rows.second);
+        });
+    } else {
+        // 10-bit: scale first so the tone mapper only sees output pixels
+        if (!reuseFrame(wideFrame, AV_PIX_FMT_YUV420P10LE, out->width, out->height)) {
+            LOG_FRAME_ERROR(logger::Stage::Filter, jobId, frameNumber, "Could not allocate 10-bit frame");
+            return false;
+        }
+        if (!toneMapper.configured(colorSource)) {
+            toneMapper.configure(colorSource);
+        }
+        async::parallelFor(bandPool, bands, [&](int i) {
+            const auto rows = geometry::Scaler::band(out->height, i, bands);
+            scaler.process(in, wideFrame, rows.first, rows.second);
+            toneMapper.process(wideFrame, native, rows.first, rows.second);
+        });
+        out->color_primaries = AVCOL_PRI_BT709;
+        out->color_trc = AVCOL_TRC_BT709;
+        out->colorspace = AVCOL_SPC_BT709;
+        out->color_range = AVCOL_RANGE_MPEG;
+    }
+
+    // The one planned conversion at output size, for encoders without yuv420p
+    if (native != out) {
+        // Returns the same context while nothing changed, frees it when it makes another
+        encoderSws.reset(sws_getCachedContext(encoderSws.release(), native->width, native->height, AV_PIX_FMT_YUV420P,
+                                              out->width, out->height, pixelPlan.encoder, SWS_POINT, nullptr, nullptr, nullptr));
+        if (!encoderSws) {
+            LOG_FRAME_ERROR(logger::Stage::Filter, jobId, frameNumber, "Cannot convert to the encoder format");
+            return false;
+        }
+        sws_scale(encoderSws, native->data, native->linesize, 0, native->height, out->data, out->linesize);
+    }
+    return true;
+}
+
+bool VideoConverter::encodeAndWrite(AVFrame* frame) {
+    // Outside the requested range, the fps filter and decode-from-keyframe produce these
+    if (frame->pts < rangeStartPts || (rangeEndPts != AV_NOPTS_VALUE && frame->pts >= rangeEndPts)) {
+        return true;
+    }
+
+    if (!workDir.empty()) {
+        // Already encoded into a completed chunk by an earlier run
+        if (resumePts != AV_NOPTS_VALUE && frame->pts < resumePts) {
+            return true;
+        }
+
+        if (cutPts != AV_NOPTS_VALUE && frame->pts >= cutPts) {
+            if (!flushEncoder() || !finishChunk(frame->pts, cutSourcePts) || !startChunk()) {
+                return false;
+            }
+            chunkSourceStart = cutSourcePts;
+            cutPts = AV_NOPTS_VALUE;
+        }
+        if (chunkStartPts == AV_NOPTS_VALUE) {
+            chunkStartPts = frame->pts;
+        }
+    }
+    lastFramePts = frame->pts;
+
+    const bool sceneCut = reachedSceneCut(frame->pts);
+    if (settings.sceneThreshold >= 0) {
+        placeKeyframe(frame, sceneCut);
+    }
+
+    if (frameWriter && !frameWriter->add(frame, sceneCut)) {
+        logger::warning(logger::Stage::Job, jobId, frameNumber, "Frames do not fit the frame cache, not keeping them");
+        frameWriter.reset();
+    }
+
+    handles::Packet pkt = handles::allocPacket();
+    if (!pkt) {
+        logError(logger::Stage::Encode, "Could not allocate packet");
+        return false;
+    }
+
+    if (qualityMonitor) {
+        qualityMonitor->reference(frame);
+        usage[memory::Stage::Quality].set((int64_t)qualityMonitor->pending());
+    }
+    int response = avcodec_send_frame(outputCodecCtx, frame);
+    if (response < 0) {
+        LOG_FRAME_ERROR(logger::Stage::Encode, jobId, frameNumber, "Failed to send frame for encoding");
+        return false;
+    }
+    usage[memory::Stage::Encode].enter();
+    if (job) {
+        job->frameDone();
+    }
+
+    while (response >= 0) {
+        response = avcodec_receive_packet(outputCodecCtx, pkt);
+        if (response == AVERROR(EAGAIN) || response == AVERROR_EOF) {
+            break; // No more packets to process from the encoder
+        } else if (response < 0) {
+            LOG_FRAME_ERROR(logger::Stage::Encode, jobId, frameNumber, "Error during encoding");
+            return false;
+        }
+        usage[memory::Stage::Encode].leave();
+
+        if (!writePacket(pkt)) {
+            LOG_FRAME_ERROR(logger::Stage::Mux, jobId, frameNumber, "Error while writing frame to output");
+            return false;
+        }
+    }
+    return true;
+}
+
+// Chunks keep source-timeline timestamps, the offset is applied when they are assembled
+bool VideoConverter::writePacket(AVPacket* pkt) {
+    if (qualityMonitor) {
+        qualityMonitor->packet(pkt);
+    }
+    if (workDir.empty()) {
+        if (pkt->pts != AV_NOPTS_VALUE) {
+            pkt->pts -= outputOffsetPts;
+        }
+        if (pkt->dts != AV_NOPTS_VALUE) {
+            pkt->dts -= outputOffsetPts;
+        }
+    }
+    pkt->stream_index = 0;
+    av_packet_rescale_ts(pkt, outputCodecCtx->time_base, outputFormatCtx->streams[0]->time_base);
+    frontIndex.muxed(pkt);
+    return av_interleaved_write_frame(outputFormatCtx, pkt) >= 0;
+}
+
+bool VideoConverter::flushEncoder() {
+    if (!outputCodecCtx) {
+        return true; // Nothing was encoded in this run
+    }
+
+    handles::Packet pkt = handles::allocPacket();
+    if (!pkt) {
+        logError(logger::Stage::Encode, "Could not allocate packet");
+        return false;
+    }
+
+    // Send a NULL frame to the encoder to flush remaining frames
+    int response = avcodec_send_frame(outputCodecCtx, nullptr);
+    if (response < 0) {
+        logError(logger::Stage::Encode, "Failed to send flush frame");
+        return false;
+    }
+
+    while (response >= 0) {
+        response = avcodec_receive_packet(outputCodecCtx, pkt);
+        if (response == AVERROR(EAGAIN) || response == AVERROR_EOF) {
+            break;  // No more packets to flush
+        } else if (response < 0) {
+            logError(logger::Stage::Encode, "Error during flushing encoder");
+            return false;
+        }
+
+        if (!writePacket(pkt)) {
+            logError(logger::Stage::Mux, "Error while writing flushed frame");
+            return false;
+        }
+    }
+    usage[memory::Stage::Encode].set(0);
+    return true;
+}
+
+
+bool VideoConverter::finalizeOutputFile() {
+    if (!workDir.empty()) {
+        if (!manifest.complete) {
+            const int64_t endPts = rangeEndPts != AV_NOPTS_VALUE ? rangeEndPts :
+                                   lastFramePts == AV_NOPTS_VALUE ? 0 : lastFramePts + 1;
+            const int64_t sourceEnd = encodeRanges.empty() ? incremental::OpenEnd : encodeRanges.back().end;
+            if (!finishChunk(endPts, sourceEnd)) {
+                return false;
+            }
+
+            // Link the reused chunks into this work directory and put everything in timeline order
+            const std::string extension = std::filesystem::path(outputFilename).extension().string();
+            for (checkpoint::Chunk chunk : reusedChunks) {
+                const std::filesystem::path source = std::filesystem::path(previousWorkDir) / chunk.file;
+                chunk.index = (int)manifest.chunks.size();
+                chunk.file = checkpoint::Manifest::chunkFileName(chunk.index, extension);
+                const std::filesystem::path target = std::filesystem::path(workDir) / chunk.file;
+
+                std::error_code error;
+                std::filesystem::remove(target, error);
+                std::filesystem::create_hard_link(source, target, error);
+                if (error) {
+                    error.clear();
+                    std::filesystem::copy_file(source, target, error);
+                }
+                if (error) {
+                    logError(logger::Stage::Job, "Failed to reuse chunk " + source.string());
+                    return false;
+                }
+                manifest.chunks.push_back(chunk);
+            }
+            std::sort(manifest.chunks.begin(), manifest.chunks.end(), [](const checkpoint::Chunk& a, const checkpoint::Chunk& b) {
+                return a.startPts < b.startPts;
+            });
+            for (size_t i = 0; i < manifest.chunks.size(); i++) {
+                manifest.chunks[i].index = (int)i;
+            }
+
+            manifest.complete = true;
+            if (!manifest.save(workDir)) {
+                logError(logger::Stage::Job, "Failed to save checkpoint manifest");
+                return false;
+            }
+        }
+        return assembleChunks();
+    }
+
+    finishQualitySegment();
+    return writeTrailer(outputFormatCtx, frontIndex);
+}
+
+/*
+
+Resumable Conversion
+The output is encoded as a sequence of independent chunk files, each with its own encoder
+so every chunk starts on a keyframe. A chunk is cut at the first source keyframe after
+chunkSeconds, which is also where a later run seeks to when it resumes.
+
+*/
+
+void VideoConverter::setResumable(const std::string& dir, int seconds) {
+    workDir = dir;
+    chunkSeconds = seconds;
+}
+
+bool VideoConverter::prepareResume() {
+    std::error_code error;
+    std::filesystem::create_directories(workDir, error);
+    if (error) {
+        logError(logger::Stage::Job, "Could not create work directory " + workDir);
+        return false;
+    }
+
+    // Incremental runs are short and always start from a fresh manifest
+    const std::string fingerprint = checkpoint::Manifest::fingerprintOf(inputFilename);
+    if (!previousWorkDir.empty() || !manifest.load(workDir) || manifest.input != inputFilename ||
+        manifest.fingerprint != fingerprint || manifest.settings != requested.normalized()) {
+        manifest = checkpoint::Manifest();
+        manifest.input = inputFilename;
+        manifest.fingerprint = fingerprint;
+        manifest.settings = requested.normalized();
+        if (!manifest.save(workDir)) {
+            logError(logger::Stage::Job, "Failed to save checkpoint manifest");
+            return false;
+        }
+    }
+
+    if (manifest.complete) {
+        logger::info(logger::Stage::Job, jobId, logger::NoFrame, "All %zu chunks already encoded", manifest.chunks.size());
+        return true;
+    }
+
+    if (!previousWorkDir.empty()) {
+        if (!planIncremental()) {
+            return false;
+        }
+    } else if (!manifest.chunks.empty()) {
+        // Continue from the keyframe the last completed chunk was cut at
+        const checkpoint::Chunk& last = manifest.chunks.back();
+        resumePts = last.endPts;
+        encodeRanges.front().start = last.sourceEnd;
+
+        logger::info(logger::Stage::Job, jobId, logger::NoFrame, "Resuming after chunk %d at pts %lld",
+                     last.index, (long long)resumePts);
+    }
+
+    if (encodeRanges.empty()) {
+        return true; // Everything is reused
+    }
+    return startChunk();
+}
+
+bool VideoConverter::startChunk() {
+    const std::string extension = std::filesystem::path(outputFilename).extension().string();
+    const std::string partial = "partial." + checkpoint::Manifest::chunkFileName((int)manifest.chunks.size(), extension);
+
+    chunkStartPts = AV_NOPTS_VALUE;
+    if (!openOutputFile((std::filesystem::path(workDir) / partial).string())) {
+        logError(logger::Stage::Mux, "Failed to open chunk file");
+        return false;
+    }
+    return true;
+}
+
+// Expects the encoder to be flushed already
+bool VideoConverter::finishChunk(int64_t endPts, int64_t sourceEnd) {
+    if (!outputFormatCtx) {
+        return true;
+    }
+    finishQualitySegment();
+
+    const int index = (int)manifest.chunks.size();
+    const std::string extension = std::filesystem::path(outputFilename).extension().string();
+    const std::filesystem::path dir(workDir);
+    const std::string file = checkpoint::Manifest::chunkFileName(index, extension);
+
+    const bool empty = chunkStartPts == AV_NOPTS_VALUE;
+    if (!empty && av_write_trailer(outputFormatCtx) < 0) {
+        logError(logger::Stage::Mux, "Error writing chunk trailer");
+        return false;
+    }
+    closeOutputFile();
+
+    std::error_code error;
+    if (empty) {
+        std::filesystem::remove(dir / ("partial." + file), error);
+        return true;
+    }
+
+    std::filesystem::rename(dir / ("partial." + file), dir / file, error);
+    if (error) {
+        logError(logger::Stage::Mux, "Failed to move chunk " + file + " into place");
+        return false;
+    }
+
+    checkpoint::Chunk chunk;
+    chunk.index = index;
+    chunk.startPts = chunkStartPts;
+    chunk.endPts = endPts;
+    chunk.sourceStart = chunkSourceStart;
+    chunk.sourceEnd = sourceEnd;
+    chunk.file = file;
+    chunk.sourceHash = packetHashes.rangeHash({chunkSourceStart, sourceEnd});
+    if (sourceEnd != incremental::OpenEnd) {
+        packetHashes.discardBefore(sourceEnd);
+    }
+    manifest.chunks.push_back(chunk);
+    if (!manifest.save(workDir)) {
+        logError(logger::Stage::Job, "Failed to save checkpoint manifest");
+        return false;
+    }
+
+    logger::info(logger::Stage::Mux, jobId, frameNumber, "Chunk %d done, pts %lld-%lld",
+                 index, (long long)chunk.startPts, (long long)chunk.endPts);
+    return true;
+}
+
+// Called for every decoded frame, schedules a cut at the first keyframe past chunkSeconds
+void VideoConverter::checkChunkCut(const AVFrame* frame, bool sceneCut) {
+    if (workDir.empty()) {
+        return;
+    }
+
+    const int64_t sourcePts = frame->best_effort_timestamp;
+    if (sourcePts == AV_NOPTS_VALUE) {
+        return;
+    }
+    if (chunkSourceStart == AV_NOPTS_VALUE) {
+        chunkSourceStart = sourcePts;
+    }
+
+    if (!frame->key_frame || cutPts != AV_NOPTS_VALUE || chunkStartPts == AV_NOPTS_VALUE) {
+        return;
+    }
+
+    const AVRational streamTimeBase = inputFormatCtx->streams[videoStreamIndex]->time_base;
+    const int64_t outputPts = av_rescale_q(sourcePts, streamTimeBase, outputCodecCtx->time_base);
+    const int64_t length = outputPts - chunkStartPts;
+    const int64_t target = (int64_t)chunkSeconds * settings.frameRate;
+
+    // With scene detection a keyframe on a cut is worth waiting for, up to twice the length
+    const bool due = sceneDetector ? (length >= target && sceneCut) || length >= 2 * target : length >= target;
+    if (due) {
+        cutPts = outputPts;
+        cutSourcePts = sourcePts;
+    }
+}
+
+/*
+
+Scene Cuts
+See scenes.hpp. Cuts are found on decoded source frames, so the chunk cutter above can
+prefer source keyframes on a cut, and reach the encoder as the first frame at or after
+the cut's time once the fps filter is done with them. Every cut then gets a keyframe
+unless the last one is closer than minGopSeconds, and no GOP runs past maxGopSeconds.
+Keyframes are always set or cleared explicitly, so a keyframe in the source no longer
+forces one in the output on its own. With fastStart the GOP limit is also at most
+seekIntervalSeconds.
+
+*/
+
+bool VideoConverter::detectScene(const AVFrame* frame) {
+    if (!sceneDetector || !sceneDetector->cut(frame)) {
+        return false;
+    }
+    if (frame->best_effort_timestamp != AV_NOPTS_VALUE) {
+        pendingCuts.push_back(toOutputPts(frame->best_effort_timestamp));
+    }
+    return true;
+}
+
+bool VideoConverter::reachedSceneCut(int64_t pts) {
+    bool reached = false;
+    while (!pendingCuts.empty() && pendingCuts.front() <= pts) {
+        pendingCuts.pop_front();
+        reached = true;
+    }
+    return reached;
+}
+
+void VideoConverter::placeKeyframe(AVFrame* frame, bool sceneCut) {
+    const int64_t minGop = std::max(1L, std::lround(settings.minGopSeconds * settings.frameRate));
+    const int64_t maxGop = std::max(1L, std::lround(settings.maxKeyframeSeconds() * settings.frameRate));
+    const int64_t distance = framesSinceKey + 1;
+    const bool key = framesSinceKey < 0 || distance >= maxGop || (sceneCut && distance >= minGop);
+
+    frame->pict_type = key ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+    framesSinceKey = key ? 0 : distance;
+    if (key && sceneCut) {
+        cutList.push_back((frame->pts - outputOffsetPts) / (double)settings.frameRate);
+    }
+}
+
+/*
+
+Side Outputs
+Images are cut from decoded source frames before the filter graph, times are relative
+to the start of the requested range. They need every frame of the range in order, so
+resumed and incremental runs, which skip parts of it, leave them out.
+
+*/
+
+bool VideoConverter::startSideOutputs() {
+    if (!sideOutputOptions && !tensorOptions) {
+        return true;
+    }
+    if (encodeRanges.size() != 1 || resumePts != AV_NOPTS_VALUE || !previousWorkDir.empty()) {
+        logger::warning(logger::Stage::Pipeline, jobId, logger::NoFrame, "Side outputs need a full decode of the range, skipped");
+        return true;
+    }
+
+    const AVStream* stream = inputFormatCtx->streams[videoStreamIndex];
+    const incremental::SourceRange range = encodeRanges.front();
+    const int64_t streamStart = stream->start_time == AV_NOPTS_VALUE ? 0 : stream->start_time;
+    double duration = durationSeconds() - (range.start - streamStart) * av_q2d(stream->time_base);
+    if (range.end != incremental::OpenEnd) {
+        duration = (range.end - range.start) * av_q2d(stream->time_base);
+    }
+
+    if (sideOutputOptions) {
+        sideOutputs = std::make_unique<thumbnails::Extractor>(*sideOutputOptions, duration, orientation, colorSource, jobId);
+    }
+    if (tensorOptions) {
+        tensorExport = std::make_unique<tensors::Exporter>(*tensorOptions, orientation, colorSource, outputFilename, jobId);
+    }
+    return true;
+}
+
+bool VideoConverter::offerSideOutputs(const AVFrame* frame) {
+    if ((!sideOutputs && !tensorExport) || frame->best_effort_timestamp < encodeRanges.front().start) {
+        return true;
+    }
+
+    const AVStream* stream = inputFormatCtx->streams[videoStreamIndex];
+    const double seconds = (frame->best_effort_timestamp - encodeRanges.front().start) * av_q2d(stream->time_base);
+    if (tensorExport && tensorExport->wants(seconds) && !tensorExport->offer(frame, seconds)) {
+        LOG_FRAME_ERROR(logger::Stage::Pipeline, jobId, frameNumber, "Failed to export tensors");
+        return false;
+    }
+    if (!sideOutputs || !sideOutputs->wants(seconds)) {
+        return true;
+    }
+    if (!sideOutputs->offer(frame, seconds)) {
+        LOG_FRAME_ERROR(logger::Stage::Pipeline, jobId, frameNumber, "Failed to write side outputs");
+        return false;
+    }
+    return true;
+}
+
+/*
+
+Source Range
+Ranges are in source pts, frames are decoded from the keyframe before the start and
+everything outside the range is dropped before the encoder.
+Trims of a source already in the output format copy their whole GOPs, see Stream Copy.
+
+*/
+
+void VideoConverter::setSourceRange(double startSeconds, double endSeconds) {
+    rangeStartSeconds = startSeconds;
+    rangeEndSeconds = endSeconds;
+}
+
+void VideoConverter::setIncremental(const std::string& dir) {
+    previousWorkDir = dir;
+}
+
+incremental::SourceRange VideoConverter::requestedRange() const {
+    const AVStream* stream = inputFormatCtx->streams[videoStreamIndex];
+    const int64_t streamStart = stream->start_time == AV_NOPTS_VALUE ? 0 : stream->start_time;
+
+    incremental::SourceRange range;
+    range.start = streamStart + (int64_t)(rangeStartSeconds / av_q2d(stream->time_base));
+    if (rangeEndSeconds >= 0) {
+        range.end = streamStart + (int64_t)(rangeEndSeconds / av_q2d(stream->time_base));
+    }
+    return range;
+}
+
+int64_t VideoConverter::toOutputPts(int64_t sourcePts) const {
+    return av_rescale_q(sourcePts, inputFormatCtx->streams[videoStreamIndex]->time_base, AVRational{1, settings.frameRate});
+}
+
+bool VideoConverter::beginRange(size_t index) {
+    activeRange = encodeRanges[index];
+    rangeStartPts = toOutputPts(activeRange.start);
+    rangeEndPts = activeRange.end == incremental::OpenEnd ? AV_NOPTS_VALUE : toOutputPts(activeRange.end);
+    chunkSourceStart = activeRange.start;
+    pendingCuts.clear();
+    if (sceneDetector) {
+        sceneDetector->reset();
+    }
+
+    // The first range of a plain conversion starts where the demuxer already is
+    const AVStream* stream = inputFormatCtx->streams[videoStreamIndex];
+    const int64_t streamStart = stream->start_time == AV_NOPTS_VALUE ? 0 : stream->start_time;
+    if (index == 0 && activeRange.start <= streamStart && previousWorkDir.empty() && !copyRange) {
+        return true;
+    }
+
+    if (av_seek_frame(inputFormatCtx, videoStreamIndex, activeRange.start, AVSEEK_FLAG_BACKWARD) < 0) {
+        logError(logger::Stage::Demux, "Failed to seek to the start of the range");
+        return false;
+    }
+    avcodec_flush_buffers(inputCodecCtx);
+    usage[memory::Stage::Decode].set(0);
+
+    // The filter graph saw EOF at the end of the previous range
+    if (index > 0) {
+        filterGraph.reset();
+        usage[memory::Stage::Filter].set(0);
+        if (!initFilters()) {
+            logError(logger::Stage::Filter, "Failed to initialize filters");
+            return false;
+        }
+    }
+    return true;
+}
+
+// Phones store portrait video as landscape frames plus a display matrix
+geometry::Transform VideoConverter::sourceOrientation() const {
+    const AVCodecParameters* codecpar = inputFormatCtx->streams[videoStreamIndex]->codecpar;
+    const AVPacketSideData* matrix = av_packet_side_data_get(codecpar->coded_side_data, codecpar->nb_coded_side_data,
+                                                             AV_PKT_DATA_DISPLAYMATRIX);
+    return geometry::Transform::fromDisplayMatrix(matrix && matrix->size >= 9 * sizeof(int32_t) ? (const int32_t*)matrix->data : nullptr);
+}
+
+/*
+
+Stream Copy
+A trim of a source that is already in the output format only re-encodes the partial
+GOPs at its edges, the whole GOPs between them are copied packet for packet:
+
+	source   K-----K-----K-----K-----K-----K
+	range       [=====================)
+	output      [enc)|copy-------|[enc)
+
+The head runs from the range start to the first keyframe in the range and is decoded
+from the keyframe before it as usual, the tail from the last keyframe in the range to
+its end. Each edge gets its own encoder, so the tail starts on a keyframe as well.
+Copied GOPs must decode on their own with the output's stream parameters: same codec,
+size, pixel format and frame rate, no frame reordering across the cut, no display
+rotation and extradata the encoder would write too. Anything that needs every frame
+or places keyframes itself rules it out.
+
+*/
+
+bool VideoConverter::canStreamCopy() const {
+    const AVStream* stream = inputFormatCtx->streams[videoStreamIndex];
+    const AVCodecParameters* source = stream->codecpar;
+    if (!streamCopy || (rangeStartSeconds <= 0 && rangeEndSeconds < 0) || !workDir.empty() ||
+        sideOutputOptions || tensorOptions || settings.duplicateThreshold >= 0 || settings.sceneThreshold >= 0 ||
+        settings.fastStart) {
+        return false;
+    }
+    if (source->codec_id != outputCodecCtx->codec_id || source->width != settings.width ||
+        source->height != settings.height || source->format != outputCodecCtx->pix_fmt ||
+        source->video_delay > 0 || pixelPlan.toneMap || av_cmp_q(stream->avg_frame_rate, AVRational{settings.frameRate, 1}) != 0 ||
+        !sourceOrientation().identity()) {
+        return false;
+    }
+    return source->extradata_size == outputCodecCtx->extradata_size &&
+           (source->extradata_size == 0 || memcmp(source->extradata, outputCodecCtx->extradata, source->extradata_size) == 0);
+}
+
+// Demux-only pass over the range for its first and last keyframes
+bool VideoConverter::planStreamCopy() {
+    if (!canStreamCopy()) {
+        return true;
+    }
+
+    const incremental::SourceRange range = encodeRanges.front();
+    if (av_seek_frame(inputFormatCtx, videoStreamIndex, range.start, AVSEEK_FLAG_BACKWARD) < 0) {
+        logError(logger::Stage::Demux, "Failed to seek to the start of the range");
+        return false;
+    }
+    handles::Packet packet = handles::allocPacket();
+    if (!packet) {
+        logError(logger::Stage::Demux, "Could not allocate packet");
+        return false;
+    }
+
+    int64_t first = AV_NOPTS_VALUE;
+    int64_t last = AV_NOPTS_VALUE;
+    while (av_read_frame(inputFormatCtx, packet) >= 0) {
+        const bool key = packet->stream_index == videoStreamIndex && (packet->flags & AV_PKT_FLAG_KEY) &&
+                         packet->pts != AV_NOPTS_VALUE;
+        const int64_t pts = packet->pts;
+        av_packet_unref(packet);
+        if (!key || pts < range.start) {
+            continue;
+        }
+        if (range.end != incremental::OpenEnd && pts > range.end) {
+            break;
+        }
+        if (first == AV_NOPTS_VALUE) {
+            first = pts;
+        }
+        last = pts;
+        if (range.end == incremental::OpenEnd) {
+            break; // Copied through to the end of the source
+        }
+    }
+
+    if (first == AV_NOPTS_VALUE || (range.end != incremental::OpenEnd && last <= first)) {
+        logger::info(logger::Stage::Demux, jobId, logger::NoFrame, "No whole GOP in the range, encoding all of it");
+        return true;
+    }
+
+    copyRange = incremental::SourceRange{first, range.end == incremental::OpenEnd ? incremental::OpenEnd : last};
+    encodeRanges.clear();
+    if (range.start < first) {
+        encodeRanges.push_back({range.start, first});
+    }
+    if (copyRange->end != incremental::OpenEnd && copyRange->end < range.end) {
+        encodeRanges.push_back({copyRange->end, range.end});
+    }
+    if (frameWriter) {
+        frameWriter.reset(); // The cache holds every frame, a copy skips most of them
+    }
+
+    const double timeBase = av_q2d(inputFormatCtx->streams[videoStreamIndex]->time_base);
+    logger::info(logger::Stage::Mux, jobId, logger::NoFrame, "Copying source GOPs from %.3f s to %s, %zu edge ranges to encode",
+                 first * timeBase, copyRange->end == incremental::OpenEnd ? "the end" :
+                 (std::to_string(copyRange->end * timeBase) + " s").c_str(), encodeRanges.size());
+    return true;
+}
+
+// Between the edge ranges: flushes the head's encoder, copies, and starts a fresh encoder
+bool VideoConverter::copySourceRange() {
+    const incremental::SourceRange range = *copyRange;
+    copyRange.reset();
+
+    if (lastFramePts != AV_NOPTS_VALUE) {
+        if (!flushEncoder()) {
+            return false;
+        }
+        finishQualitySegment();
+        outputCodecCtx.reset();
+        if (!setupEncoder(outputCodecCtx, outputFormatCtx->streams[0])) {
+            logError(logger::Stage::Encode, "Failed to set up encoder for the end of the range");
+            return false;
+        }
+        startQualitySegment();
+        framesSinceKey = -1;
+    }
+
+    if (av_seek_frame(inputFormatCtx, videoStreamIndex, range.start, AVSEEK_FLAG_BACKWARD) < 0) {
+        logError(logger::Stage::Demux, "Failed to seek to the copied range");
+        return false;
+    }
+    handles::Packet packet = handles::allocPacket();
+    if (!packet) {
+        logError(logger::Stage::Mux, "Could not allocate packet");
+        return false;
+    }
+
+    const AVRational sourceBase = inputFormatCtx->streams[videoStreamIndex]->time_base;
+    const AVRational outputBase = outputFormatCtx->streams[0]->time_base;
+    const int64_t offset = av_rescale_q(outputOffsetPts, AVRational{1, settings.frameRate}, outputBase);
+    int64_t copied = 0;
+    bool ok = true;
+    while (ok && av_read_frame(inputFormatCtx, packet) >= 0) {
+        if (packet->stream_index != videoStreamIndex || packet->pts == AV_NOPTS_VALUE || packet->pts < range.start) {
+            av_packet_unref(packet);
+            continue;
+        }
+        // The tail's keyframe, its GOP is encoded
+        if (range.end != incremental::OpenEnd && packet->pts >= range.end) {
+            av_packet_unref(packet);
+            break;
+        }
+
+        av_packet_rescale_ts(packet, sourceBase, outputBase);
+        packet->pts -= offset;
+        if (packet->dts != AV_NOPTS_VALUE) {
+            packet->dts -= offset;
+        }
+        packet->stream_index = 0;
+        packet->pos = -1;
+        frontIndex.muxed(packet);
+        if (av_interleaved_write_frame(outputFormatCtx, packet) < 0) {
+            logError(logger::Stage::Mux, "Error while writing copied packet");
+            ok = false;
+        }
+        av_packet_unref(packet);
+        copied++;
+        if (job) {
+            job->frameDone();
+            if (job->cancelled()) {
+                logger::info(logger::Stage::Job, jobId, logger::NoFrame, "Conversion cancelled");
+                ok = false;
+            }
+        }
+    }
+
+    if (ok) {
+        logger::info(logger::Stage::Mux, jobId, logger::NoFrame, "Copied %lld packets", (long long)copied);
+    }
+    return ok;
+}
+
+bool VideoConverter::planIncremental() {
+    checkpoint::Manifest previous;
+    if (!previous.load(previousWorkDir)) {
+        logger::warning(logger::Stage::Job, jobId, logger::NoFrame, "No previous manifest in %s, encoding everything",
+                        previousWorkDir.c_str());
+        return true;
+    }
+
+    std::vector<uint64_t> hashes;
+    if (!hashSourceRanges(previous.chunks, hashes)) {
+        return false;
+    }
+
+    encodeRanges.clear();
+    reusedChunks.clear();
+    for (const incremental::Segment& segment : incremental::plan(previous, requested.normalized(), requestedRange(), hashes)) {
+        if (segment.reuse) {
+            reusedChunks.push_back(segment.chunk);
+        } else {
+            encodeRanges.push_back(segment.range);
+        }
+    }
+
+    logger::info(logger::Stage::Job, jobId, logger::NoFrame, "Incremental plan: %zu reused chunks, %zu ranges to encode",
+                 reusedChunks.size(), encodeRanges.size());
+    return true;
+}
+
+// Demux-only pass over the source, hashing packets the same way the encode path does
+bool VideoConverter::hashSourceRanges(const std::vector<checkpoint::Chunk>& chunks, std::vector<uint64_t>& hashes) {
+    handles::Packet packet = handles::allocPacket();
+    if (!packet) {
+        return false;
     }
-    if (filterGraph) {
-        avfilter_graph_free(&filterGraph);
+
+    incremental::PacketHashes source;
+    while (av_read_frame(inputFormatCtx, packet) >= 0) {
+        if (packet->stream_index == videoStreamIndex && packet->pts != AV_NOPTS_VALUE) {
+            source.add(packet->pts, packet->data, packet->size);
+        }
+        av_packet_unref(packet);
+    }
+
+    hashes.clear();
+    for (const checkpoint::Chunk& chunk : chunks) {
+        hashes.push_back(source.rangeHash({chunk.sourceStart, chunk.sourceEnd}));
+    }
+    return true;
+}
+
+/*
+
+Assemble Chunks
+Stream-copies every chunk into the final output, timestamps are already continuous. The
+chunks give the exact frame count for the fast start reservation.
+
+*/
+
+bool VideoConverter::assembleChunks() {
+    handles::OutputFormat output;
+    avformat_alloc_output_context2(output.address(), nullptr, nullptr, outputFilename.c_str());
+    if (!output) {
+        logError(logger::Stage::Mux, "Could not create output context");
+        return false;
+    }
+
+    handles::Packet pkt = handles::allocPacket();
+    bool ok = pkt != nullptr;
+    AVStream* outputStream = nullptr;
+    seeking::FrontIndex index;
+    int64_t frames = 0;
+    for (const checkpoint::Chunk& chunk : manifest.chunks) {
+        frames += chunk.endPts - chunk.startPts;
+    }
+
+    for (size_t i = 0; ok && i < manifest.chunks.size(); i++) {
+        const std::string path = (std::filesystem::path(workDir) / manifest.chunks[i].file).string();
+        handles::InputFormat chunk;
+        if (avformat_open_input(chunk.address(), path.c_str(), nullptr, nullptr) < 0 ||
+            avformat_find_stream_info(chunk, nullptr) < 0) {
+            logError(logger::Stage::Mux, "Could not open chunk " + path);
+            ok = false;
+            break;
+        }
+
+        if (!outputStream) {
+            outputStream = avformat_new_stream(output, nullptr);
+            if (!outputStream || avcodec_parameters_copy(outputStream->codecpar, chunk->streams[0]->codecpar) < 0) {
+                logError(logger::Stage::Mux, "Failed to create assembled output stream");
+                ok = false;
+                break;
+            }
+            outputStream->codecpar->codec_tag = 0;
+            outputStream->time_base = chunk->streams[0]->time_base;
+
+            AVDictionary* options = muxerOptions(output, frames, index);
+            if ((!(output->oformat->flags & AVFMT_NOFILE) &&
+                 avio_open(&output->pb, outputFilename.c_str(), AVIO_FLAG_WRITE) < 0) ||
+                avformat_write_header(output, &options) < 0) {
+                logError(logger::Stage::Mux, "Could not open output file");
+                av_dict_free(&options);
+                ok = false;
+                break;
+            }
+            av_dict_free(&options);
+            index.opened(output);
+        }
+
+        const int64_t offset = av_rescale_q(outputOffsetPts, AVRational{1, settings.frameRate}, outputStream->time_base);
+        while (av_read_frame(chunk, pkt) >= 0) {
+            av_packet_rescale_ts(pkt, chunk->streams[pkt->stream_index]->time_base, outputStream->time_base);
+            if (pkt->pts != AV_NOPTS_VALUE) {
+                pkt->pts -= offset;
+            }
+            if (pkt->dts != AV_NOPTS_VALUE) {
+                pkt->dts -= offset;
+            }
+            pkt->stream_index = 0;
+            index.muxed(pkt);
+            if (av_interleaved_write_frame(output, pkt) < 0) {
+                logError(logger::Stage::Mux, "Error while writing assembled output");
+                ok = false;
+                break;
+            }
+        }
+        av_packet_unref(pkt);
+    }
+
+    if (ok && outputStream && !writeTrailer(output, index)) {
+        ok = false;
+    }
+
+    output.reset();
+
+    if (ok) {
+        logger::info(logger::Stage::Mux, jobId, logger::NoFrame, "Assembled %zu chunks into %s",
+                     manifest.chunks.size(), outputFilename.c_str());
+    }
+    return ok;
+}
+
+
+// The handles free the same on destruction, this frees the job's memory as soon as it
+// is done and reports on it
+void VideoConverter::cleanupFFmpeg() {
+    inputCodecCtx.reset();
+    outputCodecCtx.reset();
+    inputFormatCtx.reset();
+    outputFormatCtx.reset();
+    filterGraph.reset();
+    wideFrame.reset();
+    nativeFrame.reset();
+    heldFrame.reset();
+    encoderSws.reset();
+
+    if (frameNumber > 0) {
+        logger::info(logger::Stage::Job, jobId, logger::NoFrame, "Peak frames in flight: %s", usage.summary().c_str());
     }
+    if (frameArena) {
+        const arena::Stats stats = frameArena->stats();
+        logger::info(logger::Stage::Job, jobId, logger::NoFrame, "Frame arena: %.1f MB of %s pages, %llu buffers, %llu reused",
+                     stats.mappedBytes / 1048576.0, stats.explicitHugePages ? "explicit huge" : "transparent huge",
+                     (unsigned long long)stats.buffers, (unsigned long long)stats.reused);
+        frameArena.reset();  // Buffers still referenced keep their regions
+    }
+    if (qualityMonitor && qualityMonitor->overall().frames > 0) {
+        const metrics::Score score = qualityMonitor->overall().mean();
+        logger::info(logger::Stage::Job, jobId, logger::NoFrame, "Sampled quality: ssim %.4f (%.2f dB) psnr %.2f dB over %lld frames",
+                     score.ssim, score.ssimDb(), score.psnr, (long long)qualityMonitor->overall().frames);
+    }
+    qualityMonitor.reset();
+    cachedFrames.reset();
+    frameWriter.reset();
 }
 
 
 
 
 
-void VideoConverter::logError(const std::string& error) {
-    std::cerr << "Error: " << error << std::endl;
+/*
+
+Frame Cache
+See frame_cache.hpp. The key adds what the settings do not say about the frames: the
+encoder pixel format and the source range. On a hit the whole decode side is skipped,
+configureFilters included, and the cached frames go to encodeAndWrite as they are.
+
+*/
+
+bool VideoConverter::openFrameCache() {
+    if (!frameCache || !workDir.empty() || sideOutputOptions || tensorOptions) {
+        return true;
+    }
+
+    const incremental::SourceRange range = requestedRange();
+    frameCacheKey = frameCache->key(inputFilename, settings.normalizedFrames() +
+                                    ";format=" + av_get_pix_fmt_name(pixelPlan.encoder) +
+                                    ";range=" + std::to_string(range.start) + "-" + std::to_string(range.end));
+    cachedFrames = frameCache->open(frameCacheKey);
+    const AVRational timeBase{1, settings.frameRate};
+    if (cachedFrames && av_cmp_q(cachedFrames->timeBase(), timeBase) != 0) {
+        cachedFrames.reset();
+    }
+    if (cachedFrames) {
+        logger::info(logger::Stage::Job, jobId, logger::NoFrame, "Frame cache hit %s, %lld frames",
+                     frameCacheKey.c_str(), (long long)cachedFrames->frames());
+        return true;
+    }
+    frameWriter = frameCache->create(frameCacheKey, timeBase);
+    return true;
+}
+
+bool VideoConverter::encodeCachedFrames() {
+    if (job) {
+        job->start(cachedFrames->frames());
+    }
+
+    handles::Frame frame = handles::allocFrame();
+    if (!frame) {
+        logError(logger::Stage::Pipeline, "Failed to allocate frame");
+        return false;
+    }
+    for (int64_t i = 0; i < cachedFrames->frames(); i++) {
+        if (job && job->cancelled()) {
+            logger::info(logger::Stage::Job, jobId, frameNumber, "Conversion cancelled");
+            return false;
+        }
+        frameNumber = i + 1;
+        bool sceneCut = false;
+        if (!cachedFrames->read(i, frame, &sceneCut)) {
+            LOG_FRAME_ERROR(logger::Stage::Decode, jobId, frameNumber, "Could not read cached frame");
+            return false;
+        }
+        if (sceneCut) {
+            pendingCuts.push_back(frame->pts);
+        }
+        const bool ok = encodeAndWrite(frame);
+        av_frame_unref(frame);
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Keeps what this run wrote only when the conversion went through to the end
+void VideoConverter::storeFrames(bool ok) {
+    if (!frameWriter) {
+        return;
+    }
+    if (ok && frameCache->commit(frameCacheKey, *frameWriter)) {
+        logger::info(logger::Stage::Job, jobId, logger::NoFrame, "Stored %lld frames in the frame cache",
+                     (long long)frameWriter->frames());
+    }
+    frameWriter.reset();
+}
+
+/*
+
+Inline Metrics
+See quality::Monitor. A segment starts with every encoder and ends once it is flushed,
+before the muxer closes the file.
+
+*/
+
+void VideoConverter::startQualitySegment() {
+    if (qualityMonitor && !qualityMonitor->begin(outputCodecCtx)) {
+        logger::warning(logger::Stage::Encode, jobId, logger::NoFrame, "Inline metrics off, %s output in %s cannot be scored",
+                        settings.codec.c_str(), av_get_pix_fmt_name(outputCodecCtx->pix_fmt));
+        qualityMonitor.reset();
+    }
+}
+
+void VideoConverter::finishQualitySegment() {
+    if (!qualityMonitor) {
+        return;
+    }
+    const metrics::Average segment = qualityMonitor->finish();
+    if (segment.frames == 0) {
+        return;
+    }
+    const metrics::Score score = segment.mean();
+    logger::info(logger::Stage::Encode, jobId, frameNumber, "Segment %d quality: ssim %.4f (%.2f dB) psnr %.2f dB over %lld frames",
+                 qualitySegments++, score.ssim, score.ssimDb(), score.psnr, (long long)segment.frames);
+    if (job) {
+        job->segmentQuality(segment);
+    }
+}
+
+void VideoConverter::logError(logger::Stage stage, const std::string& error) {
+    logger::error(stage, jobId, frameNumber, "%s", error.c_str());
 }
 
 // #endif // VIDEO_CONVERTER_HPP
 
+async::Task<bool> convertAsync(VideoConverter& converter, async::ConversionJob& job) {
+	co_return co_await converter.run(job);
+}
+
+/*
+
+Two-Tier Conversion
+A low resolution, fast preset preview next to the full quality encode, with a callback
+as each one is ready. Both are started at once, preview first, so on a pool with a single
+free thread the preview still comes out first.
+
+They decode the source separately. Sharing one decode would hold the preview to the pace
+of the full encode, which is what it is meant to get ahead of; on its own the preview
+decodes at reduced resolution without the loop filter, and its encode at a ninth of the
+pixels with the realtime deadline is what makes it arrive in seconds.
+
+*/
+
+struct TierCallbacks {
+	std::function<void(bool ok, const std::string& path)> previewReady;
+	std::function<void(bool ok, const std::string& path)> fullReady;
+};
+
+// Inside a catch, what the exception in flight says
+static std::string thrownText() {
+	try {
+		throw;
+	} catch (const std::exception& e) {
+		return e.what();
+	} catch (...) {
+		return "unknown exception";
+	}
+}
+
+async::Task<bool> convertTwoTier(const std::string& input, const std::string& output, const std::string& previewOutput,
+                                 const OutputSettings& settings, TierCallbacks callbacks,
+                                 async::ConversionJob& previewJob, async::ConversionJob& fullJob) {
+	const auto started = std::chrono::steady_clock::now();
+	VideoConverter preview(input, previewOutput);
+	preview.setSettings(settings.preview());
+	VideoConverter full(input, output);
+	full.setSettings(settings);
+
+	async::Background<bool> previewRun = preview.start(previewJob);
+	async::Background<bool> fullRun = full.start(fullJob);
+
+	// The work of both holds `this` of the converters above, so nothing may leave this
+	// frame before fullRun is done: a throw from the preview or its callback only fails
+	// the preview
+	bool previewOk = false;
+	try {
+		previewOk = co_await previewRun;
+	} catch (...) {
+		logger::error(logger::Stage::Job, preview.getJobId(), previewJob.frames(), "Preview threw: %s", thrownText().c_str());
+	}
+	logger::info(logger::Stage::Job, preview.getJobId(), previewJob.frames(), "Preview %s after %.1f s",
+	             previewOk ? "ready" : "failed",
+	             std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count());
+	if (callbacks.previewReady) {
+		try {
+			callbacks.previewReady(previewOk, previewOutput);
+		} catch (...) {
+			logger::error(logger::Stage::Job, preview.getJobId(), previewJob.frames(), "Preview callback threw: %s",
+			              thrownText().c_str());
+		}
+	}
+
+	bool fullOk = false;
+	try {
+		fullOk = co_await fullRun;
+	} catch (...) {
+		logger::error(logger::Stage::Job, full.getJobId(), fullJob.frames(), "Conversion threw: %s", thrownText().c_str());
+	}
+	if (callbacks.fullReady) {
+		callbacks.fullReady(fullOk, output);
+	}
+	co_return fullOk;
+}
+
 int main() {
+	cache::ResultCache resultCache("cache", 10ULL << 30); // 10 GiB
+
 	VideoConverter converter("input.mov", "output.webm");
-	if (converter.configureInput() && converter.configureOutput() && converter.configureFilters()) {
-	    if (converter.performConversion()) {
-	        converter.flushEncoder();
-	        converter.finalizeOutputFile();
-	    }
-	}
-	converter.cleanupFFmpeg();
-	return 0;
+	converter.setResultCache(&resultCache);
+
+	async::ConversionJob job;
+	bool ok = syncWait(convertAsync(converter, job));
+	logger::info(logger::Stage::Job, converter.getJobId(), job.frames(), "Conversion %s, %.1f fps",
+	             ok ? "finished" : "failed", job.fps());
+
+	const cache::Stats stats = resultCache.getStats();
+	logger::info(logger::Stage::Job, converter.getJobId(), logger::NoFrame, "Result cache hits=%llu misses=%llu evictions=%llu bytes=%llu",
+	             (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+	             (unsigned long long)stats.evictions, (unsigned long long)stats.bytes);
+	logger::flush();
+	return ok ? 0 : 1;
 }
\ No newline at end of file
@@ -0,0 +1,172 @@
+#ifndef ENCODERS_HPP
+#define ENCODERS_HPP
+
+/*
+
+Encoders
+The encoders a conversion can use and how our settings map to each one's own options.
+Everything outside this file picks an encoder by its FFmpeg name (OutputSettings::codec)
+and leaves the private options to configure().
+
+	             speed (slowest .. fastest)          realtime                    lookahead
+	libvpx-vp9   cpu-used 1, 2, 4, 6, 8              deadline realtime, row-mt   lag-in-frames
+	libx264      veryslow, slow, medium, faster,     ultrafast, zerolatency      rc-lookahead
+	             veryfast
+	libsvtav1    preset 4, 6, 8, 9, 10               preset 13, low delay        lookahead
+
+The crf is on the encoder's own scale, which differs: libx264 crf 23 looks about like
+libvpx-vp9 crf 32 and libsvtav1 crf 35. The quality presets say that once, for callers
+that compare encoders rather than tune one. A bitrate with the crf caps the rate: libvpx
+takes it as constrained quality, libx264 and SVT-AV1 as a maximum rate (capped CRF).
+libx264 needs a VBV buffer for that, two seconds of the cap.
+
+Keyframes placed by the converter (pict_type I) and the GOP limits work the same on all
+three. libx264 and libsvtav1 do not fit in WebM; setupEncoder checks the container.
+
+*/
+
+extern "C" {
+	#include <libavcodec/avcodec.h>
+	#include <libavutil/opt.h>
+}
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+
+#include "settings.hpp"
+
+namespace encoders {
+
+enum class Backend { Vp9, H264, Av1 };
+
+// Roughly the same picture on every encoder, Medium the default look
+enum class Quality { Low, Medium, High };
+
+struct Info {
+	Backend backend;
+	const char* encoder;        // FFmpeg encoder name
+	const char* name;
+	int crfs[3];                // By Quality
+};
+
+static constexpr Info Backends[] = {
+	{Backend::Vp9,  "libvpx-vp9", "vp9",  {40, 32, 20}},
+	{Backend::H264, "libx264",    "h264", {28, 23, 18}},
+	{Backend::Av1,  "libsvtav1",  "av1",  {45, 35, 27}},
+};
+
+inline const Info* find(const std::string& encoder) {
+	for (const Info& info : Backends) {
+		if (encoder == info.encoder) {
+			return &info;
+		}
+	}
+	return nullptr;
+}
+
+inline int crf(const Info& info, Quality quality) {
+	return info.crfs[(int)quality];
+}
+
+struct Options {
+	int crf = 20;
+	int64_t maxBitrate = 0;       // 0 for plain constant quality
+	Speed speed = Speed::Fast;
+	bool realtime = false;
+	int lookahead = -1;           // Frames, -1 leaves the preset's own
+};
+
+inline Options options(const OutputSettings& settings, int lookahead = -1) {
+	Options options;
+	options.crf = settings.crf;
+	options.maxBitrate = settings.bitrate;
+	options.speed = settings.speed;
+	options.realtime = settings.realtime;
+	options.lookahead = settings.realtime ? 0 : lookahead;
+	return options;
+}
+
+// Native speed settings, slowest to fastest
+static constexpr int Vp9CpuUsed[] = {1, 2, 4, 6, 8};
+static constexpr const char* X264Presets[] = {"veryslow", "slow", "medium", "faster", "veryfast"};
+static constexpr int SvtPresets[] = {4, 6, 8, 9, 10};   // Past 10 only for low delay, SVT says
+
+/*
+
+Configure
+Rate control and speed on an allocated context that is not open yet. False for an
+encoder without a backend here. summary gets the native options, for the log.
+
+*/
+
+inline bool configure(AVCodecContext* ctx, const Options& options, std::string* summary = nullptr) {
+	const Info* info = ctx->codec ? find(ctx->codec->name) : nullptr;
+	if (!info) {
+		return false;
+	}
+	const int speed = (int)options.speed;
+	std::string text;
+
+	switch (info->backend) {
+	case Backend::Vp9:
+		ctx->bit_rate = options.maxBitrate;
+		av_opt_set_int(ctx->priv_data, "crf", options.crf, 0);
+		av_opt_set_int(ctx->priv_data, "cpu-used", Vp9CpuUsed[speed], 0);
+		if (options.realtime) {
+			av_opt_set(ctx->priv_data, "deadline", "realtime", 0);
+			av_opt_set_int(ctx->priv_data, "row-mt", 1, 0);
+		}
+		if (options.lookahead >= 0) {
+			av_opt_set_int(ctx->priv_data, "lag-in-frames", options.lookahead, 0);
+		}
+		text = "cpu-used " + std::to_string(Vp9CpuUsed[speed]) + (options.realtime ? " realtime" : "");
+		break;
+
+	case Backend::H264:
+		// With a bit_rate libx264 would switch to ABR, the cap goes through the VBV instead
+		ctx->bit_rate = 0;
+		if (options.maxBitrate > 0) {
+			ctx->rc_max_rate = options.maxBitrate;
+			ctx->rc_buffer_size = (int)std::min<int64_t>(INT32_MAX, options.maxBitrate * 2);
+		}
+		av_opt_set_int(ctx->priv_data, "crf", options.crf, 0);
+		av_opt_set(ctx->priv_data, "preset", options.realtime ? "ultrafast" : X264Presets[speed], 0);
+		if (options.realtime) {
+			av_opt_set(ctx->priv_data, "tune", "zerolatency", 0);
+		} else if (options.lookahead >= 0) {
+			av_opt_set_int(ctx->priv_data, "rc-lookahead", options.lookahead, 0);
+		}
+		text = std::string("preset ") + (options.realtime ? "ultrafast zerolatency" : X264Presets[speed]);
+		break;
+
+	case Backend::Av1: {
+		ctx->bit_rate = 0;
+		ctx->rc_max_rate = options.maxBitrate;
+		const int preset = options.realtime ? 13 : SvtPresets[speed];
+		av_opt_set_int(ctx->priv_data, "crf", options.crf, 0);
+		av_opt_set_int(ctx->priv_data, "preset", preset, 0);
+		std::string params;
+		if (options.realtime) {
+			params = "pred-struct=1:lookahead=0";
+		} else if (options.lookahead >= 0) {
+			params = "lookahead=" + std::to_string(options.lookahead);
+		}
+		if (!params.empty()) {
+			av_opt_set(ctx->priv_data, "svtav1-params", params.c_str(), 0);
+		}
+		text = "preset " + std::to_string(preset) + (options.realtime ? " low delay" : "");
+		break;
+	}
+	}
+
+	if (summary) {
+		*summary = std::string(info->encoder) + " " + text + ", crf " + std::to_string(options.crf) +
+		           (options.maxBitrate > 0 ? ", capped at " + std::to_string(options.maxBitrate / 1000) + " kb/s" : "");
+	}
+	return true;
+}
+
+} // namespace encoders
+
+#endif // ENCODERS_HPP
@@ -0,0 +1,117 @@
+#ifndef FORMATS_HPP
+#define FORMATS_HPP
+
+/*
+
+Formats
+Picks the pixel format of every stage up front, so each conversion is one we chose and
+logged instead of one libavfilter or the encoder slipped in.
+
+	decoder ──> filter graph (fps) ──> scaler (+ tone mapper) ──> encoder
+	            sink format             yuv420p[10le] -> yuv420p    encoder format
+
+Where a conversion is needed it goes to the cheapest place: a change of subsampling or
+bit depth is folded into the native scaler and tone mapper, which run at output size.
+Only formats the scaler cannot read are converted inside the graph, at source size, and
+only an encoder that does not take yuv420p needs a final conversion at output size.
+
+*/
+
+extern "C" {
+	#include <libavcodec/avcodec.h>
+	#include <libavutil/pixdesc.h>
+}
+
+#include <string>
+#include <vector>
+
+#include "geometry.hpp"
+
+namespace formats {
+
+struct Conversion {
+	AVPixelFormat from;
+	AVPixelFormat to;
+	std::string stage;  // Where it happens
+	bool folded;        // Part of a pass that runs anyway, costs nothing extra
+
+	std::string describe() const {
+		return stage + " " + name(from) + " -> " + name(to) + (folded ? " (folded)" : " (extra pass)");
+	}
+
+	static std::string name(AVPixelFormat format) {
+		const char* text = av_get_pix_fmt_name(format);
+		return text ? text : "none";
+	}
+};
+
+struct Plan {
+	AVPixelFormat decoder = AV_PIX_FMT_NONE;
+	AVPixelFormat graph = AV_PIX_FMT_NONE;    // Buffersink constraint, what the scaler reads
+	AVPixelFormat scaled = AV_PIX_FMT_NONE;   // Scaler output
+	AVPixelFormat native = AV_PIX_FMT_NONE;   // After the tone mapper, what our stages produce
+	AVPixelFormat encoder = AV_PIX_FMT_NONE;
+	bool toneMap = false;
+	std::vector<Conversion> conversions;
+
+	int extraPasses() const {
+		int passes = 0;
+		for (const Conversion& conversion : conversions) {
+			passes += conversion.folded ? 0 : 1;
+		}
+		return passes;
+	}
+};
+
+inline bool accepts(const AVPixelFormat* list, AVPixelFormat format) {
+	if (!list) {
+		return true;  // Encoders that do not say take anything
+	}
+	for (; *list != AV_PIX_FMT_NONE; list++) {
+		if (*list == format) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// encoderFormats is AVCodec::pix_fmts, terminated by AV_PIX_FMT_NONE
+inline Plan plan(AVPixelFormat decoder, const AVPixelFormat* encoderFormats) {
+	Plan result;
+	result.decoder = decoder;
+
+	// Graph: pass through whatever the scaler can read
+	result.graph = decoder;
+	if (!geometry::Scaler::supports(decoder)) {
+		const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(decoder);
+		result.graph = desc && desc->comp[0].depth > 8 ? AV_PIX_FMT_YUV420P10LE : AV_PIX_FMT_YUV420P;
+		result.conversions.push_back({decoder, result.graph, "filter graph", false});
+	}
+
+	// Scaler: always 4:2:0, at the bit depth it was given
+	result.scaled = geometry::Scaler::highBitDepth(result.graph) ? AV_PIX_FMT_YUV420P10LE : AV_PIX_FMT_YUV420P;
+	if (result.scaled != result.graph) {
+		result.conversions.push_back({result.graph, result.scaled, "scaler", true});
+	}
+
+	// Tone mapper: 10 to 8 bits, fused with the HDR mapping
+	result.native = result.scaled;
+	if (result.scaled == AV_PIX_FMT_YUV420P10LE) {
+		result.toneMap = true;
+		result.native = AV_PIX_FMT_YUV420P;
+		result.conversions.push_back({result.scaled, result.native, "tone mapper", true});
+	}
+
+	// Encoder: yuv420p when it takes it, otherwise its closest format
+	result.encoder = result.native;
+	if (!accepts(encoderFormats, result.native)) {
+		int loss = 0;
+		result.encoder = avcodec_find_best_pix_fmt_of_list(encoderFormats, result.native, 0, &loss);
+		result.conversions.push_back({result.native, result.encoder, "encoder input", false});
+	}
+	return result;
+}
+
+} // namespace formats
+
+#endif // FORMATS_HPP
@@ -0,0 +1,424 @@
+#ifndef FRAME_CACHE_HPP
+#define FRAME_CACHE_HPP
+
+/*
+
+Frame Cache
+Decode-once store of encoder-ready frames, for running several encodes of one source:
+CRF sweeps, codec comparisons, a re-encode with new rate settings. The first run writes
+every frame it sends to the encoder, later runs with the same source and the same frame
+chain read them back and skip the demuxer, decoder, filter graph, scaler and tone mapper.
+
+Keyed like the result cache, the XXH64 of the input bytes plus the XXH64 of everything
+that shapes the frames (OutputSettings::normalizedFrames and the encoder pixel format),
+so the codec, CRF and bitrate are free to change between runs. Entries share the LRU
+eviction of the result cache, in their own directory.
+
+An entry is one raw file, a header and then fixed size records:
+
+	FileHeader                     64 bytes
+	FrameRecord, planes            record 0, planes packed with 32 byte aligned lines
+	FrameRecord, planes            record 1
+	...
+
+Records start on 64 byte boundaries so every plane can be used in place. Reading maps
+the file and hands out frames whose buffers point into the mapping, no copy on our side,
+the kernel pages them in ahead of the encoder. Raw frames are big, 3 MB for 1080x1920,
+so an entry that would pass the cache size is dropped instead of evicting everything
+else for it.
+
+*/
+
+extern "C" {
+	#include <libavutil/buffer.h>
+	#include <libavutil/frame.h>
+	#include <libavutil/imgutils.h>
+}
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "result_cache.hpp"
+
+namespace cache {
+
+struct FileHeader {
+	char magic[8];
+	uint32_t version;
+	int32_t width;
+	int32_t height;
+	int32_t format;
+	int32_t timeBaseNum;
+	int32_t timeBaseDen;
+	int32_t colorPrimaries;
+	int32_t colorTrc;
+	int32_t colorSpace;
+	int32_t colorRange;
+	int64_t frameBytes;     // Planes of one frame
+	int64_t frameCount;     // Written last, 0 in an unfinished file
+};
+
+struct FrameRecord {
+	int64_t pts;
+	int64_t duration;
+	int32_t sceneCut;       // Scene detection saw a cut at this frame
+	int32_t reserved;
+};
+
+static constexpr char FrameMagic[8] = {'V', 'C', 'F', 'R', 'A', 'M', 'E', 'S'};
+static constexpr uint32_t FrameVersion = 2;
+static constexpr int64_t HeaderBytes = 64;
+static constexpr int64_t RecordAlign = 64;
+static constexpr int LineAlign = 32;
+
+static_assert(sizeof(FileHeader) <= HeaderBytes, "header must fit its slot");
+
+inline int64_t recordStride(int64_t frameBytes) {
+	return (RecordAlign + frameBytes + RecordAlign - 1) / RecordAlign * RecordAlign;
+}
+
+/*
+
+Frame Reader
+A finished entry, mapped. Frames it returns keep the mapping alive, so they can outlive
+the reader inside an encoder's lookahead.
+
+*/
+
+class FrameReader {
+public:
+	static std::unique_ptr<FrameReader> open(const std::filesystem::path& path) {
+		const int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			return nullptr;
+		}
+		struct stat info;
+		void* address = MAP_FAILED;
+		if (fstat(fd, &info) == 0 && info.st_size >= HeaderBytes) {
+			address = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		}
+		::close(fd);
+		if (address == MAP_FAILED) {
+			return nullptr;
+		}
+
+		auto mapping = std::make_shared<Mapping>((const uint8_t*)address, (size_t)info.st_size);
+		FileHeader header;
+		memcpy(&header, mapping->data, sizeof(header));
+		const int64_t expected = header.frameBytes > 0 ? HeaderBytes + header.frameCount * recordStride(header.frameBytes) : -1;
+		if (memcmp(header.magic, FrameMagic, sizeof(FrameMagic)) != 0 || header.version != FrameVersion ||
+		    header.frameCount <= 0 || expected != (int64_t)mapping->size ||
+		    av_image_get_buffer_size((AVPixelFormat)header.format, header.width, header.height, LineAlign) != header.frameBytes) {
+			return nullptr;
+		}
+		madvise((void*)mapping->data, mapping->size, MADV_SEQUENTIAL);
+		return std::unique_ptr<FrameReader>(new FrameReader(mapping, header));
+	}
+
+	int64_t frames() const {
+		return header.frameCount;
+	}
+
+	AVRational timeBase() const {
+		return {header.timeBaseNum, header.timeBaseDen};
+	}
+
+	// Read-only frame backed by the mapping, unref it like any other
+	bool read(int64_t index, AVFrame* frame, bool* sceneCut = nullptr) const {
+		if (index < 0 || index >= header.frameCount) {
+			return false;
+		}
+		const uint8_t* record = mapping->data + HeaderBytes + index * recordStride(header.frameBytes);
+		FrameRecord meta;
+		memcpy(&meta, record, sizeof(meta));
+		uint8_t* planes = (uint8_t*)record + RecordAlign;
+
+		// Each buffer holds a reference to the mapping, dropped when the buffer is freed
+		auto* owner = new std::shared_ptr<Mapping>(mapping);
+		frame->buf[0] = av_buffer_create(planes, (size_t)header.frameBytes, release, owner, AV_BUFFER_FLAG_READONLY);
+		if (!frame->buf[0]) {
+			delete owner;
+			return false;
+		}
+		av_image_fill_arrays(frame->data, frame->linesize, planes, (AVPixelFormat)header.format,
+		                     header.width, header.height, LineAlign);
+		frame->format = header.format;
+		frame->width = header.width;
+		frame->height = header.height;
+		frame->pts = meta.pts;
+		frame->duration = meta.duration;
+		frame->color_primaries = (AVColorPrimaries)header.colorPrimaries;
+		frame->color_trc = (AVColorTransferCharacteristic)header.colorTrc;
+		frame->colorspace = (AVColorSpace)header.colorSpace;
+		frame->color_range = (AVColorRange)header.colorRange;
+		if (sceneCut) {
+			*sceneCut = meta.sceneCut != 0;
+		}
+		return true;
+	}
+
+private:
+	struct Mapping {
+		const uint8_t* data;
+		size_t size;
+
+		Mapping(const uint8_t* data, size_t size) : data(data), size(size) {}
+		~Mapping() {
+			munmap((void*)data, size);
+		}
+	};
+
+	std::shared_ptr<Mapping> mapping;
+	FileHeader header;
+
+	FrameReader(std::shared_ptr<Mapping> mapping, const FileHeader& header) : mapping(std::move(mapping)), header(header) {}
+
+	static void release(void* opaque, uint8_t*) {
+		delete (std::shared_ptr<Mapping>*)opaque;
+	}
+};
+
+/*
+
+Frame Writer
+Appends frames to a temporary file, which becomes the entry on commit. Gives up, and
+removes the file, on the first frame that does not fit: another size or format, a write
+error, or more bytes than the cache may hold.
+
+The temporary file is held under an exclusive flock from open until it is renamed or
+removed. A second writer for the same key, another job or another process, finds it
+locked and does not write at all; the first one's entry serves both next time. The lock
+goes with the process, so a crash leaves a stale file the next writer takes over.
+
+*/
+
+class FrameWriter {
+public:
+	FrameWriter(const std::filesystem::path& entry, AVRational timeBase, uint64_t maxBytes)
+	    : entry(entry), temp(entry.string() + ".tmp"), timeBase(timeBase), maxBytes(maxBytes) {
+		file = lockTemp(temp);
+	}
+
+	FrameWriter(const FrameWriter&) = delete;
+	FrameWriter& operator=(const FrameWriter&) = delete;
+
+	~FrameWriter() {
+		abandon();
+	}
+
+	bool add(const AVFrame* frame, bool sceneCut = false) {
+		if (!file) {
+			return false;
+		}
+		if (header.frameCount == 0 && header.frameBytes == 0 && !start(frame)) {
+			abandon();
+			return false;
+		}
+		if (frame->format != header.format || frame->width != header.width || frame->height != header.height ||
+		    (uint64_t)(HeaderBytes + (header.frameCount + 1) * stride) > maxBytes) {
+			abandon();
+			return false;
+		}
+
+		uint8_t record[RecordAlign] = {};
+		const FrameRecord meta{frame->pts, frame->duration, sceneCut, 0};
+		memcpy(record, &meta, sizeof(meta));
+		const int copied = av_image_copy_to_buffer(planes.get(), (int)header.frameBytes, frame->data, frame->linesize,
+		                                           (AVPixelFormat)frame->format, frame->width, frame->height, LineAlign);
+		if (copied < 0 || fwrite(record, 1, RecordAlign, file) != (size_t)RecordAlign ||
+		    fwrite(planes.get(), 1, stride - RecordAlign, file) != (size_t)(stride - RecordAlign)) {
+			abandon();
+			return false;
+		}
+		header.frameCount++;
+		return true;
+	}
+
+	int64_t frames() const {
+		return header.frameCount;
+	}
+
+	// False once it gave up
+	bool writing() const {
+		return file != nullptr;
+	}
+
+	// The header with the final count goes in last, a crash leaves a file open() rejects
+	bool commit() {
+		if (!file || header.frameCount == 0) {
+			abandon();
+			return false;
+		}
+		uint8_t slot[HeaderBytes] = {};
+		memcpy(slot, &header, sizeof(header));
+		const bool written = fseek(file, 0, SEEK_SET) == 0 && fwrite(slot, 1, HeaderBytes, file) == (size_t)HeaderBytes &&
+		                     fflush(file) == 0;
+
+		// Renamed while still locked, a writer waiting on the old path then finds it gone
+		std::error_code error;
+		if (written) {
+			std::filesystem::rename(temp, entry, error);
+		}
+		if (!written || error) {
+			std::filesystem::remove(temp, error);
+		}
+		fclose(file);
+		file = nullptr;
+		return written && !error;
+	}
+
+private:
+	std::filesystem::path entry;
+	std::filesystem::path temp;
+	AVRational timeBase;
+	uint64_t maxBytes;
+	FILE* file = nullptr;
+	FileHeader header{};
+	int64_t stride = 0;
+	std::unique_ptr<uint8_t[]> planes;   // One frame, packed
+
+	bool start(const AVFrame* frame) {
+		const int bytes = av_image_get_buffer_size((AVPixelFormat)frame->format, frame->width, frame->height, LineAlign);
+		if (bytes <= 0) {
+			return false;
+		}
+		memcpy(header.magic, FrameMagic, sizeof(FrameMagic));
+		header.version = FrameVersion;
+		header.width = frame->width;
+		header.height = frame->height;
+		header.format = frame->format;
+		header.timeBaseNum = timeBase.num;
+		header.timeBaseDen = timeBase.den;
+		header.colorPrimaries = frame->color_primaries;
+		header.colorTrc = frame->color_trc;
+		header.colorSpace = frame->colorspace;
+		header.colorRange = frame->color_range;
+		header.frameBytes = bytes;
+		stride = recordStride(bytes);
+		planes.reset(new uint8_t[stride - RecordAlign]());
+
+		// Placeholder, frameCount 0 marks the file unfinished
+		uint8_t slot[HeaderBytes] = {};
+		memcpy(slot, &header, sizeof(header));
+		return fwrite(slot, 1, HeaderBytes, file) == (size_t)HeaderBytes;
+	}
+
+	void abandon() {
+		if (file) {
+			std::error_code error;
+			std::filesystem::remove(temp, error);
+			fclose(file);
+			file = nullptr;
+		}
+	}
+
+	// Opened, locked and emptied, null while another writer holds the path. A lock taken
+	// on a file the holder renamed or removed meanwhile is one on the wrong file, so the
+	// path must still name what was opened.
+	static FILE* lockTemp(const std::filesystem::path& path) {
+		const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+		if (fd < 0) {
+			return nullptr;
+		}
+		struct stat opened;
+		struct stat current;
+		if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &opened) != 0 || stat(path.c_str(), &current) != 0 ||
+		    opened.st_dev != current.st_dev || opened.st_ino != current.st_ino || ftruncate(fd, 0) != 0) {
+			close(fd);
+			return nullptr;
+		}
+		FILE* file = fdopen(fd, "wb");
+		if (!file) {
+			close(fd);
+		}
+		return file;
+	}
+};
+
+/*
+
+Frame Cache
+The directory, its keys and its LRU, the same scheme as ResultCache.
+
+*/
+
+class FrameCache {
+public:
+	FrameCache(const std::string& dir, uint64_t maxBytes) : dir(dir), maxBytes(maxBytes) {
+		std::error_code error;
+		std::filesystem::create_directories(dir, error);
+	}
+
+	// Empty when the input cannot be read
+	std::string key(const std::string& inputPath, const std::string& normalizedFrames) const {
+		const auto content = hashFile(inputPath);
+		if (!content) {
+			return "";
+		}
+		return hex(*content) + "-" + hex(XXH64::of(normalizedFrames));
+	}
+
+	// Null on a miss
+	std::unique_ptr<FrameReader> open(const std::string& key) {
+		std::lock_guard<std::mutex> lock(mutex);
+		std::unique_ptr<FrameReader> reader = key.empty() ? nullptr : FrameReader::open(entryPath(key));
+		if (!reader) {
+			stats.misses++;
+			return nullptr;
+		}
+		std::error_code error;
+		std::filesystem::last_write_time(entryPath(key), std::filesystem::file_time_type::clock::now(), error);
+		stats.hits++;
+		return reader;
+	}
+
+	// Null when the entry cannot be written or another writer has it, timeBase is the one of the frame timestamps
+	std::unique_ptr<FrameWriter> create(const std::string& key, AVRational timeBase) {
+		if (key.empty()) {
+			return nullptr;
+		}
+		auto writer = std::make_unique<FrameWriter>(entryPath(key), timeBase, maxBytes);
+		return writer->writing() ? std::move(writer) : nullptr;
+	}
+
+	bool commit(const std::string& key, FrameWriter& writer) {
+		if (!writer.commit()) {
+			return false;
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		stats.insertions++;
+		evictLeastRecent(dir, maxBytes, entryPath(key), stats);
+		return true;
+	}
+
+	Stats getStats() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return stats;
+	}
+
+private:
+	const std::filesystem::path dir;
+	const uint64_t maxBytes;
+	mutable std::mutex mutex;
+	Stats stats;
+
+	std::filesystem::path entryPath(const std::string& key) const {
+		return dir / (key + ".frames");
+	}
+};
+
+} // namespace cache
+
+#endif // FRAME_CACHE_HPP
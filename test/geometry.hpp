@@ -0,0 +1,423 @@
+#ifndef GEOMETRY_HPP
+#define GEOMETRY_HPP
+
+/*
+
+Geometry
+Native replacement for `scale=W:-1,crop=W:H` that also applies the display-matrix
+rotation, so portrait phone footage costs the same as landscape.
+
+Phones store portrait video as landscape frames plus a rotation in the display matrix.
+Instead of a transpose pass followed by a scale pass, every output pixel is mapped
+straight back to the stored frame: output columns walk one source axis and output rows
+the other, for a 90 degree rotation that is a transposed read. The output is produced
+in tiles so those column-wise reads stay in cache.
+
+Scaling is bilinear with 8-bit weights in fixed point. Past 2:1 bilinear taps would skip
+source samples and alias, so a plane shrunk that far averages the whole source footprint
+of every output sample instead, an area filter like SWS_AREA. Every output row is computed
+from the source alone, so a frame can be split into bands of output rows and scaled on several
+threads (see band()) with output identical to the single-threaded path; the filter taps
+of neighbouring bands simply read the same source rows. 10-bit input is scaled at 10 bits
+and left for the tone mapper (tonemap.hpp) to bring down to 8.
+
+*/
+
+extern "C" {
+	#include <libavutil/display.h>
+	#include <libavutil/frame.h>
+	#include <libavutil/pixdesc.h>
+}
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace geometry {
+
+/*
+
+Transform
+Orientation that turns a stored frame into the displayed one: a clockwise rotation
+by a multiple of 90 degrees followed by an optional horizontal mirror. Read from the
+display matrix the same way the ffmpeg command line does its autorotate.
+
+*/
+
+struct Transform {
+	int rotation = 0;    // Clockwise degrees: 0, 90, 180 or 270
+	bool hflip = false;
+
+	bool swapsAxes() const {
+		return rotation == 90 || rotation == 270;
+	}
+
+	bool identity() const {
+		return rotation == 0 && !hflip;
+	}
+
+	static Transform fromDisplayMatrix(const int32_t* matrix) {
+		Transform transform;
+		if (!matrix) {
+			return transform;
+		}
+
+		double theta = -std::round(av_display_rotation_get(matrix));
+		theta -= 360 * std::floor(theta / 360 + 0.9 / 360);
+
+		if (std::fabs(theta - 90) < 1.0) {
+			transform.rotation = 90;
+			transform.hflip = matrix[3] > 0;       // transpose=cclock_flip
+		} else if (std::fabs(theta - 180) < 1.0) {
+			// hflip when matrix[0] < 0, vflip when matrix[4] < 0, both is a plain rotation
+			if (matrix[0] < 0 && matrix[4] < 0) {
+				transform.rotation = 180;
+			} else if (matrix[0] < 0) {
+				transform.hflip = true;
+			} else if (matrix[4] < 0) {
+				transform.rotation = 180;
+				transform.hflip = true;
+			}
+		} else if (std::fabs(theta - 270) < 1.0) {
+			transform.rotation = 270;
+			transform.hflip = matrix[3] < 0;       // transpose=clock_flip
+		} else if (std::fabs(theta) < 1.0 && matrix[4] < 0) {
+			transform.rotation = 180;              // vflip
+			transform.hflip = true;
+		}
+		return transform;
+	}
+};
+
+/*
+
+Scaler
+Scales the displayed picture to cover width x height and crops the center, which is
+what scale=W:-1,crop=W:H does whenever that crop fits. Output is yuv420p, or
+yuv420p10le for 10-bit input.
+
+*/
+
+class Scaler {
+public:
+	// Planar limited range YUV, anything else goes through the filter graph first
+	static bool supports(int format) {
+		return format == AV_PIX_FMT_YUV420P || format == AV_PIX_FMT_YUV422P || format == AV_PIX_FMT_YUV444P ||
+		       format == AV_PIX_FMT_YUV420P10LE || format == AV_PIX_FMT_YUV422P10LE || format == AV_PIX_FMT_YUV444P10LE;
+	}
+
+	static bool highBitDepth(int format) {
+		return format == AV_PIX_FMT_YUV420P10LE || format == AV_PIX_FMT_YUV422P10LE || format == AV_PIX_FMT_YUV444P10LE;
+	}
+
+	bool configured(int srcWidth, int srcHeight, int srcFormat) const {
+		return srcWidth == sourceWidth && srcHeight == sourceHeight && srcFormat == sourceFormat;
+	}
+
+	bool configure(int srcWidth, int srcHeight, int srcFormat, const Transform& orientation, int width, int height) {
+		const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)srcFormat);
+		if (!supports(srcFormat) || !desc || srcWidth <= 0 || srcHeight <= 0 || width <= 0 || height <= 0) {
+			return false;
+		}
+		sourceWidth = srcWidth;
+		sourceHeight = srcHeight;
+		sourceFormat = srcFormat;
+		transform = orientation;
+		outputWidth = width;
+		outputHeight = height;
+
+		// Cover the output with the displayed picture and center the crop
+		const double displayWidth = transform.swapsAxes() ? srcHeight : srcWidth;
+		const double displayHeight = transform.swapsAxes() ? srcWidth : srcHeight;
+		const double scale = std::max(width / displayWidth, height / displayHeight);
+		const double cropX = (displayWidth * scale - width) / 2;
+		const double cropY = (displayHeight * scale - height) / 2;
+
+		for (int i = 0; i < 3; i++) {
+			const int shiftX = i == 0 ? 0 : desc->log2_chroma_w;
+			const int shiftY = i == 0 ? 0 : desc->log2_chroma_h;
+			const int outShift = i == 0 ? 0 : 1;
+
+			Plane& plane = planes[i];
+			plane.sourceWidth = -((-srcWidth) >> shiftX);
+			plane.sourceHeight = -((-srcHeight) >> shiftY);
+			plane.width = -((-width) >> outShift);
+			plane.height = -((-height) >> outShift);
+
+			// Output columns run along display x, which is a source row for 0/180 and a column for 90/270
+			const int columnAxis = transform.swapsAxes() ? plane.sourceHeight : plane.sourceWidth;
+			const int rowAxis = transform.swapsAxes() ? plane.sourceWidth : plane.sourceHeight;
+			const bool reverseColumns = (transform.rotation == 90 || transform.rotation == 180) != transform.hflip;
+			const bool reverseRows = transform.rotation == 180 || transform.rotation == 270;
+
+			// Source samples per output sample, chroma of 4:4:4 input shrinks twice as much as luma
+			const double columnStep = columnAxis * ((double)width / plane.width) / (displayWidth * scale);
+			const double rowStep = rowAxis * ((double)height / plane.height) / (displayHeight * scale);
+			plane.area = columnStep > 2 || rowStep > 2;
+
+			plane.columns.clear();
+			plane.rows.clear();
+			plane.columnFilter = Filter();
+			plane.rowFilter = Filter();
+			if (plane.area) {
+				buildFilter(plane.columnFilter, plane.width, width, cropX, displayWidth * scale, columnAxis, reverseColumns);
+				buildFilter(plane.rowFilter, plane.height, height, cropY, displayHeight * scale, rowAxis, reverseRows);
+			} else {
+				buildTaps(plane.columns, plane.width, width, cropX, displayWidth * scale, columnAxis, reverseColumns);
+				buildTaps(plane.rows, plane.height, height, cropY, displayHeight * scale, rowAxis, reverseRows);
+			}
+		}
+		return true;
+	}
+
+	int width() const {
+		return outputWidth;
+	}
+
+	int height() const {
+		return outputHeight;
+	}
+
+	AVPixelFormat outputFormat() const {
+		return highBitDepth(sourceFormat) ? AV_PIX_FMT_YUV420P10LE : AV_PIX_FMT_YUV420P;
+	}
+
+	// Scales luma rows [rowStart, rowEnd) and the chroma rows under them, rowStart even
+	void process(const AVFrame* in, AVFrame* out, int rowStart, int rowEnd) const {
+		for (int i = 0; i < 3; i++) {
+			const int shift = i == 0 ? 0 : 1;
+			const int start = rowStart >> shift;
+			const int end = i == 0 ? rowEnd : std::min(planes[i].height, (rowEnd + 1) >> 1);
+			if (highBitDepth(sourceFormat)) {
+				processPlane<uint16_t>(planes[i], in->data[i], in->linesize[i], out->data[i], out->linesize[i], start, end);
+			} else {
+				processPlane<uint8_t>(planes[i], in->data[i], in->linesize[i], out->data[i], out->linesize[i], start, end);
+			}
+		}
+	}
+
+	void process(const AVFrame* in, AVFrame* out) const {
+		process(in, out, 0, outputHeight);
+	}
+
+	// Output rows [first, second) of band index out of count, even so no chroma row is split
+	static std::pair<int, int> band(int height, int index, int count) {
+		const int start = (int)((int64_t)height * index / count) & ~1;
+		const int end = index + 1 == count ? height : (int)((int64_t)height * (index + 1) / count) & ~1;
+		return {start, end};
+	}
+
+private:
+	// Source position of one output coordinate, index and index + 1 blended by frac / 256
+	struct Tap {
+		int index;
+		int frac;
+	};
+
+	// Source samples [index, index + count) of one output coordinate, weights out of FilterOne
+	struct Footprint {
+		int index;
+		int count;
+		int offset;    // Into Filter::weights
+	};
+
+	struct Filter {
+		std::vector<Footprint> footprints;
+		std::vector<int> weights;
+	};
+
+	// Either the taps or, when one axis shrinks past 2:1, the filters are set
+	struct Plane {
+		int sourceWidth = 0;
+		int sourceHeight = 0;
+		int width = 0;
+		int height = 0;
+		bool area = false;
+		std::vector<Tap> columns;
+		std::vector<Tap> rows;
+		Filter columnFilter;
+		Filter rowFilter;
+	};
+
+	static constexpr int TileSize = 64;
+	static constexpr int FilterBits = 14;
+	static constexpr int FilterOne = 1 << FilterBits;
+
+	int sourceWidth = 0;
+	int sourceHeight = 0;
+	int sourceFormat = AV_PIX_FMT_NONE;
+	int outputWidth = 0;
+	int outputHeight = 0;
+	Transform transform;
+	Plane planes[3];
+
+	// Bilinear tap at a source position in pixels, pixel centers sit at + 0.5
+	static Tap tapAt(double position, int sourceSize) {
+		position = std::clamp(position - 0.5, 0.0, (double)(sourceSize - 1));
+		const int fixed = (int)std::lround(position * 256);
+		Tap tap{fixed >> 8, fixed & 255};
+		if (tap.index >= sourceSize - 1) {
+			tap.index = std::max(sourceSize - 2, 0);
+			tap.frac = sourceSize > 1 ? 256 : 0;
+		}
+		return tap;
+	}
+
+	// count output samples over `full` output pixels, cropped by `crop` out of `scaled` display pixels
+	static void buildTaps(std::vector<Tap>& taps, int count, int full, double crop, double scaled, int sourceSize, bool reverse) {
+		taps.resize(count);
+		const double ratio = (double)full / count;
+		for (int i = 0; i < count; i++) {
+			// Pixel centers, normalized over the whole scaled picture
+			const double u = (crop + (i + 0.5) * ratio) / scaled;
+			taps[i] = tapAt((reverse ? 1.0 - u : u) * sourceSize, sourceSize);
+		}
+	}
+
+	// Same coordinates as buildTaps. An axis shrunk by 2:1 or less keeps the weights of its
+	// bilinear taps, only an axis past 2:1 averages its footprint.
+	static void buildFilter(Filter& filter, int count, int full, double crop, double scaled, int sourceSize, bool reverse) {
+		filter.footprints.resize(count);
+		filter.weights.clear();
+		const double ratio = (double)full / count;
+		for (int i = 0; i < count; i++) {
+			// Pixel edges, normalized over the whole scaled picture
+			const double u0 = (crop + i * ratio) / scaled;
+			const double u1 = (crop + (i + 1) * ratio) / scaled;
+			const double start = std::clamp((reverse ? 1.0 - u1 : u0) * sourceSize, 0.0, (double)sourceSize);
+			const double end = std::clamp((reverse ? 1.0 - u0 : u1) * sourceSize, start, (double)sourceSize);
+
+			Footprint& footprint = filter.footprints[i];
+			footprint.offset = (int)filter.weights.size();
+			if (end - start <= 2) {
+				const Tap tap = tapAt((start + end) / 2, sourceSize);
+				footprint.index = tap.index;
+				footprint.count = tap.frac > 0 ? 2 : 1;
+				filter.weights.push_back((256 - tap.frac) << (FilterBits - 8));
+				if (tap.frac > 0) {
+					filter.weights.push_back(tap.frac << (FilterBits - 8));
+				}
+				continue;
+			}
+
+			// Every sample weighted by how much of it the pixel covers, rounding the running
+			// total keeps the weights adding up to exactly FilterOne
+			footprint.index = std::min((int)start, sourceSize - 1);
+			footprint.count = std::max((int)std::ceil(end) - footprint.index, 1);
+			int previous = 0;
+			for (int k = 0; k < footprint.count; k++) {
+				const double covered = std::min(end, footprint.index + k + 1.0) - start;
+				const int total = k + 1 == footprint.count ? FilterOne : (int)std::lround(covered / (end - start) * FilterOne);
+				filter.weights.push_back(total - previous);
+				previous = total;
+			}
+		}
+	}
+
+	// 10-bit samples stay below 2^31 too: 1023 * 256 * 256
+	template <typename T>
+	static T blend(const T* p, ptrdiff_t stepX, ptrdiff_t stepY, int fx, int fy) {
+		const int top = p[0] * (256 - fx) + p[stepX] * fx;
+		const int bottom = p[stepY] * (256 - fx) + p[stepY + stepX] * fx;
+		return (T)((top * (256 - fy) + bottom * fy + 32768) >> 16);
+	}
+
+	// Strides are in bytes like everywhere in FFmpeg, converted to samples here
+	template <typename T>
+	void processPlane(const Plane& plane, const uint8_t* srcData, int srcBytes, uint8_t* dstData, int dstBytes, int rowStart, int rowEnd) const {
+		const T* src = (const T*)srcData;
+		T* dst = (T*)dstData;
+		const int srcStride = srcBytes / (int)sizeof(T);
+		const int dstStride = dstBytes / (int)sizeof(T);
+		const bool swap = transform.swapsAxes();
+		if (plane.area) {
+			processArea(plane, src, srcStride, dst, dstStride, rowStart, rowEnd);
+			return;
+		}
+		const ptrdiff_t stepX = plane.sourceWidth > 1 ? 1 : 0;
+		const ptrdiff_t stepY = plane.sourceHeight > 1 ? srcStride : 0;
+
+		for (int tileY = rowStart; tileY < rowEnd; tileY += TileSize) {
+			const int tileEndY = std::min(tileY + TileSize, rowEnd);
+			for (int tileX = 0; tileX < plane.width; tileX += TileSize) {
+				const int tileEndX = std::min(tileX + TileSize, plane.width);
+
+				for (int y = tileY; y < tileEndY; y++) {
+					const Tap row = plane.rows[y];
+					T* out = dst + (ptrdiff_t)y * dstStride;
+					if (!swap) {
+						// Row of the output is a row of the source
+						const T* line = src + (ptrdiff_t)row.index * srcStride;
+						for (int x = tileX; x < tileEndX; x++) {
+							const Tap column = plane.columns[x];
+							out[x] = blend(line + column.index, stepX, stepY, column.frac, row.frac);
+						}
+					} else {
+						// Row of the output is a column of the source
+						const T* column0 = src + row.index;
+						for (int x = tileX; x < tileEndX; x++) {
+							const Tap column = plane.columns[x];
+							out[x] = blend(column0 + (ptrdiff_t)column.index * srcStride, stepX, stepY, row.frac, column.frac);
+						}
+					}
+				}
+			}
+		}
+	}
+
+	// Weighted sum of the source rows under `rows` and the samples under `samples` in each.
+	// 64 bits, 1023 * FilterOne * FilterOne does not fit in 32.
+	template <typename T>
+	static int64_t footprintSum(const T* corner, ptrdiff_t stride, const Footprint& rows, const int* rowWeights,
+	                            const Footprint& samples, const int* sampleWeights) {
+		int64_t sum = 0;
+		for (int r = 0; r < rows.count; r++) {
+			const T* line = corner + r * stride;
+			int lineSum = 0;
+			for (int i = 0; i < samples.count; i++) {
+				lineSum += line[i] * sampleWeights[i];
+			}
+			sum += (int64_t)lineSum * rowWeights[r];
+		}
+		return sum;
+	}
+
+	template <typename T>
+	void processArea(const Plane& plane, const T* src, int srcStride, T* dst, int dstStride, int rowStart, int rowEnd) const {
+		// Output columns step along a source row unless the axes are swapped
+		const bool swap = transform.swapsAxes();
+		const ptrdiff_t columnStep = swap ? srcStride : 1;
+		const ptrdiff_t rowStep = swap ? 1 : srcStride;
+
+		for (int tileY = rowStart; tileY < rowEnd; tileY += TileSize) {
+			const int tileEndY = std::min(tileY + TileSize, rowEnd);
+			for (int tileX = 0; tileX < plane.width; tileX += TileSize) {
+				const int tileEndX = std::min(tileX + TileSize, plane.width);
+
+				for (int y = tileY; y < tileEndY; y++) {
+					const Footprint& row = plane.rowFilter.footprints[y];
+					const int* rowWeights = plane.rowFilter.weights.data() + row.offset;
+					const T* first = src + row.index * rowStep;
+					T* out = dst + (ptrdiff_t)y * dstStride;
+
+					for (int x = tileX; x < tileEndX; x++) {
+						const Footprint& column = plane.columnFilter.footprints[x];
+						const int* columnWeights = plane.columnFilter.weights.data() + column.offset;
+						const T* corner = first + column.index * columnStep;
+
+						// The inner loop always walks along a source row
+						const int64_t sum = swap ? footprintSum(corner, srcStride, column, columnWeights, row, rowWeights)
+						                         : footprintSum(corner, srcStride, row, rowWeights, column, columnWeights);
+						out[x] = (T)((sum + ((int64_t)1 << (2 * FilterBits - 1))) >> (2 * FilterBits));
+					}
+				}
+			}
+		}
+	}
+};
+
+} // namespace geometry
+
+#endif // GEOMETRY_HPP
@@ -0,0 +1,158 @@
+#ifndef HANDLES_HPP
+#define HANDLES_HPP
+
+/*
+
+Handles
+Owners for the FFmpeg objects a conversion holds. Each one frees its object with the
+matching FFmpeg call when it goes out of scope, so an early return or an exception
+cannot leak a context or free one twice.
+
+	InputFormat     avformat_close_input
+	OutputFormat    avio_closep unless the muxer has no file, then avformat_free_context
+	CodecContext    avcodec_free_context, which closes the codec too
+	FilterGraph     avfilter_graph_free, the filter contexts in it go with it
+	Frame, Packet   av_frame_free, av_packet_free
+	Sws             sws_freeContext
+
+Handles move and do not copy. They convert to the raw pointer, so they pass straight
+to FFmpeg calls; address() is for the calls that allocate or free through a pointer to
+the pointer (avformat_open_input, avformat_alloc_output_context2).
+
+FrameView shares one decoded or scaled picture between several consumers without
+copying pixels: copying a view only bumps a count, and ref() hands out a new frame that
+references the same buffers (av_frame_ref). A view is only read, the buffers are not
+writable while someone else holds them.
+
+*/
+
+extern "C" {
+	#include <libavcodec/avcodec.h>
+	#include <libavfilter/avfilter.h>
+	#include <libavformat/avformat.h>
+	#include <libavutil/frame.h>
+	#include <libswscale/swscale.h>
+}
+
+#include <memory>
+#include <utility>
+
+namespace handles {
+
+template <typename T, void (*Free)(T*)>
+class Handle {
+public:
+	Handle() = default;
+	explicit Handle(T* pointer) : pointer(pointer) {}
+
+	Handle(Handle&& other) noexcept : pointer(other.release()) {}
+	Handle& operator=(Handle&& other) noexcept {
+		if (this != &other) {
+			reset(other.release());
+		}
+		return *this;
+	}
+
+	Handle(const Handle&) = delete;
+	Handle& operator=(const Handle&) = delete;
+
+	~Handle() {
+		reset();
+	}
+
+	T* get() const { return pointer; }
+	T* operator->() const { return pointer; }
+	operator T*() const { return pointer; }
+
+	T** address() { return &pointer; }
+
+	// Frees the current object and takes ownership of another
+	void reset(T* next = nullptr) {
+		if (pointer && pointer != next) {
+			Free(pointer);
+		}
+		pointer = next;
+	}
+
+	T* release() {
+		return std::exchange(pointer, nullptr);
+	}
+
+private:
+	T* pointer = nullptr;
+};
+
+namespace detail {
+
+inline void closeInput(AVFormatContext* ctx) { avformat_close_input(&ctx); }
+
+inline void freeOutput(AVFormatContext* ctx) {
+	if (ctx->pb && !(ctx->oformat->flags & AVFMT_NOFILE)) {
+		avio_closep(&ctx->pb);
+	}
+	avformat_free_context(ctx);
+}
+
+inline void freeCodec(AVCodecContext* ctx) { avcodec_free_context(&ctx); }
+inline void freeGraph(AVFilterGraph* graph) { avfilter_graph_free(&graph); }
+inline void freeFrame(AVFrame* frame) { av_frame_free(&frame); }
+inline void freePacket(AVPacket* packet) { av_packet_free(&packet); }
+inline void freeSws(SwsContext* sws) { sws_freeContext(sws); }
+
+} // namespace detail
+
+using InputFormat = Handle<AVFormatContext, detail::closeInput>;
+using OutputFormat = Handle<AVFormatContext, detail::freeOutput>;
+using CodecContext = Handle<AVCodecContext, detail::freeCodec>;
+using FilterGraph = Handle<AVFilterGraph, detail::freeGraph>;
+using Frame = Handle<AVFrame, detail::freeFrame>;
+using Packet = Handle<AVPacket, detail::freePacket>;
+using Sws = Handle<SwsContext, detail::freeSws>;
+
+// Empty handles when FFmpeg is out of memory
+inline Frame allocFrame() { return Frame(av_frame_alloc()); }
+inline Packet allocPacket() { return Packet(av_packet_alloc()); }
+
+/*
+
+Frame View
+A counted reference to one frame. Empty when made from a frame without buffers or when
+the reference cannot be taken.
+
+*/
+
+class FrameView {
+public:
+	FrameView() = default;
+
+	explicit FrameView(const AVFrame* source) {
+		Frame frame = allocFrame();
+		if (source && source->buf[0] && frame && av_frame_ref(frame, source) >= 0) {
+			shared = std::make_shared<Frame>(std::move(frame));
+		}
+	}
+
+	explicit operator bool() const { return shared != nullptr; }
+	const AVFrame* get() const { return shared ? shared->get() : nullptr; }
+	const AVFrame* operator->() const { return get(); }
+
+	// Another frame on the same buffers, for a consumer that wants an AVFrame of its own
+	Frame ref() const {
+		Frame frame = allocFrame();
+		if (shared && frame && av_frame_ref(frame, *shared) < 0) {
+			frame.reset();
+		}
+		return shared ? std::move(frame) : Frame();
+	}
+
+	long holders() const {
+		return shared.use_count();
+	}
+
+private:
+	std::shared_ptr<const Frame> shared;
+};
+
+} // namespace handles
+
+#endif // HANDLES_HPP
@@ -0,0 +1,143 @@
+#ifndef INCREMENTAL_HPP
+#define INCREMENTAL_HPP
+
+/*
+
+Incremental
+Reuse of encoded chunks from an earlier conversion of the same source.
+
+Every chunk in a checkpoint manifest records the source range it was encoded from and
+a hash of the source packets in that range. A new request with the same settings only
+has to re-encode the parts of its range that are not covered by an unchanged chunk:
+
+	previous  |--c0--|--c1--|--c2--|--c3--|
+	request       [==========================)   trimmed start, longer end
+	plan          [enc)|--c1--|--c2--|--c3--|[enc)
+
+*/
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "checkpoint.hpp"
+#include "result_cache.hpp"
+
+namespace incremental {
+
+// Unbounded end of a range, same value as AV_NOPTS_VALUE
+constexpr int64_t OpenEnd = INT64_MIN;
+
+// Half-open range of source pts in the input stream time base
+struct SourceRange {
+	int64_t start = 0;
+	int64_t end = OpenEnd;
+
+	bool contains(int64_t pts) const {
+		return pts >= start && (end == OpenEnd || pts < end);
+	}
+};
+
+/*
+
+Packet Hashes
+Per-packet hashes keyed by pts, folded into one value per source range.
+Keying by pts makes the result independent of demux order around GOP boundaries.
+
+*/
+
+class PacketHashes {
+public:
+	void add(int64_t pts, const uint8_t* data, size_t size) {
+		cache::XXH64 hash;
+		hash.update(data, size);
+		packets[pts] = hash.digest();
+	}
+
+	uint64_t rangeHash(const SourceRange& range) const {
+		cache::XXH64 hash;
+		for (auto it = packets.lower_bound(range.start); it != packets.end() && range.contains(it->first); ++it) {
+			hash.update(&it->first, sizeof(it->first));
+			hash.update(&it->second, sizeof(it->second));
+		}
+		return hash.digest();
+	}
+
+	// Drops everything before pts once the chunk it belonged to is done
+	void discardBefore(int64_t pts) {
+		packets.erase(packets.begin(), packets.lower_bound(pts));
+	}
+
+	void clear() {
+		packets.clear();
+	}
+
+private:
+	std::map<int64_t, uint64_t> packets;
+};
+
+struct Segment {
+	bool reuse = false;
+	checkpoint::Chunk chunk; // When reused
+	SourceRange range;       // Source range covered by the segment
+};
+
+/*
+
+Plan
+Splits the requested range into reused chunks and ranges to encode.
+currentHashes[i] is the hash of the current source over previous.chunks[i]'s range.
+
+*/
+
+inline std::vector<Segment> plan(const checkpoint::Manifest& previous, const std::string& settings,
+                                 const SourceRange& request, const std::vector<uint64_t>& currentHashes) {
+	std::vector<Segment> segments;
+
+	auto inside = [&](const checkpoint::Chunk& chunk) {
+		if (chunk.sourceStart < request.start) {
+			return false;
+		}
+		if (request.end == OpenEnd) {
+			return true;
+		}
+		return chunk.sourceEnd != OpenEnd && chunk.sourceEnd <= request.end;
+	};
+
+	int64_t cursor = request.start;
+	if (previous.settings == settings && previous.complete) {
+		for (size_t i = 0; i < previous.chunks.size() && i < currentHashes.size(); i++) {
+			const checkpoint::Chunk& chunk = previous.chunks[i];
+			if (!inside(chunk) || chunk.sourceHash != currentHashes[i]) {
+				continue;
+			}
+
+			if (chunk.sourceStart > cursor) {
+				segments.push_back({false, {}, {cursor, chunk.sourceStart}});
+			}
+
+			Segment segment;
+			segment.reuse = true;
+			segment.chunk = chunk;
+			segment.range = {chunk.sourceStart, chunk.sourceEnd};
+			segments.push_back(segment);
+
+			cursor = chunk.sourceEnd;
+			if (cursor == OpenEnd) {
+				return segments;
+			}
+		}
+	}
+
+	if (request.end == OpenEnd || cursor < request.end) {
+		segments.push_back({false, {}, {cursor, request.end}});
+	}
+	return segments;
+}
+
+} // namespace incremental
+
+#endif // INCREMENTAL_HPP
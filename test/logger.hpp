@@ -0,0 +1,512 @@
+#ifndef LOGGER_HPP
+#define LOGGER_HPP
+
+/*
+
+Logger
+Structured asynchronous logger for the conversion pipelines.
+
+Every thread writes fixed-size records into its own single-producer ring buffer,
+so a log call on the frame path is a vsnprintf plus two atomic operations and never
+takes a lock or touches a stream. A background thread drains all rings, merges the
+records by timestamp and writes them to stderr in one buffered write per batch.
+
+Records are logfmt lines carrying the job ID, pipeline stage and frame number:
+
+	2026-10-18T12:00:00.123456Z ERROR job=3 stage=decode frame=1200 msg="Failed to receive frame"
+
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace logger {
+
+enum class Level : uint8_t {
+	Debug,
+	Info,
+	Warning,
+	Error
+};
+
+enum class Stage : uint8_t {
+	Job,
+	Demux,
+	Decode,
+	Filter,
+	Encode,
+	Mux,
+	Pipeline
+};
+
+// Frame number used by records that are not tied to a frame
+constexpr int64_t NoFrame = -1;
+
+inline const char* levelName(Level level) {
+	switch (level) {
+		case Level::Debug: return "DEBUG";
+		case Level::Info: return "INFO";
+		case Level::Warning: return "WARN";
+		case Level::Error: return "ERROR";
+	}
+	return "?";
+}
+
+inline const char* stageName(Stage stage) {
+	switch (stage) {
+		case Stage::Job: return "job";
+		case Stage::Demux: return "demux";
+		case Stage::Decode: return "decode";
+		case Stage::Filter: return "filter";
+		case Stage::Encode: return "encode";
+		case Stage::Mux: return "mux";
+		case Stage::Pipeline: return "pipeline";
+	}
+	return "?";
+}
+
+struct Record {
+	int64_t timestamp;   // ns since epoch
+	uint64_t jobId;
+	int64_t frame;
+	uint32_t suppressed; // Identical records dropped by rate limiting since the last one
+	Level level;
+	Stage stage;
+	uint16_t length;
+	char message[224];
+};
+
+/*
+
+Ring
+Single-producer / single-consumer queue owned by one logging thread.
+When the ring is full the record is dropped and counted instead of blocking the caller.
+
+*/
+
+class Ring {
+public:
+	static constexpr size_t Capacity = 1024; // Must be a power of two
+
+	bool push(const Record& record) {
+		const size_t head = head_.load(std::memory_order_relaxed);
+		if (head - tail_.load(std::memory_order_acquire) >= Capacity) {
+			dropped_.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		records_[head & (Capacity - 1)] = record;
+		head_.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	template <typename Sink>
+	size_t drain(Sink&& sink) {
+		const size_t tail = tail_.load(std::memory_order_relaxed);
+		const size_t head = head_.load(std::memory_order_acquire);
+		for (size_t i = tail; i != head; i++) {
+			sink(records_[i & (Capacity - 1)]);
+		}
+		tail_.store(head, std::memory_order_release);
+		return head - tail;
+	}
+
+	size_t size() const {
+		return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+	}
+
+	uint64_t takeDropped() {
+		return dropped_.exchange(0, std::memory_order_relaxed);
+	}
+
+	std::atomic<bool> orphaned{false}; // Owning thread has exited
+
+private:
+	alignas(64) std::atomic<size_t> head_{0};
+	alignas(64) std::atomic<size_t> tail_{0};
+	alignas(64) std::atomic<uint64_t> dropped_{0};
+	Record records_[Capacity];
+};
+
+/*
+
+Rate Limit
+Limiter for errors that can repeat on every frame, the logger keeps one per call site
+and job so one job's error flood never silences another job.
+Lets `burst` records through per interval and counts the rest, the next record
+that gets through reports how many were suppressed. Whatever is still counted when
+the job ends or the logger is flushed goes out as a record of its own.
+
+*/
+
+class RateLimit {
+public:
+	explicit RateLimit(uint32_t burst = 5, std::chrono::milliseconds interval = std::chrono::seconds(1))
+		: burst(burst), interval(std::chrono::duration_cast<std::chrono::nanoseconds>(interval).count()) {}
+
+	bool allow(uint32_t& suppressed) {
+		const int64_t now = std::chrono::steady_clock::now().time_since_epoch().count();
+		int64_t start = windowStart.load(std::memory_order_relaxed);
+		if (now - start >= interval && windowStart.compare_exchange_strong(start, now, std::memory_order_relaxed)) {
+			count.store(0, std::memory_order_relaxed);
+		}
+
+		if (count.fetch_add(1, std::memory_order_relaxed) < burst) {
+			suppressed = suppressedCount.exchange(0, std::memory_order_relaxed);
+			return true;
+		}
+		suppressedCount.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	uint32_t takeSuppressed() {
+		return suppressedCount.exchange(0, std::memory_order_relaxed);
+	}
+
+private:
+	const uint32_t burst;
+	const int64_t interval;
+	std::atomic<int64_t> windowStart{0};
+	std::atomic<uint32_t> count{0};
+	std::atomic<uint32_t> suppressedCount{0};
+};
+
+/*
+
+Logger
+Process-wide registry of rings plus the drain thread.
+
+*/
+
+class Logger {
+public:
+	static Logger& instance() {
+		static Logger logger;
+		return logger;
+	}
+
+	void setLevel(Level level) {
+		minLevel.store(level, std::memory_order_relaxed);
+	}
+
+	bool enabled(Level level) const {
+		return level >= minLevel.load(std::memory_order_relaxed);
+	}
+
+	void setOutput(FILE* stream) {
+		std::lock_guard<std::mutex> lock(outputMutex);
+		output = stream;
+	}
+
+	void write(Level level, Stage stage, uint64_t jobId, int64_t frame, uint32_t suppressed, const char* format, va_list args) {
+		Record record;
+		record.timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+		record.jobId = jobId;
+		record.frame = frame;
+		record.suppressed = suppressed;
+		record.level = level;
+		record.stage = stage;
+
+		int length = vsnprintf(record.message, sizeof(record.message), format, args);
+		record.length = (uint16_t)std::clamp(length, 0, (int)sizeof(record.message) - 1);
+
+		Ring& ring = localRing();
+		ring.push(record);
+
+		// Only wake the drain thread early for errors or when the ring is filling up
+		if (level == Level::Error || ring.size() > Ring::Capacity / 2) {
+			wakeup.notify_one();
+		}
+	}
+
+	// Limiter of one LOG_FRAME_ERROR call site within one job. Only errors get here, so
+	// the lock stays off the frame path of a healthy job.
+	bool allow(const void* site, Stage stage, uint64_t jobId, int64_t frame, uint32_t& suppressed) {
+		std::lock_guard<std::mutex> lock(limitsMutex);
+		Limited& limited = limits[{site, jobId}];
+		limited.stage = stage;
+		limited.frame = frame;
+		return limited.limit.allow(suppressed);
+	}
+
+	// Reports what the limiters of jobId still hold back and forgets them
+	void endJob(uint64_t jobId) {
+		reportSuppressed(&jobId);
+	}
+
+	// Blocks until every record written before the call has been printed
+	void flush() {
+		reportSuppressed(nullptr);
+		std::unique_lock<std::mutex> lock(drainMutex);
+		const uint64_t target = ++flushRequests;
+		wakeup.notify_one();
+		flushed.wait(lock, [&] { return flushesDone >= target || !running; });
+	}
+
+	~Logger() {
+		{
+			std::lock_guard<std::mutex> lock(drainMutex);
+			running = false;
+		}
+		wakeup.notify_one();
+		if (drainThread.joinable()) {
+			drainThread.join();
+		}
+		drainOnce();
+	}
+
+private:
+	std::atomic<Level> minLevel{Level::Info};
+
+	std::mutex registryMutex;
+	std::vector<std::shared_ptr<Ring>> rings;
+
+	struct Limited {
+		RateLimit limit;
+		Stage stage = Stage::Pipeline;
+		int64_t frame = NoFrame;
+	};
+
+	std::mutex limitsMutex;
+	std::map<std::pair<const void*, uint64_t>, Limited> limits;
+
+	std::mutex drainMutex;
+	std::condition_variable wakeup;
+	std::condition_variable flushed;
+	uint64_t flushRequests = 0;
+	uint64_t flushesDone = 0;
+	bool running = true;
+
+	std::mutex outputMutex;
+	FILE* output = stderr;
+
+	std::vector<Record> batch;
+	std::string buffer;
+	std::thread drainThread;
+
+	Logger() {
+		drainThread = std::thread([this] { run(); });
+	}
+
+	struct LocalRing {
+		std::shared_ptr<Ring> ring;
+		~LocalRing() {
+			if (ring) {
+				ring->orphaned.store(true, std::memory_order_release);
+			}
+		}
+	};
+
+	Ring& localRing() {
+		thread_local LocalRing local;
+		if (!local.ring) {
+			local.ring = std::make_shared<Ring>();
+			std::lock_guard<std::mutex> lock(registryMutex);
+			rings.push_back(local.ring);
+		}
+		return *local.ring;
+	}
+
+	// Pending suppressed counts of one job, or of every job without forgetting them
+	void reportSuppressed(const uint64_t* jobId) {
+		std::lock_guard<std::mutex> lock(limitsMutex);
+		for (auto it = limits.begin(); it != limits.end();) {
+			if (jobId && it->first.second != *jobId) {
+				++it;
+				continue;
+			}
+			const uint32_t suppressed = it->second.limit.takeSuppressed();
+			if (suppressed > 0 && enabled(Level::Error)) {
+				writeRecord(Level::Error, it->second.stage, it->first.second, it->second.frame, suppressed, "Repeated errors suppressed");
+			}
+			it = jobId ? limits.erase(it) : std::next(it);
+		}
+	}
+
+	void writeRecord(Level level, Stage stage, uint64_t jobId, int64_t frame, uint32_t suppressed, const char* format, ...) {
+		va_list args;
+		va_start(args, format);
+		write(level, stage, jobId, frame, suppressed, format, args);
+		va_end(args);
+	}
+
+	void run() {
+		std::unique_lock<std::mutex> lock(drainMutex);
+		while (running) {
+			if (flushRequests == flushesDone) {
+				wakeup.wait_for(lock, std::chrono::milliseconds(50));
+			}
+			const uint64_t target = flushRequests;
+
+			lock.unlock();
+			drainOnce();
+			lock.lock();
+
+			flushesDone = target;
+			flushed.notify_all();
+		}
+		flushed.notify_all();
+	}
+
+	void drainOnce() {
+		std::vector<std::shared_ptr<Ring>> snapshot;
+		{
+			std::lock_guard<std::mutex> lock(registryMutex);
+			snapshot = rings;
+		}
+
+		batch.clear();
+		uint64_t dropped = 0;
+		for (auto& ring : snapshot) {
+			ring->drain([&](const Record& record) { batch.push_back(record); });
+			dropped += ring->takeDropped();
+		}
+
+		// Forget rings of exited threads once they are empty
+		{
+			std::lock_guard<std::mutex> lock(registryMutex);
+			rings.erase(std::remove_if(rings.begin(), rings.end(), [](const std::shared_ptr<Ring>& ring) {
+				return ring->orphaned.load(std::memory_order_acquire) && ring->size() == 0;
+			}), rings.end());
+		}
+
+		if (batch.empty() && dropped == 0) {
+			return;
+		}
+
+		std::stable_sort(batch.begin(), batch.end(), [](const Record& a, const Record& b) {
+			return a.timestamp < b.timestamp;
+		});
+
+		buffer.clear();
+		for (const Record& record : batch) {
+			format(record);
+		}
+		if (dropped > 0) {
+			char line[96];
+			snprintf(line, sizeof(line), "WARN stage=pipeline msg=\"log rings full\" dropped=%llu\n", (unsigned long long)dropped);
+			buffer += line;
+		}
+
+		std::lock_guard<std::mutex> lock(outputMutex);
+		fwrite(buffer.data(), 1, buffer.size(), output);
+		fflush(output);
+	}
+
+	void format(const Record& record) {
+		char line[128];
+		const time_t seconds = (time_t)(record.timestamp / 1000000000);
+		const long micros = (long)(record.timestamp % 1000000000 / 1000);
+		struct tm utc;
+		gmtime_r(&seconds, &utc);
+
+		size_t n = strftime(line, sizeof(line), "%Y-%m-%dT%H:%M:%S", &utc);
+		n += snprintf(line + n, sizeof(line) - n, ".%06ldZ %s job=%llu stage=%s",
+			micros, levelName(record.level), (unsigned long long)record.jobId, stageName(record.stage));
+		if (record.frame != NoFrame) {
+			n += snprintf(line + n, sizeof(line) - n, " frame=%lld", (long long)record.frame);
+		}
+		buffer.append(line, std::min(n, sizeof(line) - 1));
+
+		buffer += " msg=\"";
+		for (uint16_t i = 0; i < record.length; i++) {
+			const char c = record.message[i];
+			if (c == '"' || c == '\\') {
+				buffer += '\\';
+				buffer += c;
+			} else if (c == '\n') {
+				buffer += "\\n";
+			} else {
+				buffer += c;
+			}
+		}
+		buffer += '"';
+
+		if (record.suppressed > 0) {
+			snprintf(line, sizeof(line), " suppressed=%u", record.suppressed);
+			buffer += line;
+		}
+		buffer += '\n';
+	}
+};
+
+/*
+
+Free functions used by the converters
+
+*/
+
+#if defined(__GNUC__)
+#define LOGGER_PRINTF(fmt, args) __attribute__((format(printf, fmt, args)))
+#else
+#define LOGGER_PRINTF(fmt, args)
+#endif
+
+LOGGER_PRINTF(6, 7)
+inline void write(Level level, Stage stage, uint64_t jobId, int64_t frame, uint32_t suppressed, const char* format, ...) {
+	Logger& logger = Logger::instance();
+	if (!logger.enabled(level)) {
+		return;
+	}
+	va_list args;
+	va_start(args, format);
+	logger.write(level, stage, jobId, frame, suppressed, format, args);
+	va_end(args);
+}
+
+#define LOGGER_LEVEL_FN(name, level) \
+	LOGGER_PRINTF(4, 5) \
+	inline void name(Stage stage, uint64_t jobId, int64_t frame, const char* format, ...) { \
+		Logger& logger = Logger::instance(); \
+		if (!logger.enabled(level)) { \
+			return; \
+		} \
+		va_list args; \
+		va_start(args, format); \
+		logger.write(level, stage, jobId, frame, 0, format, args); \
+		va_end(args); \
+	}
+
+LOGGER_LEVEL_FN(debug, Level::Debug)
+LOGGER_LEVEL_FN(info, Level::Info)
+LOGGER_LEVEL_FN(warning, Level::Warning)
+LOGGER_LEVEL_FN(error, Level::Error)
+
+#undef LOGGER_LEVEL_FN
+
+inline void flush() {
+	Logger::instance().flush();
+}
+
+// Call once a job has stopped logging frame errors
+inline void endJob(uint64_t jobId) {
+	Logger::instance().endJob(jobId);
+}
+
+} // namespace logger
+
+// Rate-limited error for the frame path, one limiter per call site and job
+#define LOG_FRAME_ERROR(stage, jobId, frame, ...) \
+	do { \
+		static const char logSite_ = 0; \
+		uint32_t logSuppressed_ = 0; \
+		if (logger::Logger::instance().enabled(logger::Level::Error) && \
+		    logger::Logger::instance().allow(&logSite_, stage, jobId, frame, logSuppressed_)) { \
+			logger::write(logger::Level::Error, stage, jobId, frame, logSuppressed_, __VA_ARGS__); \
+		} \
+	} while (0)
+
+#endif // LOGGER_HPP
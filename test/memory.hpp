@@ -0,0 +1,167 @@
+#ifndef MEMORY_HPP
+#define MEMORY_HPP
+
+/*
+
+Memory
+Frame budget for a conversion. Nearly all of a job's memory is frames held inside the
+stages, and most of them are held by libraries we only configure:
+
+	decode    reference frames, plus one frame per frame thread
+	filter    the fps filter's pending frame, our filtered, scaled and converted frames
+	encode    libvpx reference buffers, plus the lookahead (lag-in-frames)
+	quality   kept reference frames waiting for their decoded version (quality::Monitor)
+
+plan() takes the part a stage needs whatever we do, then hands out decoder threads,
+lookahead frames and quality backlog from what is left, one at a time in turn, so a
+tight budget trades a little of each instead of all of one. Below the minimum the job
+runs at the minimum and says so.
+
+Usage counts what each stage actually holds while the job runs, for the high-water
+marks reported at the end. Counts are frames sent in minus frames taken out, so frames
+a stage holds as references on top of those are not in them.
+
+*/
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+namespace memory {
+
+enum class Stage { Decode, Filter, Encode, Quality };
+static constexpr int StageCount = 4;
+
+inline const char* stageName(Stage stage) {
+	switch (stage) {
+	case Stage::Decode:  return "decode";
+	case Stage::Filter:  return "filter";
+	case Stage::Encode:  return "encode";
+	case Stage::Quality: return "quality";
+	}
+	return "unknown";
+}
+
+// Frames a stage holds whatever it is configured to
+static constexpr int DecoderReferences = 9;   // VP9 keeps 8 reference slots, plus the frame being decoded
+static constexpr int FilterFrames = 4;
+static constexpr int EncoderReferences = 10;  // libvpx references, alt-ref and the frame being coded
+
+// Upper ends of what plan() hands out, libvpx's own lookahead default and the monitor's
+static constexpr int MaxLag = 25;
+static constexpr int MaxQualityPending = 4;
+
+struct Sizes {
+	int64_t sourceFrame = 0;   // Decoded frame
+	int64_t outputFrame = 0;   // Frame at the output size, what the filter and encoder side hold
+};
+
+struct Limits {
+	int decoderThreads = 1;
+	int lagInFrames = 0;
+	int qualityPending = 0;    // 0 with inline metrics off
+	int64_t minimumBytes = 0;  // What the stages hold with the smallest settings
+	int64_t plannedBytes = 0;
+
+	bool fits(int64_t budget) const {
+		return minimumBytes <= budget;
+	}
+};
+
+/*
+
+Plan
+maxThreads and maxLag are what the job would use without a budget, maxLag 0 for the
+realtime tier. qualityInterval is the monitor's sampling interval, 0 with it off: the
+lookahead holds one kept frame per interval on top of the backlog.
+
+*/
+
+inline Limits plan(int64_t budget, const Sizes& sizes, int maxThreads, int maxLag, int qualityInterval) {
+	Limits limits;
+	maxThreads = std::max(1, maxThreads);
+	maxLag = std::clamp(maxLag, 0, MaxLag);
+	const int maxPending = qualityInterval > 0 ? MaxQualityPending : 0;
+	limits.qualityPending = qualityInterval > 0 ? 1 : 0;
+
+	auto cost = [&](const Limits& candidate) {
+		const int64_t kept = qualityInterval > 0 ? candidate.lagInFrames / qualityInterval + candidate.qualityPending : 0;
+		return (DecoderReferences + candidate.decoderThreads) * sizes.sourceFrame +
+		       (FilterFrames + EncoderReferences + candidate.lagInFrames + kept) * sizes.outputFrame;
+	};
+	limits.minimumBytes = cost(limits);
+
+	bool grew = true;
+	while (grew) {
+		grew = false;
+		auto tryStep = [&](int Limits::*field, int maximum) {
+			Limits next = limits;
+			if (next.*field >= maximum) {
+				return;
+			}
+			next.*field += 1;
+			if (cost(next) <= budget) {
+				limits = next;
+				grew = true;
+			}
+		};
+		tryStep(&Limits::lagInFrames, maxLag);
+		tryStep(&Limits::decoderThreads, maxThreads);
+		tryStep(&Limits::qualityPending, maxPending);
+	}
+	limits.plannedBytes = cost(limits);
+	return limits;
+}
+
+// Frames in one stage, from the conversion thread only
+struct Gauge {
+	int64_t frames = 0;
+	int64_t frameBytes = 0;
+	int64_t peakFrames = 0;
+
+	void set(int64_t count) {
+		frames = std::max<int64_t>(0, count);
+		peakFrames = std::max(peakFrames, frames);
+	}
+
+	void enter() { set(frames + 1); }
+	void leave() { set(frames - 1); }
+
+	int64_t peakBytes() const {
+		return peakFrames * frameBytes;
+	}
+};
+
+class Usage {
+public:
+	void configure(const Sizes& sizes) {
+		gauges[(int)Stage::Decode].frameBytes = sizes.sourceFrame;
+		gauges[(int)Stage::Filter].frameBytes = sizes.outputFrame;
+		gauges[(int)Stage::Encode].frameBytes = sizes.outputFrame;
+		gauges[(int)Stage::Quality].frameBytes = sizes.outputFrame;
+	}
+
+	Gauge& operator[](Stage stage) { return gauges[(int)stage]; }
+	const Gauge& operator[](Stage stage) const { return gauges[(int)stage]; }
+
+	// "decode 3 (24.9 MB), filter 1 (...)", peaks of each stage
+	std::string summary() const {
+		std::string text;
+		for (int i = 0; i < StageCount; i++) {
+			char part[96];
+			snprintf(part, sizeof(part), "%s%s %lld (%.1f MB)", i ? ", " : "", stageName((Stage)i),
+			         (long long)gauges[i].peakFrames, gauges[i].peakBytes() / 1048576.0);
+			text += part;
+		}
+		return text;
+	}
+
+private:
+	std::array<Gauge, StageCount> gauges;
+};
+
+} // namespace memory
+
+#endif // MEMORY_HPP
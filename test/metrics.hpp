@@ -0,0 +1,208 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+/*
+
+Metrics
+PSNR and SSIM between two 8-bit YUV 4:2:0 frames of the same size, in process, so a
+quality number does not need an ffmpeg run over the output afterwards.
+
+SSIM is the usual fast form (x264, the ffmpeg ssim filter): 8x8 windows every 4 pixels,
+built from sums over 4x4 blocks, each window scored with the standard constants and the
+scores averaged. Both metrics are computed per plane and combined weighted by sample
+count, so luma counts four times each chroma plane, which is what ffmpeg reports as All.
+
+All sums are integers, the SSE2 path gives exactly the same result as the scalar one.
+
+*/
+
+extern "C" {
+	#include <libavutil/frame.h>
+}
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "scores.hpp"
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <emmintrin.h>
+#define METRICS_SSE2 1
+#endif
+
+namespace metrics {
+
+inline double psnrFromMse(double mse) {
+	return mse > 0 ? std::min(100.0, 10 * std::log10(255.0 * 255.0 / mse)) : 100;
+}
+
+/*
+
+Plane Kernels
+
+*/
+
+// Sum of squared differences over a width x height plane
+inline uint64_t squaredError(const uint8_t* a, int strideA, const uint8_t* b, int strideB, int width, int height) {
+	uint64_t total = 0;
+	for (int y = 0; y < height; y++) {
+		const uint8_t* rowA = a + (ptrdiff_t)y * strideA;
+		const uint8_t* rowB = b + (ptrdiff_t)y * strideB;
+		int x = 0;
+		uint64_t row = 0;
+#ifdef METRICS_SSE2
+		// Per lane at most 4 * 255^2 per 16 pixels, 32 bits hold rows of over 60k pixels
+		const __m128i zero = _mm_setzero_si128();
+		__m128i sum = zero;
+		for (; x + 16 <= width; x += 16) {
+			const __m128i pixelsA = _mm_loadu_si128((const __m128i*)(rowA + x));
+			const __m128i pixelsB = _mm_loadu_si128((const __m128i*)(rowB + x));
+			const __m128i low = _mm_sub_epi16(_mm_unpacklo_epi8(pixelsA, zero), _mm_unpacklo_epi8(pixelsB, zero));
+			const __m128i high = _mm_sub_epi16(_mm_unpackhi_epi8(pixelsA, zero), _mm_unpackhi_epi8(pixelsB, zero));
+			sum = _mm_add_epi32(sum, _mm_add_epi32(_mm_madd_epi16(low, low), _mm_madd_epi16(high, high)));
+		}
+		uint32_t lanes[4];
+		_mm_storeu_si128((__m128i*)lanes, sum);
+		row = (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+		for (; x < width; x++) {
+			const int d = rowA[x] - rowB[x];
+			row += d * d;
+		}
+		total += row;
+	}
+	return total;
+}
+
+// Sums over one 4x4 block of both planes
+struct BlockSums {
+	int a = 0;       // sum a
+	int b = 0;       // sum b
+	int squares = 0; // sum a^2 + b^2
+	int cross = 0;   // sum a*b
+};
+
+// One row of 4x4 blocks starting at a and b, count blocks
+inline void blockSums(const uint8_t* a, int strideA, const uint8_t* b, int strideB, int count, BlockSums* out) {
+	int block = 0;
+#ifdef METRICS_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ones = _mm_set1_epi16(1);
+	for (; block + 4 <= count; block += 4) {
+		__m128i sumA[2] = {zero, zero}, sumB[2] = {zero, zero}, squares[2] = {zero, zero}, cross[2] = {zero, zero};
+		for (int y = 0; y < 4; y++) {
+			const __m128i pixelsA = _mm_loadu_si128((const __m128i*)(a + (ptrdiff_t)y * strideA + block * 4));
+			const __m128i pixelsB = _mm_loadu_si128((const __m128i*)(b + (ptrdiff_t)y * strideB + block * 4));
+			const __m128i wideA[2] = {_mm_unpacklo_epi8(pixelsA, zero), _mm_unpackhi_epi8(pixelsA, zero)};
+			const __m128i wideB[2] = {_mm_unpacklo_epi8(pixelsB, zero), _mm_unpackhi_epi8(pixelsB, zero)};
+			for (int half = 0; half < 2; half++) {
+				sumA[half] = _mm_add_epi16(sumA[half], wideA[half]);
+				sumB[half] = _mm_add_epi16(sumB[half], wideB[half]);
+				squares[half] = _mm_add_epi32(squares[half], _mm_add_epi32(_mm_madd_epi16(wideA[half], wideA[half]),
+				                                                            _mm_madd_epi16(wideB[half], wideB[half])));
+				cross[half] = _mm_add_epi32(cross[half], _mm_madd_epi16(wideA[half], wideB[half]));
+			}
+		}
+		// Each half holds two blocks: pairs of columns per 32-bit lane, lanes 0+1 and 2+3
+		for (int half = 0; half < 2; half++) {
+			int32_t lanes[4][4];
+			_mm_storeu_si128((__m128i*)lanes[0], _mm_madd_epi16(sumA[half], ones));
+			_mm_storeu_si128((__m128i*)lanes[1], _mm_madd_epi16(sumB[half], ones));
+			_mm_storeu_si128((__m128i*)lanes[2], squares[half]);
+			_mm_storeu_si128((__m128i*)lanes[3], cross[half]);
+			for (int i = 0; i < 2; i++) {
+				BlockSums& sums = out[block + half * 2 + i];
+				sums.a = lanes[0][2 * i] + lanes[0][2 * i + 1];
+				sums.b = lanes[1][2 * i] + lanes[1][2 * i + 1];
+				sums.squares = lanes[2][2 * i] + lanes[2][2 * i + 1];
+				sums.cross = lanes[3][2 * i] + lanes[3][2 * i + 1];
+			}
+		}
+	}
+#endif
+	for (; block < count; block++) {
+		BlockSums sums;
+		for (int y = 0; y < 4; y++) {
+			for (int x = 0; x < 4; x++) {
+				const int pa = a[(ptrdiff_t)y * strideA + block * 4 + x];
+				const int pb = b[(ptrdiff_t)y * strideB + block * 4 + x];
+				sums.a += pa;
+				sums.b += pb;
+				sums.squares += pa * pa + pb * pb;
+				sums.cross += pa * pb;
+			}
+		}
+		out[block] = sums;
+	}
+}
+
+// Score of one 8x8 window from the sums of its four 4x4 blocks
+inline double windowSsim(const BlockSums& s0, const BlockSums& s1, const BlockSums& s2, const BlockSums& s3) {
+	const int64_t c1 = (int64_t)(.01 * .01 * 255 * 255 * 64 + .5);
+	const int64_t c2 = (int64_t)(.03 * .03 * 255 * 255 * 64 * 63 + .5);
+	const int64_t sa = s0.a + s1.a + s2.a + s3.a;
+	const int64_t sb = s0.b + s1.b + s2.b + s3.b;
+	const int64_t squares = s0.squares + s1.squares + s2.squares + s3.squares;
+	const int64_t cross = s0.cross + s1.cross + s2.cross + s3.cross;
+	const int64_t variance = squares * 64 - sa * sa - sb * sb;
+	const int64_t covariance = cross * 64 - sa * sb;
+	return (double)(2 * sa * sb + c1) * (double)(2 * covariance + c2) /
+	       ((double)(sa * sa + sb * sb + c1) * (double)(variance + c2));
+}
+
+// Mean SSIM over the plane's 8x8 windows, and how many there were
+inline double planeSsim(const uint8_t* a, int strideA, const uint8_t* b, int strideB, int width, int height, int64_t& windows) {
+	const int blocksX = width / 4;
+	const int blocksY = height / 4;
+	windows = (int64_t)std::max(0, blocksX - 1) * std::max(0, blocksY - 1);
+	if (windows == 0) {
+		return 1;
+	}
+
+	std::vector<BlockSums> above(blocksX), below(blocksX);
+	blockSums(a, strideA, b, strideB, blocksX, above.data());
+	double total = 0;
+	for (int y = 1; y < blocksY; y++) {
+		blockSums(a + (ptrdiff_t)y * 4 * strideA, strideA, b + (ptrdiff_t)y * 4 * strideB, strideB, blocksX, below.data());
+		for (int x = 0; x + 1 < blocksX; x++) {
+			total += windowSsim(above[x], above[x + 1], below[x], below[x + 1]);
+		}
+		std::swap(above, below);
+	}
+	return total / windows;
+}
+
+/*
+
+Frames
+
+*/
+
+// a and b are yuv420p of the same size
+inline Score compare(const AVFrame* a, const AVFrame* b) {
+	uint64_t error = 0;
+	int64_t samples = 0;
+	double ssim = 0;
+	int64_t windowsTotal = 0;
+	for (int plane = 0; plane < 3; plane++) {
+		const int width = plane == 0 ? a->width : (a->width + 1) / 2;
+		const int height = plane == 0 ? a->height : (a->height + 1) / 2;
+		error += squaredError(a->data[plane], a->linesize[plane], b->data[plane], b->linesize[plane], width, height);
+		samples += (int64_t)width * height;
+
+		int64_t windows = 0;
+		const double planeScore = planeSsim(a->data[plane], a->linesize[plane], b->data[plane], b->linesize[plane], width, height, windows);
+		ssim += planeScore * windows;
+		windowsTotal += windows;
+	}
+	Score score;
+	score.psnr = psnrFromMse(samples ? (double)error / samples : 0);
+	score.ssim = windowsTotal ? ssim / windowsTotal : 1;
+	return score;
+}
+
+} // namespace metrics
+
+#endif // METRICS_HPP
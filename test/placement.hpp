@@ -0,0 +1,335 @@
+#ifndef PLACEMENT_HPP
+#define PLACEMENT_HPP
+
+/*
+
+Placement
+Keeps each conversion on one NUMA node. On a dual-socket host a frame decoded on one
+socket, scaled on the other and encoded on the first crosses the interconnect twice,
+and its memory sits wherever the thread that touched it first happened to run.
+
+A placed job gets the node with the fewest running jobs. The thread running it is pinned
+to that node's CPUs for the job, so the decoder and libvpx threads it creates inherit the
+mask; scaling bands and inline metrics run on a worker pool of that node; and frame
+memory comes from an arena (arena.hpp) bound to the node. Concurrent jobs spread across
+nodes in turn.
+
+Topologies come from /sys/devices/system/node. A simulated one splits the CPUs we may
+run on into nodes, so pinning and job spreading can be tried on a single-socket box;
+there is no node memory to bind to then, frame memory is left to first touch.
+
+*/
+
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "async.hpp"
+
+namespace placement {
+
+struct Node {
+	int id = 0;
+	std::vector<int> cpus;
+};
+
+// Linux cpulist format, "0-3,8-11"
+inline std::vector<int> parseCpuList(const std::string& text) {
+	std::vector<int> cpus;
+	std::stringstream stream(text);
+	std::string part;
+	while (std::getline(stream, part, ',')) {
+		int first = 0;
+		int last = 0;
+		const int fields = sscanf(part.c_str(), "%d-%d", &first, &last);
+		if (fields < 1) {
+			continue;
+		}
+		for (int cpu = first; cpu <= (fields == 2 ? last : first); cpu++) {
+			cpus.push_back(cpu);
+		}
+	}
+	return cpus;
+}
+
+// CPUs this process may run on
+inline std::vector<int> allowedCpus() {
+	std::vector<int> cpus;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &set)) {
+				cpus.push_back(cpu);
+			}
+		}
+	}
+	if (cpus.empty()) {
+		cpus.push_back(0);
+	}
+	return cpus;
+}
+
+struct Topology {
+	std::vector<Node> nodes;
+	bool simulated = false;
+
+	// Nodes with at least one CPU we may run on, one node with all of them without sysfs
+	static Topology detect() {
+		const std::vector<int> allowed = allowedCpus();
+		Topology topology;
+		for (int id = 0; id < 1024; id++) {
+			std::ifstream file("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+			if (!file) {
+				continue;  // Node ids can have gaps
+			}
+			std::string text;
+			std::getline(file, text);
+			Node node;
+			node.id = id;
+			for (int cpu : parseCpuList(text)) {
+				if (std::find(allowed.begin(), allowed.end(), cpu) != allowed.end()) {
+					node.cpus.push_back(cpu);
+				}
+			}
+			if (!node.cpus.empty()) {
+				topology.nodes.push_back(node);
+			}
+		}
+		if (topology.nodes.empty()) {
+			topology.nodes.push_back({0, allowed});
+		}
+		return topology;
+	}
+
+	// The allowed CPUs in nodeCount contiguous groups, nodes share CPUs when there are
+	// fewer CPUs than nodes
+	static Topology simulate(int nodeCount) {
+		const std::vector<int> allowed = allowedCpus();
+		const size_t cpus = allowed.size();
+		nodeCount = std::max(1, nodeCount);
+		Topology topology;
+		topology.simulated = true;
+		for (int id = 0; id < nodeCount; id++) {
+			Node node;
+			node.id = id;
+			if (cpus >= (size_t)nodeCount) {
+				node.cpus.assign(allowed.begin() + cpus * id / nodeCount, allowed.begin() + cpus * (id + 1) / nodeCount);
+			} else {
+				node.cpus.push_back(allowed[id % cpus]);
+			}
+			topology.nodes.push_back(node);
+		}
+		return topology;
+	}
+
+	// "0-3;4-7", one cpulist per node
+	static Topology parse(const std::string& spec) {
+		Topology topology;
+		topology.simulated = true;
+		std::stringstream stream(spec);
+		std::string list;
+		while (std::getline(stream, list, ';')) {
+			Node node;
+			node.id = (int)topology.nodes.size();
+			node.cpus = parseCpuList(list);
+			if (!node.cpus.empty()) {
+				topology.nodes.push_back(node);
+			}
+		}
+		return topology;
+	}
+
+	// "node0 4 cpus, node1 4 cpus (simulated)"
+	std::string describe() const {
+		std::string text;
+		for (const Node& node : nodes) {
+			text += (text.empty() ? "node" : ", node") + std::to_string(node.id) + " " +
+			        std::to_string(node.cpus.size()) + " cpus";
+		}
+		return text + (simulated ? " (simulated)" : "");
+	}
+};
+
+/*
+
+Pin
+Pins the calling thread to a set of CPUs and puts its previous mask back on destruction,
+for jobs that run on a shared pool thread.
+
+*/
+
+class Pin {
+public:
+	explicit Pin(const std::vector<int>& cpus) {
+		CPU_ZERO(&previous);
+		if (sched_getaffinity(0, sizeof(previous), &previous) != 0) {
+			return;
+		}
+		pinned = pinCurrentThread(cpus);
+	}
+
+	~Pin() {
+		if (pinned) {
+			sched_setaffinity(0, sizeof(previous), &previous);
+		}
+	}
+
+	Pin(const Pin&) = delete;
+	Pin& operator=(const Pin&) = delete;
+
+	bool ok() const {
+		return pinned;
+	}
+
+	static bool pinCurrentThread(const std::vector<int>& cpus) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (int cpu : cpus) {
+			if (cpu >= 0 && cpu < CPU_SETSIZE) {
+				CPU_SET(cpu, &set);
+			}
+		}
+		return CPU_COUNT(&set) > 0 && sched_setaffinity(0, sizeof(set), &set) == 0;
+	}
+
+private:
+	cpu_set_t previous;
+	bool pinned = false;
+};
+
+// Pages of [data, data + bytes) not touched yet are taken from node when it has any
+// free, MPOL_PREFERRED through the raw syscall so there is no libnuma dependency
+inline bool preferNode(void* data, size_t bytes, int node) {
+#ifdef SYS_mbind
+	if (node < 0 || node >= 64) {
+		return false;
+	}
+	const int MpolPreferred = 1;
+	const unsigned long mask = 1UL << node;
+	return syscall(SYS_mbind, data, bytes, MpolPreferred, &mask, 64UL, 0U) == 0;
+#else
+	(void)data;
+	(void)bytes;
+	(void)node;
+	return false;
+#endif
+}
+
+/*
+
+Scheduler
+Process-wide node assignment. Configure a simulated topology before the first job is
+placed; nodes keep their worker pools once created.
+
+*/
+
+class Scheduler {
+public:
+	// Node slot held by one job, released on destruction
+	class Lease {
+	public:
+		Lease() = default;
+		Lease(Scheduler* owner, int index) : owner(owner), slot(index) {}
+		Lease(Lease&& other) noexcept : owner(other.owner), slot(other.slot) { other.owner = nullptr; }
+		Lease& operator=(Lease&& other) noexcept {
+			if (this != &other) {
+				release();
+				owner = other.owner;
+				slot = other.slot;
+				other.owner = nullptr;
+			}
+			return *this;
+		}
+		~Lease() { release(); }
+
+		explicit operator bool() const { return owner != nullptr; }
+		int index() const { return slot; }
+		const Node& node() const { return owner->topology().nodes[slot]; }
+		bool simulated() const { return owner->topology().simulated; }
+
+		// Scaling bands and metrics of this job, the node's own threads
+		async::WorkerPool& pool() const { return owner->pool(slot); }
+
+	private:
+		Scheduler* owner = nullptr;
+		int slot = 0;
+
+		void release() {
+			if (owner) {
+				owner->release(slot);
+				owner = nullptr;
+			}
+		}
+	};
+
+	static Scheduler& shared() {
+		static Scheduler scheduler(Topology::detect());
+		return scheduler;
+	}
+
+	explicit Scheduler(const Topology& topology) {
+		configure(topology);
+	}
+
+	void configure(const Topology& newTopology) {
+		std::lock_guard<std::mutex> lock(mutex);
+		current = newTopology;
+		jobs.assign(current.nodes.size(), 0);
+		pools.clear();
+		pools.resize(current.nodes.size());
+	}
+
+	const Topology& topology() const {
+		return current;
+	}
+
+	// Node with the fewest running jobs, the lowest index on a tie
+	Lease acquire() {
+		std::lock_guard<std::mutex> lock(mutex);
+		const int index = (int)(std::min_element(jobs.begin(), jobs.end()) - jobs.begin());
+		jobs[index]++;
+		return Lease(this, index);
+	}
+
+	int runningJobs(int index) const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return jobs[index];
+	}
+
+private:
+	mutable std::mutex mutex;
+	Topology current;
+	std::vector<int> jobs;
+	std::vector<std::unique_ptr<async::WorkerPool>> pools;
+
+	void release(int index) {
+		std::lock_guard<std::mutex> lock(mutex);
+		jobs[index]--;
+	}
+
+	async::WorkerPool& pool(int index) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!pools[index]) {
+			const std::vector<int> cpus = current.nodes[index].cpus;
+			pools[index] = std::make_unique<async::WorkerPool>((unsigned)cpus.size(), [cpus] {
+				Pin::pinCurrentThread(cpus);
+			});
+		}
+		return *pools[index];
+	}
+};
+
+} // namespace placement
+
+#endif // PLACEMENT_HPP
@@ -0,0 +1,681 @@
+#ifndef QUALITY_HPP
+#define QUALITY_HPP
+
+/*
+
+Quality
+Target quality mode: finds the CRF that reaches a quality target for this source instead
+of one hand picked CRF for everything, which overspends on easy content and underspends
+on hard content.
+
+	decode a few short segments spread over the source, scale them like the converter
+	encode every segment at every candidate CRF, in parallel on the worker pool
+	decode the packets back and score them against the scaled source (metrics.hpp)
+	interpolate the CRF where the score crosses the target
+
+The full encode then runs once at that CRF, as constant quality without a bitrate cap.
+Scores are interpolated as dB (SSIM as -10 log10(1 - ssim)), which is close to linear
+in the CRF, and the CRF is rounded down so the target is met rather than just missed.
+
+The samples are limited to a fraction of the duration per candidate, so the search
+costs a small part of the full encode on anything longer than a clip.
+
+Monitor, at the end, scores the real output while it is encoded.
+
+*/
+
+extern "C" {
+	#include <libavcodec/avcodec.h>
+	#include <libavformat/avformat.h>
+	#include <libavutil/opt.h>
+	#include <libswscale/swscale.h>
+}
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "async.hpp"
+#include "encoders.hpp"
+#include "geometry.hpp"
+#include "handles.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "settings.hpp"
+#include "tonemap.hpp"
+
+namespace quality {
+
+enum class Metric { Ssim, Psnr };
+
+struct Options {
+	Metric metric = Metric::Ssim;
+	double target = 0.97;                    // SSIM 0-1, or PSNR in dB
+	std::vector<int> crfs = {18, 26, 34, 42}; // Candidates, ascending
+	int segments = 3;
+	double segmentSeconds = 2;
+	double maxSampleFraction = 0.02;         // Sampled seconds per candidate against the duration
+	double minSegmentSeconds = 0.5;
+};
+
+struct Candidate {
+	int crf = 0;
+	metrics::Average quality;
+	int64_t bytes = 0;
+};
+
+struct Result {
+	bool ok = false;
+	int crf = 0;
+	std::vector<Candidate> candidates;
+	double sampledSeconds = 0;
+	double searchSeconds = 0;
+};
+
+// The number the interpolation works on
+inline double value(const metrics::Score& score, Metric metric) {
+	return metric == Metric::Ssim ? score.ssimDb() : score.psnr;
+}
+
+inline double targetValue(const Options& options) {
+	return options.metric == Metric::Ssim ? metrics::Score{0, options.target}.ssimDb() : options.target;
+}
+
+/*
+
+Samples
+Decoded segments scaled to the output size as 8-bit yuv420p, the same path the converter
+takes: display rotation, cover scale and crop, tone mapping for 10-bit input.
+
+*/
+
+class Samples {
+public:
+	std::vector<std::vector<AVFrame*>> segments;
+	double seconds = 0;
+
+	Samples() = default;
+	Samples(const Samples&) = delete;
+	Samples& operator=(const Samples&) = delete;
+
+	~Samples() {
+		for (std::vector<AVFrame*>& frames : segments) {
+			for (AVFrame*& frame : frames) {
+				av_frame_free(&frame);
+			}
+		}
+		av_frame_free(&converted);
+		av_frame_free(&wide);
+		sws_freeContext(sws);
+	}
+
+	bool load(const std::string& inputPath, const OutputSettings& settings, const Options& options, uint64_t jobId) {
+		AVFormatContext* format = nullptr;
+		if (avformat_open_input(&format, inputPath.c_str(), nullptr, nullptr) != 0) {
+			logger::error(logger::Stage::Demux, jobId, logger::NoFrame, "Could not open %s", inputPath.c_str());
+			return false;
+		}
+		if (avformat_find_stream_info(format, nullptr) < 0) {
+			avformat_close_input(&format);
+			return false;
+		}
+		const int streamIndex = av_find_best_stream(format, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+		if (streamIndex < 0) {
+			logger::error(logger::Stage::Demux, jobId, logger::NoFrame, "No video stream in %s", inputPath.c_str());
+			avformat_close_input(&format);
+			return false;
+		}
+		AVStream* stream = format->streams[streamIndex];
+
+		const AVCodec* decoder = avcodec_find_decoder(stream->codecpar->codec_id);
+		AVCodecContext* ctx = decoder ? avcodec_alloc_context3(decoder) : nullptr;
+		if (!ctx || avcodec_parameters_to_context(ctx, stream->codecpar) < 0 || avcodec_open2(ctx, decoder, nullptr) < 0) {
+			logger::error(logger::Stage::Decode, jobId, logger::NoFrame, "Failed to open decoder");
+			avcodec_free_context(&ctx);
+			avformat_close_input(&format);
+			return false;
+		}
+
+		const AVPacketSideData* matrix = av_packet_side_data_get(stream->codecpar->coded_side_data,
+		                                                         stream->codecpar->nb_coded_side_data, AV_PKT_DATA_DISPLAYMATRIX);
+		orientation = geometry::Transform::fromDisplayMatrix(matrix && matrix->size >= 9 * sizeof(int32_t) ? (const int32_t*)matrix->data : nullptr);
+		color = tonemap::Source::of(ctx, stream);
+		outputWidth = settings.width;
+		outputHeight = settings.height;
+
+		double duration = 0;
+		if (stream->duration != AV_NOPTS_VALUE) {
+			duration = stream->duration * av_q2d(stream->time_base);
+		} else if (format->duration != AV_NOPTS_VALUE) {
+			duration = format->duration / (double)AV_TIME_BASE;
+		}
+		const int64_t streamStart = stream->start_time == AV_NOPTS_VALUE ? 0 : stream->start_time;
+
+		// Short sources are sampled whole in one segment
+		int count = std::max(1, options.segments);
+		double length = std::max(options.minSegmentSeconds,
+		                         std::min(options.segmentSeconds, duration * options.maxSampleFraction / count));
+		if (duration <= 0 || length * count >= duration) {
+			count = 1;
+			length = duration > 0 ? duration : options.segmentSeconds;
+		}
+
+		bool ok = true;
+		for (int i = 0; i < count && ok; i++) {
+			const double start = count == 1 ? 0 : std::max(0.0, duration * (i + 0.5) / count - length / 2);
+			segments.emplace_back();
+			ok = readSegment(format, ctx, streamIndex, streamStart, start, length, settings.frameRate, segments.back());
+			seconds += segments.back().size() / (double)settings.frameRate;
+		}
+
+		avcodec_free_context(&ctx);
+		avformat_close_input(&format);
+		if (ok && seconds <= 0) {
+			logger::error(logger::Stage::Decode, jobId, logger::NoFrame, "No frames decoded for the quality search");
+			ok = false;
+		}
+		return ok;
+	}
+
+private:
+	geometry::Transform orientation;
+	geometry::Scaler scaler;
+	tonemap::Source color;
+	tonemap::ToneMapper toneMapper;
+	int outputWidth = 0;
+	int outputHeight = 0;
+	AVFrame* converted = nullptr;   // Source size, for formats the scaler does not read
+	AVFrame* wide = nullptr;        // Scaled 10-bit, before tone mapping
+	SwsContext* sws = nullptr;
+
+	// Frames of [start, start + length) seconds on the output frame rate grid
+	bool readSegment(AVFormatContext* format, AVCodecContext* ctx, int streamIndex, int64_t streamStart,
+	                 double start, double length, int frameRate, std::vector<AVFrame*>& frames) {
+		const AVRational timeBase = format->streams[streamIndex]->time_base;
+		if (av_seek_frame(format, streamIndex, streamStart + (int64_t)(start / av_q2d(timeBase)), AVSEEK_FLAG_BACKWARD) < 0) {
+			return false;
+		}
+		avcodec_flush_buffers(ctx);
+
+		const size_t wanted = (size_t)std::max(1.0, std::round(length * frameRate));
+		double next = start;
+		AVPacket* packet = av_packet_alloc();
+		AVFrame* frame = av_frame_alloc();
+		bool ok = packet && frame;
+		bool draining = false;
+		while (ok && frames.size() < wanted) {
+			if (!draining) {
+				if (av_read_frame(format, packet) < 0) {
+					draining = true;
+					avcodec_send_packet(ctx, nullptr);
+				} else if (packet->stream_index != streamIndex) {
+					av_packet_unref(packet);
+					continue;
+				} else {
+					avcodec_send_packet(ctx, packet);
+					av_packet_unref(packet);
+				}
+			}
+
+			int ret = 0;
+			while (ok && frames.size() < wanted && (ret = avcodec_receive_frame(ctx, frame)) >= 0) {
+				const double seconds = (frame->best_effort_timestamp - streamStart) * av_q2d(timeBase);
+				if (seconds >= next) {
+					next += 1.0 / frameRate;
+					AVFrame* scaled = scale(frame);
+					ok = scaled != nullptr;
+					if (ok) {
+						scaled->pts = (int64_t)frames.size();
+						frames.push_back(scaled);
+					}
+				}
+				av_frame_unref(frame);
+			}
+			if (draining && ret == AVERROR_EOF) {
+				break;
+			}
+		}
+		av_frame_free(&frame);
+		av_packet_free(&packet);
+		return ok;
+	}
+
+	AVFrame* scale(const AVFrame* in) {
+		if (!geometry::Scaler::supports(in->format)) {
+			const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)in->format);
+			const AVPixelFormat target = desc && desc->comp[0].depth > 8 ? AV_PIX_FMT_YUV420P10LE : AV_PIX_FMT_YUV420P;
+			if (!allocate(converted, target, in->width, in->height)) {
+				return nullptr;
+			}
+			sws = sws_getCachedContext(sws, in->width, in->height, (AVPixelFormat)in->format, in->width, in->height,
+			                           target, SWS_POINT, nullptr, nullptr, nullptr);
+			if (!sws) {
+				return nullptr;
+			}
+			sws_scale(sws, in->data, in->linesize, 0, in->height, converted->data, converted->linesize);
+			in = converted;
+		}
+		if (!scaler.configured(in->width, in->height, in->format) &&
+		    !scaler.configure(in->width, in->height, in->format, orientation, outputWidth, outputHeight)) {
+			return nullptr;
+		}
+
+		AVFrame* out = nullptr;
+		if (!allocate(out, AV_PIX_FMT_YUV420P, scaler.width(), scaler.height())) {
+			return nullptr;
+		}
+		if (scaler.outputFormat() == AV_PIX_FMT_YUV420P) {
+			scaler.process(in, out);
+		} else {
+			if (!allocate(wide, AV_PIX_FMT_YUV420P10LE, scaler.width(), scaler.height())) {
+				av_frame_free(&out);
+				return nullptr;
+			}
+			if (!toneMapper.configured(color)) {
+				toneMapper.configure(color);
+			}
+			scaler.process(in, wide);
+			toneMapper.process(wide, out);
+		}
+		return out;
+	}
+
+	static bool allocate(AVFrame*& frame, AVPixelFormat format, int width, int height) {
+		if (frame && frame->format == format && frame->width == width && frame->height == height) {
+			return true;
+		}
+		av_frame_free(&frame);
+		frame = av_frame_alloc();
+		if (!frame) {
+			return false;
+		}
+		frame->format = format;
+		frame->width = width;
+		frame->height = height;
+		if (av_frame_get_buffer(frame, 0) < 0) {
+			av_frame_free(&frame);
+			return false;
+		}
+		return true;
+	}
+};
+
+/*
+
+Trial Encode
+One segment at one CRF, single threaded since the candidates already run in parallel.
+The reference frames are only read, several trials share them.
+
+*/
+
+inline bool trialEncode(const std::vector<AVFrame*>& frames, const OutputSettings& settings, int crf, Candidate& candidate) {
+	const AVCodec* encoder = avcodec_find_encoder_by_name(settings.codec.c_str());
+	const AVCodec* decoder = encoder ? avcodec_find_decoder(encoder->id) : nullptr;
+	AVCodecContext* encodeCtx = encoder ? avcodec_alloc_context3(encoder) : nullptr;
+	AVCodecContext* decodeCtx = decoder ? avcodec_alloc_context3(decoder) : nullptr;
+	AVPacket* packet = av_packet_alloc();
+	AVFrame* decoded = av_frame_alloc();
+	bool ok = encodeCtx && decodeCtx && packet && decoded && !frames.empty();
+
+	if (ok) {
+		encodeCtx->width = frames[0]->width;
+		encodeCtx->height = frames[0]->height;
+		encodeCtx->pix_fmt = AV_PIX_FMT_YUV420P;
+		encodeCtx->time_base = {1, settings.frameRate};
+		encodeCtx->thread_count = 1;
+		encoders::Options options = encoders::options(settings);
+		options.crf = crf;
+		options.maxBitrate = 0;
+		ok = encoders::configure(encodeCtx, options) && avcodec_open2(encodeCtx, encoder, nullptr) >= 0 && avcodec_open2(decodeCtx, decoder, nullptr) >= 0;
+	}
+
+	// Decoded frames come out in presentation order, the same order as the references
+	size_t compared = 0;
+	auto drain = [&](bool flush) {
+		int ret;
+		while ((ret = avcodec_receive_packet(encodeCtx, packet)) >= 0) {
+			candidate.bytes += packet->size;
+			avcodec_send_packet(decodeCtx, packet);
+			av_packet_unref(packet);
+			while (avcodec_receive_frame(decodeCtx, decoded) >= 0) {
+				if (compared < frames.size()) {
+					candidate.quality.add(metrics::compare(frames[compared++], decoded));
+				}
+				av_frame_unref(decoded);
+			}
+		}
+		if (flush && ret == AVERROR_EOF) {
+			avcodec_send_packet(decodeCtx, nullptr);
+			while (avcodec_receive_frame(decodeCtx, decoded) >= 0) {
+				if (compared < frames.size()) {
+					candidate.quality.add(metrics::compare(frames[compared++], decoded));
+				}
+				av_frame_unref(decoded);
+			}
+		}
+	};
+
+	for (size_t i = 0; ok && i < frames.size(); i++) {
+		ok = avcodec_send_frame(encodeCtx, frames[i]) >= 0;
+		if (ok) {
+			drain(false);
+		}
+	}
+	if (ok) {
+		avcodec_send_frame(encodeCtx, nullptr);
+		drain(true);
+		ok = compared == frames.size();
+	}
+
+	av_frame_free(&decoded);
+	av_packet_free(&packet);
+	avcodec_free_context(&decodeCtx);
+	avcodec_free_context(&encodeCtx);
+	return ok;
+}
+
+// Lowest CRF whose neighbours bracket the target, interpolated and rounded down
+inline int interpolate(const std::vector<Candidate>& candidates, const Options& options) {
+	const double target = targetValue(options);
+	auto score = [&](const Candidate& candidate) {
+		return value(candidate.quality.mean(), options.metric);
+	};
+
+	if (score(candidates.front()) < target) {
+		return candidates.front().crf;   // Not reachable in range, best we tried
+	}
+	for (size_t i = 1; i < candidates.size(); i++) {
+		const double above = score(candidates[i - 1]);
+		const double below = score(candidates[i]);
+		if (below < target) {
+			const double t = above > below ? (above - target) / (above - below) : 0;
+			return candidates[i - 1].crf + (int)std::floor(t * (candidates[i].crf - candidates[i - 1].crf));
+		}
+	}
+	return candidates.back().crf;        // Every candidate meets it
+}
+
+inline Result search(const std::string& inputPath, const OutputSettings& settings, const Options& options,
+                     async::WorkerPool& pool, uint64_t jobId = 0) {
+	Result result;
+	const auto started = std::chrono::steady_clock::now();
+	if (options.crfs.empty()) {
+		return result;
+	}
+
+	Samples samples;
+	if (!samples.load(inputPath, settings, options, jobId)) {
+		return result;
+	}
+	result.sampledSeconds = samples.seconds;
+
+	// Every (crf, segment) pair is its own job, results are summed per crf afterwards
+	const int segmentCount = (int)samples.segments.size();
+	const int trials = (int)options.crfs.size() * segmentCount;
+	std::vector<Candidate> partial(trials);
+	std::vector<char> succeeded(trials, 0);
+	async::parallelFor(pool, trials, [&](int i) {
+		const int crf = options.crfs[i / segmentCount];
+		partial[i].crf = crf;
+		succeeded[i] = trialEncode(samples.segments[i % segmentCount], settings, crf, partial[i]);
+	});
+
+	for (size_t c = 0; c < options.crfs.size(); c++) {
+		Candidate candidate;
+		candidate.crf = options.crfs[c];
+		for (int s = 0; s < segmentCount; s++) {
+			const int i = (int)c * segmentCount + s;
+			if (!succeeded[i]) {
+				logger::error(logger::Stage::Encode, jobId, logger::NoFrame, "Trial encode at crf %d failed", candidate.crf);
+				return result;
+			}
+			candidate.quality.add(partial[i].quality);
+			candidate.bytes += partial[i].bytes;
+		}
+		const metrics::Score mean = candidate.quality.mean();
+		logger::info(logger::Stage::Encode, jobId, logger::NoFrame, "Trial crf %d: ssim %.4f (%.2f dB) psnr %.2f dB, %.0f kb/s",
+		             candidate.crf, mean.ssim, mean.ssimDb(), mean.psnr, candidate.bytes * 8 / samples.seconds / 1000);
+		result.candidates.push_back(candidate);
+	}
+
+	result.crf = interpolate(result.candidates, options);
+	result.ok = true;
+	result.searchSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+	return result;
+}
+
+/*
+
+Monitor
+Inline quality of an encode: every packet the encoder produces is decoded again on the
+worker pool, and every interval-th frame sent to the encoder is kept and scored against
+its decoded version. Decoding all packets is needed for the prediction chain, but it costs
+a fraction of the encode; the comparison, the expensive part, only runs on the samples.
+
+One segment per encoder instance: begin() with the fresh encoder, finish() once it is
+flushed. Decoding normally runs as pool tasks next to the encoder. When the pool does not
+get to it and kept frames pile up, the caller decodes the backlog itself, which bounds
+memory and cannot deadlock on a pool whose threads are all busy encoding.
+
+*/
+
+class Monitor {
+public:
+	// maxPending kept frames with their packets out before the caller decodes them itself
+	Monitor(async::WorkerPool& pool, int interval, size_t maxPending = 4)
+	    : pool(pool), interval(std::max(1, interval)), maxPending(std::max<size_t>(1, maxPending)), state(std::make_shared<State>()) {}
+
+	Monitor(const Monitor&) = delete;
+	Monitor& operator=(const Monitor&) = delete;
+
+	~Monitor() {
+		finish();
+	}
+
+	// False when the encoder's output cannot be compared, only 8-bit yuv420p is
+	bool begin(const AVCodecContext* encoder) {
+		finish();
+		if (encoder->pix_fmt != AV_PIX_FMT_YUV420P) {
+			return false;
+		}
+		const AVCodec* codec = avcodec_find_decoder(encoder->codec_id);
+		AVCodecContext* decoder = codec ? avcodec_alloc_context3(codec) : nullptr;
+		if (!decoder) {
+			return false;
+		}
+		decoder->thread_count = 1;
+		if (encoder->extradata_size > 0) {
+			decoder->extradata = (uint8_t*)av_mallocz(encoder->extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+			if (decoder->extradata) {
+				std::copy(encoder->extradata, encoder->extradata + encoder->extradata_size, decoder->extradata);
+				decoder->extradata_size = encoder->extradata_size;
+			}
+		}
+		if (avcodec_open2(decoder, codec, nullptr) < 0 || !(state->decoded = av_frame_alloc())) {
+			avcodec_free_context(&decoder);
+			return false;
+		}
+		state->decoder = decoder;
+		sent = 0;
+		return true;
+	}
+
+	// Every frame sent to the encoder, in order. Kept frames share the encoder input's
+	// buffers, which the converter does not write again once the frame is sent.
+	void reference(const AVFrame* frame) {
+		if (!state->decoder || sent++ % interval != 0) {
+			return;
+		}
+		handles::FrameView view(frame);
+		if (!view) {
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(state->mutex);
+		state->references[frame->pts] = std::move(view);
+	}
+
+	// Every packet out of the encoder, before the muxer changes its timestamps
+	void packet(const AVPacket* packet) {
+		if (!state->decoder) {
+			return;
+		}
+		AVPacket* copy = av_packet_clone(packet);
+		if (!copy) {
+			return;
+		}
+
+		bool post = false;
+		bool help = false;
+		{
+			std::lock_guard<std::mutex> lock(state->mutex);
+			state->packets.push_back(copy);
+			if (!state->draining) {
+				if (state->references.size() >= maxPending) {
+					state->draining = help = true;
+				} else if (!state->queued) {
+					state->queued = post = true;
+				}
+			}
+		}
+		if (post) {
+			pool.post([state = state] {
+				{
+					std::lock_guard<std::mutex> lock(state->mutex);
+					state->queued = false;
+					if (state->draining || !state->decoder) {
+						return;
+					}
+					state->draining = true;
+				}
+				drain(*state, false);
+			});
+		}
+		if (help) {
+			drain(*state, false);
+		}
+	}
+
+	// Waits for the decoder and returns the segment's scores, the encoder must be flushed
+	metrics::Average finish() {
+		if (!state->decoder) {
+			return {};
+		}
+		{
+			std::unique_lock<std::mutex> lock(state->mutex);
+			state->idle.wait(lock, [&] { return !state->draining; });
+			state->draining = true;
+		}
+		drain(*state, true);
+
+		std::lock_guard<std::mutex> lock(state->mutex);
+		state->references.clear();
+		avcodec_free_context(&state->decoder);
+		av_frame_free(&state->decoded);
+
+		const metrics::Average segment = state->segment;
+		state->segment = {};
+		total.add(segment);
+		return segment;
+	}
+
+	// Every segment finished so far
+	const metrics::Average& overall() const {
+		return total;
+	}
+
+	// Kept frames not scored yet
+	size_t pending() const {
+		std::lock_guard<std::mutex> lock(state->mutex);
+		return state->references.size();
+	}
+
+private:
+	struct State {
+		std::mutex mutex;
+		std::condition_variable idle;
+		bool draining = false;   // Someone owns the decoder, a pool task or the caller
+		bool queued = false;     // A pool task is posted and has not started
+		AVCodecContext* decoder = nullptr;
+		AVFrame* decoded = nullptr;
+		std::deque<AVPacket*> packets;
+		std::map<int64_t, handles::FrameView> references;  // By pts
+		metrics::Average segment;
+
+		~State() {
+			for (AVPacket*& packet : packets) {
+				av_packet_free(&packet);
+			}
+		}
+	};
+
+	async::WorkerPool& pool;
+	int interval;
+	size_t maxPending;                        // Kept frames waiting for their decoded version
+	int64_t sent = 0;
+	std::shared_ptr<State> state;
+	metrics::Average total;
+
+	// Called with draining set, clears it when the queue is empty
+	static void drain(State& state, bool flush) {
+		while (true) {
+			AVPacket* packet = nullptr;
+			{
+				std::lock_guard<std::mutex> lock(state.mutex);
+				if (!state.packets.empty()) {
+					packet = state.packets.front();
+					state.packets.pop_front();
+				}
+			}
+			if (!packet) {
+				break;
+			}
+			decode(state, packet);
+			av_packet_free(&packet);
+		}
+		if (flush) {
+			decode(state, nullptr);
+		}
+
+		std::lock_guard<std::mutex> lock(state.mutex);
+		state.draining = false;
+		state.idle.notify_all();
+	}
+
+	static void decode(State& state, const AVPacket* packet) {
+		if (avcodec_send_packet(state.decoder, packet) < 0) {
+			return;
+		}
+		while (avcodec_receive_frame(state.decoder, state.decoded) >= 0) {
+			handles::FrameView reference;
+			{
+				// Kept frames before this one will not come out any more
+				std::lock_guard<std::mutex> lock(state.mutex);
+				auto end = state.references.upper_bound(state.decoded->pts);
+				for (auto it = state.references.begin(); it != end; ++it) {
+					if (it->first == state.decoded->pts) {
+						reference = std::move(it->second);
+					}
+				}
+				state.references.erase(state.references.begin(), end);
+			}
+			if (reference) {
+				const metrics::Score score = metrics::compare(reference.get(), state.decoded);
+				std::lock_guard<std::mutex> lock(state.mutex);
+				state.segment.add(score);
+			}
+			av_frame_unref(state.decoded);
+		}
+	}
+};
+
+} // namespace quality
+
+#endif // QUALITY_HPP
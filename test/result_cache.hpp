@@ -0,0 +1,367 @@
+#ifndef RESULT_CACHE_HPP
+#define RESULT_CACHE_HPP
+
+/*
+
+Result Cache
+Content-addressed store of finished outputs.
+
+The key is the XXH64 of the input bytes plus the XXH64 of the normalized output settings,
+so a re-upload of the same bytes with the same settings maps to the same entry no matter
+what the file is called. Entries are plain files in the cache directory named after the
+key; their modification time is the LRU clock and is bumped on every hit. Inserting past
+maxBytes evicts the least recently used entries.
+
+A hit places a copy of the entry at the output path, a reflink where the filesystem has
+them (btrfs, xfs) so it costs no data blocks. Never a hard link: the next conversion to
+that path truncates it in place, which would rewrite the entry under every other user.
+
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+namespace cache {
+
+/*
+
+XXH64
+Streaming implementation of xxHash64, fast enough that hashing an upload costs
+about as much as reading it.
+
+*/
+
+class XXH64 {
+public:
+	explicit XXH64(uint64_t seed = 0) : seed(seed) {
+		v[0] = seed + P1 + P2;
+		v[1] = seed + P2;
+		v[2] = seed;
+		v[3] = seed - P1;
+	}
+
+	void update(const void* data, size_t size) {
+		const uint8_t* p = (const uint8_t*)data;
+		total += size;
+
+		if (bufferSize + size < 32) {
+			memcpy(buffer + bufferSize, p, size);
+			bufferSize += size;
+			return;
+		}
+
+		if (bufferSize > 0) {
+			const size_t fill = 32 - bufferSize;
+			memcpy(buffer + bufferSize, p, fill);
+			consume(buffer);
+			p += fill;
+			size -= fill;
+			bufferSize = 0;
+		}
+
+		while (size >= 32) {
+			consume(p);
+			p += 32;
+			size -= 32;
+		}
+
+		memcpy(buffer, p, size);
+		bufferSize = size;
+	}
+
+	uint64_t digest() const {
+		uint64_t h;
+		if (total >= 32) {
+			h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+			for (int i = 0; i < 4; i++) {
+				h = (h ^ round(0, v[i])) * P1 + P4;
+			}
+		} else {
+			h = seed + P5;
+		}
+		h += total;
+
+		const uint8_t* p = buffer;
+		size_t size = bufferSize;
+		while (size >= 8) {
+			h ^= round(0, read64(p));
+			h = rotl(h, 27) * P1 + P4;
+			p += 8;
+			size -= 8;
+		}
+		if (size >= 4) {
+			h ^= (uint64_t)read32(p) * P1;
+			h = rotl(h, 23) * P2 + P3;
+			p += 4;
+			size -= 4;
+		}
+		while (size > 0) {
+			h ^= (*p) * P5;
+			h = rotl(h, 11) * P1;
+			p++;
+			size--;
+		}
+
+		h ^= h >> 33;
+		h *= P2;
+		h ^= h >> 29;
+		h *= P3;
+		h ^= h >> 32;
+		return h;
+	}
+
+	static uint64_t of(const std::string& text) {
+		XXH64 hash;
+		hash.update(text.data(), text.size());
+		return hash.digest();
+	}
+
+private:
+	static constexpr uint64_t P1 = 11400714785074694791ULL;
+	static constexpr uint64_t P2 = 14029467366897019727ULL;
+	static constexpr uint64_t P3 = 1609587929392839161ULL;
+	static constexpr uint64_t P4 = 9650029242287828579ULL;
+	static constexpr uint64_t P5 = 2870177450012600261ULL;
+
+	uint64_t seed;
+	uint64_t v[4];
+	uint64_t total = 0;
+	uint8_t buffer[32];
+	size_t bufferSize = 0;
+
+	static uint64_t rotl(uint64_t x, int r) {
+		return (x << r) | (x >> (64 - r));
+	}
+
+	static uint64_t read64(const uint8_t* p) {
+		uint64_t x;
+		memcpy(&x, p, 8);
+		return x; // Little endian hosts only, which is all we run on
+	}
+
+	static uint32_t read32(const uint8_t* p) {
+		uint32_t x;
+		memcpy(&x, p, 4);
+		return x;
+	}
+
+	static uint64_t round(uint64_t acc, uint64_t input) {
+		acc += input * P2;
+		acc = rotl(acc, 31);
+		return acc * P1;
+	}
+
+	void consume(const uint8_t* p) {
+		for (int i = 0; i < 4; i++) {
+			v[i] = round(v[i], read64(p + i * 8));
+		}
+	}
+};
+
+inline std::optional<uint64_t> hashFile(const std::string& path) {
+	FILE* file = fopen(path.c_str(), "rb");
+	if (!file) {
+		return std::nullopt;
+	}
+
+	XXH64 hash;
+	std::vector<uint8_t> block(1 << 20);
+	size_t n;
+	while ((n = fread(block.data(), 1, block.size(), file)) > 0) {
+		hash.update(block.data(), n);
+	}
+	const bool failed = ferror(file);
+	fclose(file);
+	if (failed) {
+		return std::nullopt;
+	}
+	return hash.digest();
+}
+
+inline std::string hex(uint64_t value) {
+	char text[17];
+	snprintf(text, sizeof(text), "%016llx", (unsigned long long)value);
+	return text;
+}
+
+struct Stats {
+	uint64_t hits = 0;
+	uint64_t misses = 0;
+	uint64_t insertions = 0;
+	uint64_t evictions = 0;
+	uint64_t bytes = 0;
+};
+
+// Removes the least recently used entries of dir until it fits maxBytes, never keep
+inline void evictLeastRecent(const std::filesystem::path& dir, uint64_t maxBytes, const std::filesystem::path& keep, Stats& stats) {
+	struct Entry {
+		std::filesystem::path path;
+		std::filesystem::file_time_type used;
+		uint64_t size;
+	};
+
+	std::vector<Entry> entries;
+	uint64_t total = 0;
+	std::error_code error;
+	for (const auto& item : std::filesystem::directory_iterator(dir, error)) {
+		if (!item.is_regular_file(error) || item.path().extension() == ".tmp") {
+			continue;
+		}
+		Entry entry{item.path(), item.last_write_time(error), (uint64_t)item.file_size(error)};
+		total += entry.size;
+		entries.push_back(entry);
+	}
+
+	std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+		return a.used < b.used;
+	});
+
+	for (const Entry& entry : entries) {
+		if (total <= maxBytes) {
+			break;
+		}
+		if (entry.path == keep) {
+			continue;
+		}
+		if (std::filesystem::remove(entry.path, error)) {
+			total -= entry.size;
+			stats.evictions++;
+		}
+	}
+	stats.bytes = total;
+}
+
+// Independent copy of from at to, sharing extents with it when the filesystem can
+inline bool cloneFile(const std::filesystem::path& from, const std::filesystem::path& to) {
+	std::error_code error;
+#ifdef FICLONE
+	const int source = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+	if (source >= 0) {
+		const int target = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		const bool cloned = target >= 0 && ioctl(target, FICLONE, source) == 0;
+		if (target >= 0) {
+			close(target);
+		}
+		close(source);
+		if (cloned) {
+			return true;
+		}
+	}
+#endif
+	std::filesystem::copy_file(from, to, std::filesystem::copy_options::overwrite_existing, error);
+	return !error;
+}
+
+class ResultCache {
+public:
+	ResultCache(const std::string& dir, uint64_t maxBytes) : dir(dir), maxBytes(maxBytes) {
+		std::error_code error;
+		std::filesystem::create_directories(dir, error);
+	}
+
+	// Empty when the input cannot be read
+	std::string key(const std::string& inputPath, const std::string& normalizedSettings) const {
+		const auto content = hashFile(inputPath);
+		if (!content) {
+			return "";
+		}
+		return hex(*content) + "-" + hex(XXH64::of(normalizedSettings));
+	}
+
+	// Places the cached output at outputPath, false on a miss
+	bool fetch(const std::string& key, const std::string& outputPath) {
+		std::lock_guard<std::mutex> lock(mutex);
+		const std::filesystem::path entry = entryPath(key, outputPath);
+
+		std::error_code error;
+		if (key.empty() || !std::filesystem::exists(entry, error)) {
+			stats.misses++;
+			return false;
+		}
+
+		// Removed first so an old hard link to some entry is not written through
+		std::filesystem::remove(outputPath, error);
+		if (!cloneFile(entry, outputPath)) {
+			stats.misses++;
+			return false;
+		}
+
+		// Touch for LRU
+		std::filesystem::last_write_time(entry, std::filesystem::file_time_type::clock::now(), error);
+		stats.hits++;
+		return true;
+	}
+
+	// Stores a copy of a freshly produced output and evicts down to maxBytes
+	bool insert(const std::string& key, const std::string& outputPath) {
+		if (key.empty()) {
+			return false;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		const std::filesystem::path entry = entryPath(key, outputPath);
+		const std::filesystem::path temp = tempPath(entry);
+
+		// Clone into a private temp file, the rename then swaps the whole entry in at once
+		std::error_code error;
+		const bool copied = cloneFile(outputPath, temp);
+		if (copied) {
+			std::filesystem::rename(temp, entry, error);
+		}
+		if (!copied || error) {
+			std::filesystem::remove(temp, error);
+			return false;
+		}
+
+		stats.insertions++;
+		evict(entry);
+		return true;
+	}
+
+	Stats getStats() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return stats;
+	}
+
+private:
+	const std::filesystem::path dir;
+	const uint64_t maxBytes;
+	mutable std::mutex mutex;
+	Stats stats;
+
+	std::filesystem::path entryPath(const std::string& key, const std::string& outputPath) const {
+		return dir / (key + std::filesystem::path(outputPath).extension().string());
+	}
+
+	// Unique per process and insert, other processes may store the same key in the same directory
+	static std::filesystem::path tempPath(const std::filesystem::path& entry) {
+		static std::atomic<uint64_t> counter{0};
+		return entry.string() + "." + std::to_string(getpid()) + "." +
+		       std::to_string(counter.fetch_add(1, std::memory_order_relaxed)) + ".tmp";
+	}
+
+	void evict(const std::filesystem::path& keep) {
+		evictLeastRecent(dir, maxBytes, keep, stats);
+	}
+};
+
+} // namespace cache
+
+#endif // RESULT_CACHE_HPP
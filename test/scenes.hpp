@@ -0,0 +1,109 @@
+#ifndef SCENES_HPP
+#define SCENES_HPP
+
+/*
+
+Scenes
+Scene cut detection on decoded frames, cheap enough to run on every frame ahead of the
+encoder. A frame is a cut when its luma histogram differs from the previous frame's by
+more than the threshold, as the share of samples that changed bins: 0 for the same
+histogram, 1 for nothing in common.
+
+Histograms come from every step-th pixel of every step-th row, 64 bins whatever the
+bit depth, so a 4K frame costs about as much as a 480p one and noise or small motion
+inside a scene hardly moves them. Fades cross the threshold late or not at all, which is
+what we want: a keyframe in the middle of a fade buys little.
+
+*/
+
+extern "C" {
+	#include <libavutil/frame.h>
+	#include <libavutil/pixdesc.h>
+}
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <utility>
+
+namespace scenes {
+
+static constexpr int Bins = 64;
+
+struct Histogram {
+	std::array<uint32_t, Bins> counts{};
+	uint32_t samples = 0;
+
+	void compute(const AVFrame* frame, int step) {
+		const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+		const bool wide = desc && desc->comp[0].depth > 8;
+		const int shift = (desc ? desc->comp[0].depth : 8) - 6;
+		counts.fill(0);
+		samples = 0;
+		for (int y = step / 2; y < frame->height; y += step) {
+			const uint8_t* row = frame->data[0] + (ptrdiff_t)y * frame->linesize[0];
+			if (wide) {
+				const uint16_t* row16 = (const uint16_t*)row;
+				for (int x = step / 2; x < frame->width; x += step) {
+					counts[std::min(Bins - 1, row16[x] >> shift)]++;
+				}
+			} else {
+				for (int x = step / 2; x < frame->width; x += step) {
+					counts[row[x] >> shift]++;
+				}
+			}
+			samples += (uint32_t)((frame->width - step / 2 + step - 1) / step);
+		}
+	}
+
+	// Share of samples in different bins, 0 to 1
+	double difference(const Histogram& other) const {
+		if (samples == 0 || other.samples == 0) {
+			return 0;
+		}
+		double total = 0;
+		for (int i = 0; i < Bins; i++) {
+			total += std::abs((double)counts[i] / samples - (double)other.counts[i] / other.samples);
+		}
+		return total / 2;
+	}
+};
+
+struct Options {
+	double threshold = 0.4;
+	int step = 8;
+};
+
+class Detector {
+public:
+	explicit Detector(const Options& options) : options(options) {}
+
+	// Frames in presentation order, true when this one starts a new scene
+	bool cut(const AVFrame* frame) {
+		current.compute(frame, options.step);
+		const bool first = previous.samples == 0;
+		score = first ? 0 : current.difference(previous);
+		std::swap(previous, current);
+		return !first && score > options.threshold;
+	}
+
+	// The next frame is compared with nothing, after a seek
+	void reset() {
+		previous.samples = 0;
+	}
+
+	double lastScore() const {
+		return score;
+	}
+
+private:
+	Options options;
+	Histogram previous;
+	Histogram current;
+	double score = 0;
+};
+
+} // namespace scenes
+
+#endif // SCENES_HPP
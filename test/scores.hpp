@@ -0,0 +1,52 @@
+#ifndef SCORES_HPP
+#define SCORES_HPP
+
+/*
+
+Scores
+The quality numbers metrics.hpp produces, on their own so that code which only carries
+them around (ConversionJob, callers reading its progress) does not include FFmpeg.
+
+*/
+
+#include <cmath>
+#include <cstdint>
+
+namespace metrics {
+
+struct Score {
+	double psnr = 0;   // dB, capped at 100 for identical frames
+	double ssim = 0;   // 0 to 1
+
+	// SSIM as dB, -10 log10(1 - ssim), closer to linear in the encoder's quantizer
+	double ssimDb() const {
+		return ssim >= 1 ? 100 : -10 * std::log10(1 - ssim);
+	}
+};
+
+// Running mean over frames
+struct Average {
+	double psnr = 0;
+	double ssim = 0;
+	int64_t frames = 0;
+
+	void add(const Score& score) {
+		psnr += score.psnr;
+		ssim += score.ssim;
+		frames++;
+	}
+
+	void add(const Average& other) {
+		psnr += other.psnr;
+		ssim += other.ssim;
+		frames += other.frames;
+	}
+
+	Score mean() const {
+		return frames ? Score{psnr / frames, ssim / frames} : Score{};
+	}
+};
+
+} // namespace metrics
+
+#endif // SCORES_HPP
@@ -0,0 +1,184 @@
+#ifndef SEEKING_HPP
+#define SEEKING_HPP
+
+/*
+
+Seeking
+Muxer options for a file a player can start and seek in without reading its end first.
+By default the WebM Cues and the MP4 moov are written after the media, so a player over
+HTTP needs an extra range request to the end before it can seek (WebM) or even start
+(MP4). ffmpeg's -movflags +faststart fixes that by rewriting the whole file afterwards.
+
+Instead we reserve the index space up front and the muxer writes it there on the trailer:
+
+	matroska, webm    reserve_index_space   Cues in a Void element after the header
+	mp4, mov          moov_size             moov in a free atom before mdat
+
+The size is estimated from the frame and keyframe counts with headroom. A too small
+WebM reservation only puts the Cues back at the end, a too small moov reservation fails
+the trailer, so the MP4 estimate is the more generous one and FrontIndex drops the
+reservation when the file outgrew it. Seek points are the keyframes, the converter bounds
+their distance with the encoder's GOP.
+
+*/
+
+extern "C" {
+	#include <libavformat/avformat.h>
+	#include <libavutil/dict.h>
+	#include <libavutil/opt.h>
+}
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+namespace seeking {
+
+enum class Container { Other, Matroska, Mp4 };
+
+inline Container container(const AVOutputFormat* format) {
+	const char* name = format ? format->name : nullptr;
+	if (!name) {
+		return Container::Other;
+	}
+	if (strstr(name, "matroska") || strstr(name, "webm")) {
+		return Container::Matroska;
+	}
+	if (strstr(name, "mp4") || strstr(name, "mov")) {
+		return Container::Mp4;
+	}
+	return Container::Other;
+}
+
+// Cue points are one per keyframe: time, track, cluster position and relative position
+inline int64_t cuesBytes(int64_t keyframes) {
+	return 4096 + keyframes * 40;
+}
+
+// stsz and stco entries per sample, ctts for B-frames, stss per keyframe, plus the boxes
+inline int64_t moovNeeded(int64_t frames, int64_t keyframes) {
+	return 4096 + frames * 16 + keyframes * 4;
+}
+
+// What is reserved for that, with headroom
+inline int64_t moovBytes(int64_t frames, int64_t keyframes) {
+	return 16384 + (frames * 16 + keyframes * 4) * 5 / 4;
+}
+
+/*
+
+Muxer Options
+frames is the expected frame count, keyframes an upper bound on keyframes, both 0 when
+unknown; without them nothing is reserved. Empty summary when the container has no
+front index option.
+
+*/
+
+inline AVDictionary* muxerOptions(const AVOutputFormat* format, int64_t frames, int64_t keyframes,
+                                  double seekIntervalSeconds, std::string& summary) {
+	AVDictionary* options = nullptr;
+	summary.clear();
+	if (frames <= 0) {
+		return options;
+	}
+	keyframes = std::clamp<int64_t>(keyframes, 1, frames);
+
+	switch (container(format)) {
+	case Container::Matroska: {
+		// Twice the bound, the encoder may add keyframes of its own
+		const int64_t bytes = cuesBytes(keyframes * 2);
+		av_dict_set_int(&options, "reserve_index_space", bytes, 0);
+		av_dict_set_int(&options, "cluster_time_limit", (int64_t)(seekIntervalSeconds * 1000), 0);
+		summary = "cues reserved " + std::to_string(bytes) + " bytes";
+		break;
+	}
+	case Container::Mp4: {
+		const int64_t bytes = moovBytes(frames, keyframes * 2);
+		av_dict_set_int(&options, "moov_size", bytes, 0);
+		summary = "moov reserved " + std::to_string(bytes) + " bytes";
+		break;
+	}
+	case Container::Other:
+		break;
+	}
+	return options;
+}
+
+/*
+
+Front Index
+One output's reservation, checked again before the trailer. The mp4 muxer skips the
+reserved bytes after ftyp and writes the moov into them at the end; a moov that does not
+fit fails the trailer after it has already overwritten the start of mdat. So the packets
+muxed are counted, and when moovNeeded for them passes what was reserved (far more frames
+or keyframes than estimated) the reservation is given up before the trailer: moov_size goes
+to 0, the moov is written after mdat, and the skipped bytes become a free atom. The file
+is then complete but not fast start.
+
+*/
+
+class FrontIndex {
+public:
+	// muxerOptions, remembering what it reserved
+	AVDictionary* options(const AVOutputFormat* format, int64_t frames, int64_t keyframes,
+	                      double seekIntervalSeconds, std::string& summary) {
+		*this = FrontIndex();
+		AVDictionary* options = muxerOptions(format, frames, keyframes, seekIntervalSeconds, summary);
+		const AVDictionaryEntry* moov = av_dict_get(options, "moov_size", nullptr, 0);
+		reserved = moov ? std::stoll(moov->value) : 0;
+		return options;
+	}
+
+	// After avformat_write_header, which left the "free" placeholder and the mdat header
+	// right behind the reservation
+	void opened(AVFormatContext* output) {
+		start = reserved > 0 && output->pb ? avio_tell(output->pb) - MdatHeaderBytes - reserved : -1;
+	}
+
+	// Before the packet goes to the muxer, which takes it
+	void muxed(const AVPacket* packet) {
+		packets++;
+		if (packet->flags & AV_PKT_FLAG_KEY) {
+			keyframes++;
+		}
+	}
+
+	int writeTrailer(AVFormatContext* output) {
+		dropped = reserved > 0 && start > 0 && moovNeeded(packets, keyframes) > reserved &&
+		          av_opt_set_int(output->priv_data, "moov_size", 0, 0) >= 0;
+		const int result = av_write_trailer(output);
+		if (result >= 0 && dropped) {
+			const int64_t end = avio_tell(output->pb);
+			avio_seek(output->pb, start, SEEK_SET);
+			avio_wb32(output->pb, (unsigned int)reserved);
+			avio_write(output->pb, (const unsigned char*)"free", 4);
+			avio_seek(output->pb, end, SEEK_SET);
+			avio_flush(output->pb);
+		}
+		return result;
+	}
+
+	// True when the last trailer left the index at the end
+	bool droppedReservation() const {
+		return dropped;
+	}
+
+	int64_t reservedBytes() const {
+		return reserved;
+	}
+
+private:
+	static constexpr int64_t MdatHeaderBytes = 16;   // free 8, mdat 8
+
+	int64_t reserved = 0;
+	int64_t start = -1;
+	int64_t packets = 0;
+	int64_t keyframes = 0;
+	bool dropped = false;
+};
+
+} // namespace seeking
+
+#endif // SEEKING_HPP
@@ -0,0 +1,147 @@
+#ifndef SETTINGS_HPP
+#define SETTINGS_HPP
+
+/*
+
+Output Settings
+Everything that decides what the encoded output looks like.
+Defaults match the command we settled on in test.1.cpp:
+
+	-vf "scale=1080:-1, crop=1080:1920, fps=29" -c:v libvpx-vp9 -crf 20 -b:v 1M -cpu-used 6 -threads 6
+
+*/
+
+#include <cstdint>
+#include <string>
+
+// Encoder speed, each encoder's own preset for it is in encoders.hpp. Fast is libvpx
+// cpu-used 6, what we always used.
+enum class Speed { Slowest, Slow, Medium, Fast, Fastest };
+
+inline const char* speedName(Speed speed) {
+	switch (speed) {
+	case Speed::Slowest: return "slowest";
+	case Speed::Slow:    return "slow";
+	case Speed::Medium:  return "medium";
+	case Speed::Fast:    return "fast";
+	case Speed::Fastest: return "fastest";
+	}
+	return "fast";
+}
+
+struct OutputSettings {
+	// libvpx-vp9, libx264 or libsvtav1. The crf is on that encoder's own scale, bitrate caps
+	// the constant quality rate.
+	std::string codec = "libvpx-vp9";
+	int crf = 20;
+	int64_t bitrate = 1000000;
+	Speed speed = Speed::Fast;
+	int threads = 6;
+
+	int width = 1080;
+	int height = 1920;
+	int frameRate = 29;
+
+	// Drop frames that look like the last encoded one and stretch that one over them, see
+	// dedup.hpp. -1 encodes every frame, 0 drops only frames with unchanged luma, screen
+	// recordings want about 2. A frame is still encoded at least every maxDuplicateSeconds.
+	int duplicateThreshold = -1;
+	double maxDuplicateSeconds = 2;
+
+	// Speed over quality, for the preview tier: the encoder's low latency mode without
+	// lookahead, and a decoder that works at reduced resolution and skips its loop filter
+	bool realtime = false;
+	bool fastDecode = false;
+
+	// Keyframes at scene cuts (scenes.hpp), -1 leaves keyframe placement to the encoder.
+	// A cut closer than minGopSeconds to the last keyframe gets none, and there is one at
+	// least every maxGopSeconds.
+	double sceneThreshold = -1;
+	double minGopSeconds = 1;
+	double maxGopSeconds = 5;
+
+	// Mean SSIM the output should reach, 0 to use crf as given. The converter picks the crf
+	// from trial encodes of sampled segments (quality.hpp) and drops the bitrate cap.
+	double targetSsim = 0;
+
+	// Index at the front of the file so players can start and seek without reading its end
+	// first: WebM Cues and the MP4 moov go into space reserved after the header (seeking.hpp).
+	// Seek points are keyframes, there is one at least every seekIntervalSeconds.
+	bool fastStart = false;
+	double seekIntervalSeconds = 2;
+
+	// Bytes of frames the stages may hold together, 0 for no limit (memory.hpp). Sizes the
+	// encoder lookahead, which changes the output, and the decoder threads.
+	int64_t memoryBudget = 0;
+
+	// Quick low resolution version of these settings, playable long before the full
+	// encode is done (convertTwoTier in draft.3.cpp)
+	OutputSettings preview() const {
+		OutputSettings tier = *this;
+		tier.width = (width / 3) & ~1;
+		tier.height = (height / 3) & ~1;
+		tier.crf = 40;
+		tier.bitrate = 250000;
+		tier.speed = Speed::Fastest;
+		tier.threads = 2;
+		tier.realtime = true;
+		tier.fastDecode = true;
+		tier.targetSsim = 0;
+		return tier;
+	}
+
+	// Same chain as the ffmpeg -vf we used, built from the numbers above. The converter does
+	// the scale and crop natively (geometry.hpp), display rotation included.
+	std::string filterChain() const {
+		return "scale=" + std::to_string(width) + ":-1,crop=" + std::to_string(width) + ":" +
+		       std::to_string(height) + ",fps=" + std::to_string(frameRate);
+	}
+
+	// Canonical form of every field that changes the output bytes, used for cache keys.
+	// Threads are left out where they do not change the output: libvpx with row-mt off and
+	// SVT-AV1. x264's frame threads change its decisions, so its keys have them.
+	std::string normalized() const {
+		return "codec=" + codec +
+		       ";crf=" + std::to_string(crf) +
+		       ";bitrate=" + std::to_string(bitrate) +
+		       ";speed=" + speedName(speed) +
+		       (codec == "libx264" ? ";threads=" + std::to_string(threads) : "") +
+		       ";vf=" + filterChain() +
+		       ";scaler=bilinear-area-autorotate" +
+		       ";dedup=" + dedupName() +
+		       (sceneThreshold >= 0 ? ";scenes=" + std::to_string(sceneThreshold) + "/" +
+		                              std::to_string(minGopSeconds) + "/" + std::to_string(maxGopSeconds) : "") +
+		       (realtime ? ";deadline=realtime" : "") +
+		       (fastDecode ? ";decode=fast" : "") +
+		       (targetSsim > 0 ? ";target-ssim=" + std::to_string(targetSsim) : "") +
+		       (fastStart ? ";faststart=" + std::to_string(seekIntervalSeconds) : "") +
+		       (memoryBudget > 0 ? ";memory=" + std::to_string(memoryBudget) : "");
+	}
+
+	// Longest run without a keyframe we ask for, 0 leaves it to the encoder
+	double maxKeyframeSeconds() const {
+		double limit = sceneThreshold >= 0 ? maxGopSeconds : 0;
+		if (fastStart && (limit <= 0 || seekIntervalSeconds < limit)) {
+			limit = seekIntervalSeconds;
+		}
+		return limit;
+	}
+
+	// The fields that change the frames sent to the encoder, not how they are encoded. Keys
+	// the frame cache, so encodes that only differ in codec or rate control share an entry.
+	// The scene threshold is in because cached frames carry their scene cuts.
+	std::string normalizedFrames() const {
+		return "vf=" + filterChain() +
+		       ";scaler=bilinear-area-autorotate" +
+		       ";dedup=" + dedupName() +
+		       (fastDecode ? ";decode=fast" : "") +
+		       (sceneThreshold >= 0 ? ";scenes=" + std::to_string(sceneThreshold) : "");
+	}
+
+	std::string dedupName() const {
+		return duplicateThreshold < 0 ? std::string("off") :
+		       std::to_string(duplicateThreshold) + "/" + std::to_string(maxDuplicateSeconds);
+	}
+};
+
+#endif // SETTINGS_HPP
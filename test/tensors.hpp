@@ -0,0 +1,465 @@
+#ifndef TENSORS_HPP
+#define TENSORS_HPP
+
+/*
+
+Tensors
+Sampled frames for local ML consumers (moderation, tagging), taken from the decode the
+transcode already does. Frames are picked at a fixed rate, scaled, turned upright with the
+display rotation and written as tensors into a ring in a memory-mapped file, /dev/shm by
+default so it never touches a disk. The consumer maps the same file and reads the
+tensors in place. HDR sources go through the same tone mapper as the encode, so the
+tensors are the BT.709 picture the viewer gets rather than the raw PQ or HLG code values.
+
+	RingHeader                     4096 bytes, geometry and the two counters
+	SlotHeader, tensor             slot 0, 64 byte aligned
+	SlotHeader, tensor             slot 1
+	...
+
+The producer owns `written`, the consumer owns `consumed`. A slot is only written when
+the consumer has released it, so nothing is read while it changes; when the ring is full
+the sample is dropped rather than holding up the transcode. Layouts:
+
+	Rgb8       height x width x 3 bytes, packed RGB (HWC)
+	Float32    3 x height x width floats in [0, 1], planar RGB (CHW)
+
+Reader is the consumer side, a header-only include for the ML process.
+
+*/
+
+extern "C" {
+	#include <libavutil/frame.h>
+	#include <libswscale/swscale.h>
+}
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "geometry.hpp"
+#include "logger.hpp"
+#include "tonemap.hpp"
+
+namespace tensors {
+
+enum class Layout : uint32_t { Rgb8 = 0, Float32 = 1 };
+
+struct Options {
+	std::string path;              // Empty for /dev/shm/video-tensors-<pid>-<hash of the output path>
+	double rate = 1;               // Samples per second of source time
+	int width = 224;
+	int height = 224;              // One of them 0 keeps the displayed aspect
+	Layout layout = Layout::Rgb8;
+	int slots = 16;
+};
+
+struct RingHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t layout;
+	uint32_t width;
+	uint32_t height;
+	uint32_t channels;
+	uint32_t slots;
+	uint64_t tensorBytes;
+	uint64_t slotStride;
+	std::atomic<uint64_t> written;     // Tensors published, producer only
+	std::atomic<uint64_t> consumed;    // Tensors released, consumer only
+	std::atomic<uint32_t> finished;    // No more tensors will come
+};
+
+struct SlotHeader {
+	uint64_t index;                    // Sample number
+	double seconds;                    // Source time of the frame
+	int64_t pts;                       // Source timestamp
+};
+
+static constexpr char RingMagic[8] = {'V', 'C', 'T', 'E', 'N', 'S', 'O', 'R'};
+static constexpr uint32_t RingVersion = 1;
+static constexpr uint64_t HeaderBytes = 4096;
+static constexpr uint64_t SlotAlign = 64;
+
+static_assert(sizeof(RingHeader) <= HeaderBytes, "header must fit its page");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "ring counters are shared between processes");
+
+inline uint64_t tensorBytes(Layout layout, int width, int height) {
+	return (uint64_t)width * height * 3 * (layout == Layout::Float32 ? sizeof(float) : 1);
+}
+
+/*
+
+Mapped File
+The ring file, created by the producer and opened by the consumer.
+
+*/
+
+class MappedFile {
+public:
+	MappedFile() = default;
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile() {
+		if (data) {
+			munmap(data, size);
+		}
+	}
+
+	bool create(const std::string& path, size_t bytes) {
+		const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			return false;
+		}
+		const bool ok = ftruncate(fd, (off_t)bytes) == 0 && map(fd, bytes, PROT_READ | PROT_WRITE);
+		::close(fd);
+		return ok;
+	}
+
+	bool open(const std::string& path) {
+		const int fd = ::open(path.c_str(), O_RDWR);
+		if (fd < 0) {
+			return false;
+		}
+		struct stat info;
+		const bool ok = fstat(fd, &info) == 0 && (uint64_t)info.st_size >= HeaderBytes &&
+		                map(fd, (size_t)info.st_size, PROT_READ | PROT_WRITE);
+		::close(fd);
+		return ok;
+	}
+
+	uint8_t* bytes() const {
+		return data;
+	}
+
+	size_t length() const {
+		return size;
+	}
+
+private:
+	uint8_t* data = nullptr;
+	size_t size = 0;
+
+	bool map(int fd, size_t bytes, int protection) {
+		void* address = mmap(nullptr, bytes, protection, MAP_SHARED, fd, 0);
+		if (address == MAP_FAILED) {
+			return false;
+		}
+		data = (uint8_t*)address;
+		size = bytes;
+		return true;
+	}
+};
+
+/*
+
+Exporter
+The producer, fed with decoded frames in presentation order like thumbnails::Extractor.
+
+*/
+
+class Exporter {
+public:
+	// color is the decoded source's, outputPath names the default ring
+	Exporter(const Options& options, const geometry::Transform& orientation, const tonemap::Source& color,
+	         const std::string& outputPath, uint64_t jobId = 0)
+		: options(options), orientation(orientation), color(color), jobId(jobId) {
+		if (this->options.path.empty()) {
+			char name[64];
+			snprintf(name, sizeof(name), "/dev/shm/video-tensors-%d-%016zx", (int)getpid(), std::hash<std::string>{}(outputPath));
+			this->options.path = name;
+		}
+	}
+
+	~Exporter() {
+		finish();
+		av_frame_free(&rgb);
+		av_frame_free(&wide);
+		av_frame_free(&mapped);
+		sws_freeContext(sws);
+		sws_freeContext(rgbSws);
+	}
+
+	Exporter(const Exporter&) = delete;
+	Exporter& operator=(const Exporter&) = delete;
+
+	// The ring is created on the first frame, once the displayed size is known
+	bool wants(double seconds) const {
+		return options.rate > 0 && next * (1 / options.rate) <= seconds;
+	}
+
+	bool offer(const AVFrame* frame, double seconds) {
+		if (!wants(seconds)) {
+			return true;
+		}
+		while (wants(seconds)) {
+			next++;
+		}
+		if (!ring && !create(frame)) {
+			return false;
+		}
+
+		RingHeader* header = (RingHeader*)file.bytes();
+		const uint64_t written = header->written.load(std::memory_order_relaxed);
+		if (written - header->consumed.load(std::memory_order_acquire) >= header->slots) {
+			dropped++;
+			return true;
+		}
+
+		if (!scale(frame)) {
+			logger::error(logger::Stage::Pipeline, jobId, logger::NoFrame, "Cannot convert frame for tensor export");
+			return false;
+		}
+		uint8_t* slot = file.bytes() + HeaderBytes + (written % header->slots) * header->slotStride;
+		const SlotHeader meta{written, seconds, frame->best_effort_timestamp};
+		memcpy(slot, &meta, sizeof(meta));
+		writeTensor(slot + SlotAlign);
+		header->written.store(written + 1, std::memory_order_release);
+		return true;
+	}
+
+	void finish() {
+		if (ring) {
+			((RingHeader*)file.bytes())->finished.store(1, std::memory_order_release);
+		}
+	}
+
+	const std::string& path() const {
+		return options.path;
+	}
+
+	uint64_t exported() const {
+		return ring ? ((const RingHeader*)file.bytes())->written.load(std::memory_order_relaxed) : 0;
+	}
+
+	uint64_t droppedFrames() const {
+		return dropped;
+	}
+
+private:
+	Options options;
+	geometry::Transform orientation;
+	tonemap::Source color;
+	tonemap::ToneMapper toneMapper;
+	uint64_t jobId;
+	MappedFile file;
+	bool ring = false;
+	uint64_t next = 0;
+	uint64_t dropped = 0;
+	int width = 0;                 // Tensor, displayed orientation
+	int height = 0;
+	SwsContext* sws = nullptr;
+	SwsContext* rgbSws = nullptr;  // Tone mapped to RGB, HDR only
+	AVFrame* rgb = nullptr;        // Scaled, stored orientation
+	AVFrame* wide = nullptr;       // HDR scaled to 10-bit 4:2:0, before tone mapping
+	AVFrame* mapped = nullptr;     // After tone mapping
+
+	bool create(const AVFrame* frame) {
+		const int displayedWidth = orientation.swapsAxes() ? frame->height : frame->width;
+		const int displayedHeight = orientation.swapsAxes() ? frame->width : frame->height;
+		width = options.width > 0 ? options.width : (int)std::lround((double)options.height * displayedWidth / displayedHeight);
+		height = options.height > 0 ? options.height : (int)std::lround((double)options.width * displayedHeight / displayedWidth);
+		if (width <= 0 || height <= 0 || options.slots <= 0) {
+			logger::error(logger::Stage::Pipeline, jobId, logger::NoFrame, "Invalid tensor size %dx%d", width, height);
+			return false;
+		}
+
+		const uint64_t bytes = tensorBytes(options.layout, width, height);
+		const uint64_t stride = (SlotAlign + bytes + SlotAlign - 1) / SlotAlign * SlotAlign;
+		if (!file.create(options.path, HeaderBytes + stride * options.slots)) {
+			logger::error(logger::Stage::Pipeline, jobId, logger::NoFrame, "Cannot create tensor ring %s", options.path.c_str());
+			return false;
+		}
+
+		RingHeader* header = new (file.bytes()) RingHeader();
+		header->version = RingVersion;
+		header->layout = (uint32_t)options.layout;
+		header->width = width;
+		header->height = height;
+		header->channels = 3;
+		header->slots = options.slots;
+		header->tensorBytes = bytes;
+		header->slotStride = stride;
+		header->written.store(0, std::memory_order_relaxed);
+		header->consumed.store(0, std::memory_order_relaxed);
+		header->finished.store(0, std::memory_order_relaxed);
+		// The magic goes in last, a consumer that sees it sees the rest
+		std::atomic_thread_fence(std::memory_order_release);
+		memcpy(header->magic, RingMagic, sizeof(RingMagic));
+
+		logger::info(logger::Stage::Pipeline, jobId, logger::NoFrame, "Tensor ring %s: %d slots of %dx%d %s",
+		             options.path.c_str(), options.slots, width, height, options.layout == Layout::Float32 ? "float32 chw" : "rgb8 hwc");
+		ring = true;
+		return true;
+	}
+
+	// To RGB at the tensor size, still in the stored orientation. HDR is scaled to 10 bits
+	// first so the tone mapper only sees tensor pixels, then converted from its output.
+	bool scale(const AVFrame* frame) {
+		const int scaledWidth = orientation.swapsAxes() ? height : width;
+		const int scaledHeight = orientation.swapsAxes() ? width : height;
+		if (!allocate(rgb, AV_PIX_FMT_RGB24, scaledWidth, scaledHeight)) {
+			return false;
+		}
+		if (color.transfer == tonemap::Transfer::Sdr) {
+			sws = sws_getCachedContext(sws, frame->width, frame->height, (AVPixelFormat)frame->format,
+			                           scaledWidth, scaledHeight, AV_PIX_FMT_RGB24, SWS_BILINEAR, nullptr, nullptr, nullptr);
+			if (!sws) {
+				return false;
+			}
+			sws_scale(sws, frame->data, frame->linesize, 0, frame->height, rgb->data, rgb->linesize);
+			return true;
+		}
+
+		if (!allocate(wide, AV_PIX_FMT_YUV420P10LE, scaledWidth, scaledHeight) ||
+		    !allocate(mapped, AV_PIX_FMT_YUV420P, scaledWidth, scaledHeight)) {
+			return false;
+		}
+		sws = sws_getCachedContext(sws, frame->width, frame->height, (AVPixelFormat)frame->format,
+		                           scaledWidth, scaledHeight, AV_PIX_FMT_YUV420P10LE, SWS_BILINEAR, nullptr, nullptr, nullptr);
+		rgbSws = sws_getCachedContext(rgbSws, scaledWidth, scaledHeight, AV_PIX_FMT_YUV420P,
+		                              scaledWidth, scaledHeight, AV_PIX_FMT_RGB24, SWS_POINT, nullptr, nullptr, nullptr);
+		if (!sws || !rgbSws) {
+			return false;
+		}
+		if (!toneMapper.configured(color)) {
+			toneMapper.configure(color);
+		}
+		sws_scale(sws, frame->data, frame->linesize, 0, frame->height, wide->data, wide->linesize);
+		toneMapper.process(wide, mapped);
+		sws_scale(rgbSws, mapped->data, mapped->linesize, 0, scaledHeight, rgb->data, rgb->linesize);
+		return true;
+	}
+
+	static bool allocate(AVFrame*& frame, AVPixelFormat format, int width, int height) {
+		if (frame) {
+			return true;
+		}
+		frame = av_frame_alloc();
+		if (!frame) {
+			return false;
+		}
+		frame->format = format;
+		frame->width = width;
+		frame->height = height;
+		if (av_frame_get_buffer(frame, 0) < 0) {
+			av_frame_free(&frame);
+			return false;
+		}
+		return true;
+	}
+
+	// Upright copy in the ring's layout. Displayed (x, y) comes from stored (sx, sy).
+	void writeTensor(uint8_t* out) const {
+		const bool upright = orientation.identity();
+		for (int y = 0; y < height; y++) {
+			if (upright && options.layout == Layout::Rgb8) {
+				memcpy(out + (size_t)y * width * 3, rgb->data[0] + (ptrdiff_t)y * rgb->linesize[0], (size_t)width * 3);
+				continue;
+			}
+			for (int x = 0; x < width; x++) {
+				const int mirrored = orientation.hflip ? width - 1 - x : x;
+				int sx = mirrored, sy = y;
+				if (orientation.rotation == 90) {
+					sx = y;
+					sy = width - 1 - mirrored;
+				} else if (orientation.rotation == 180) {
+					sx = width - 1 - mirrored;
+					sy = height - 1 - y;
+				} else if (orientation.rotation == 270) {
+					sx = height - 1 - y;
+					sy = mirrored;
+				}
+				const uint8_t* pixel = rgb->data[0] + (ptrdiff_t)sy * rgb->linesize[0] + sx * 3;
+				if (options.layout == Layout::Rgb8) {
+					memcpy(out + ((size_t)y * width + x) * 3, pixel, 3);
+				} else {
+					float* planes = (float*)out;
+					const size_t plane = (size_t)width * height;
+					for (int c = 0; c < 3; c++) {
+						planes[c * plane + (size_t)y * width + x] = pixel[c] * (1.0f / 255);
+					}
+				}
+			}
+		}
+	}
+};
+
+/*
+
+Reader
+The consumer: maps the ring and hands out the oldest unread tensor in place, which stays
+valid until release().
+
+*/
+
+class Reader {
+public:
+	struct Tensor {
+		const SlotHeader* meta;
+		const void* data;
+	};
+
+	// Null until the producer has created the ring
+	static std::unique_ptr<Reader> open(const std::string& path) {
+		auto reader = std::unique_ptr<Reader>(new Reader());
+		if (!reader->file.open(path)) {
+			return nullptr;
+		}
+		const RingHeader* header = (const RingHeader*)reader->file.bytes();
+		if (memcmp(header->magic, RingMagic, sizeof(RingMagic)) != 0 || header->version != RingVersion ||
+		    HeaderBytes + header->slotStride * header->slots > reader->file.length()) {
+			return nullptr;
+		}
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return reader;
+	}
+
+	const RingHeader& header() const {
+		return *(const RingHeader*)file.bytes();
+	}
+
+	// False when nothing is ready yet, or ever again once finished() is true
+	bool peek(Tensor& tensor) const {
+		const RingHeader& ring = header();
+		const uint64_t consumed = ring.consumed.load(std::memory_order_relaxed);
+		if (consumed == ring.written.load(std::memory_order_acquire)) {
+			return false;
+		}
+		const uint8_t* slot = file.bytes() + HeaderBytes + (consumed % ring.slots) * ring.slotStride;
+		tensor.meta = (const SlotHeader*)slot;
+		tensor.data = slot + SlotAlign;
+		return true;
+	}
+
+	void release() {
+		RingHeader& ring = *(RingHeader*)file.bytes();
+		ring.consumed.fetch_add(1, std::memory_order_release);
+	}
+
+	// The producer is done and every tensor has been read
+	bool finished() const {
+		const RingHeader& ring = header();
+		return ring.finished.load(std::memory_order_acquire) &&
+		       ring.consumed.load(std::memory_order_relaxed) == ring.written.load(std::memory_order_acquire);
+	}
+
+private:
+	MappedFile file;
+
+	Reader() = default;
+};
+
+} // namespace tensors
+
+#endif // TENSORS_HPP
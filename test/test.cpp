@@ -1,6 +1,12 @@
 
 #include <gst/gst.h>
 #include <iostream>
+
+#include "logger.hpp"
+
+// Single pipeline per process, so a fixed job ID for the log records
+static const uint64_t jobId = 1;
+
 extern "C" {
 // Function to link elements with dynamic pads
 static void on_pad_added(GstElement* src, GstPad* new_pad, gpointer data) {
@@ -22,9 +28,9 @@ static void on_pad_added(GstElement* src, GstPad* new_pad, gpointer data) {
 	if (g_str_has_prefix(new_pad_type, "video/x-raw")) {
 		ret = gst_pad_link(new_pad, sink_pad);
 		if (GST_PAD_LINK_FAILED(ret)) {
-			std::cerr << "Type is " << new_pad_type << " but link failed.\n";
+			logger::error(logger::Stage::Pipeline, jobId, logger::NoFrame, "Type is %s but link failed.", new_pad_type);
 		} else {
-			std::cout << "Link succeeded (type " << new_pad_type << ").\n";
+			logger::info(logger::Stage::Pipeline, jobId, logger::NoFrame, "Link succeeded (type %s).", new_pad_type);
 		}
 	}
 
@@ -55,7 +61,8 @@ int main(int argc, char *argv[]) {
 	sink = gst_element_factory_make("filesink", "sink");
 
 	if (!pipeline || !source || !decodebin || !scaler || !filter || !converter || !encoder || !muxer || !sink) {
-		g_printerr("Not all elements could be created.\n");
+		logger::error(logger::Stage::Pipeline, jobId, logger::NoFrame, "Not all elements could be created.");
+		logger::flush();
 		return -1;
 	}
 
@@ -121,8 +128,9 @@ int main(int argc, char *argv[]) {
 
 	ret = gst_element_set_state(pipeline, GST_STATE_PLAYING);
 	if (ret == GST_STATE_CHANGE_FAILURE) {
-		g_printerr("Failed to start the pipeline.\n");
+		logger::error(logger::Stage::Pipeline, jobId, logger::NoFrame, "Failed to start the pipeline.");
 		gst_object_unref(pipeline);
+		logger::flush();
 		return -1;
 	}
 
@@ -137,14 +145,14 @@ int main(int argc, char *argv[]) {
 			switch (GST_MESSAGE_TYPE(msg)) {
 				case GST_MESSAGE_ERROR:
 					gst_message_parse_error(msg, &err, &debug_info);
-					g_printerr("Error received from element %s: %s\n", GST_OBJECT_NAME(msg->src), err->message);
-					g_printerr("Debugging information: %s\n", debug_info ? debug_info : "none");
+					logger::error(logger::Stage::Pipeline, jobId, logger::NoFrame, "Error received from element %s: %s (debug: %s)",
+						GST_OBJECT_NAME(msg->src), err->message, debug_info ? debug_info : "none");
 					g_clear_error(&err);
 					g_free(debug_info);
 					is_active = false;
 					break;
 				case GST_MESSAGE_EOS:
-					g_print("End-Of-Stream reached.\n");
+					logger::info(logger::Stage::Pipeline, jobId, logger::NoFrame, "End-Of-Stream reached.");
 					is_active = false;
 					break;
 				case GST_MESSAGE_STATE_CHANGED:
@@ -152,12 +160,12 @@ int main(int argc, char *argv[]) {
 					if (GST_MESSAGE_SRC(msg) == GST_OBJECT(pipeline)) {
 						GstState old_state, new_state, pending_state;
 						gst_message_parse_state_changed(msg, &old_state, &new_state, &pending_state);
-						g_print("Pipeline state changed from %s to %s:\n",
+						logger::info(logger::Stage::Pipeline, jobId, logger::NoFrame, "Pipeline state changed from %s to %s",
 								gst_element_state_get_name(old_state), gst_element_state_get_name(new_state));
 					}
 					break;
 				default:
-					g_printerr("Unexpected message received.\n");
+					logger::warning(logger::Stage::Pipeline, jobId, logger::NoFrame, "Unexpected message received.");
 					break;
 			}
 			gst_message_unref(msg);
@@ -167,6 +175,7 @@ int main(int argc, char *argv[]) {
 	gst_element_set_state(pipeline, GST_STATE_NULL);
 	gst_object_unref(bus);
 	gst_object_unref(pipeline);
+	logger::flush();
 	return 0;
 }
 }
\ No newline at end of file
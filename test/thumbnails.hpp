@@ -0,0 +1,559 @@
+#ifndef THUMBNAILS_HPP
+#define THUMBNAILS_HPP
+
+/*
+
+Thumbnails
+Poster, evenly spaced thumbnails and a scrubbing sprite sheet with its WebVTT index,
+taken from frames that are decoded anyway instead of a separate ffmpeg run per image.
+
+	dir/poster.jpg
+	dir/thumb.000.jpg ... thumb.NNN.jpg
+	dir/sprite.000.jpg ...           columns x rows tiles per sheet
+	dir/sprite.vtt                   00:00:05.000 --> 00:00:10.000
+	                                 sprite.000.jpg#xywh=160,0,160,90
+
+Each target takes the first frame at or after its time, so frames have to be offered
+in presentation order. Images are written upright, with the display rotation the encoded
+video gets, so portrait phone footage does not come out sideways next to it. HDR frames
+go through the encode's tone mapper first, the images match the BT.709 video rather than
+showing washed out PQ or HLG code values. extractKeyframes() is the standalone fast mode: it decodes
+keyframes only, which is good enough for scrubbing and a lot cheaper than a full decode.
+
+*/
+
+extern "C" {
+	#include <libavcodec/avcodec.h>
+	#include <libavformat/avformat.h>
+	#include <libavutil/opt.h>
+	#include <libswscale/swscale.h>
+}
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "geometry.hpp"
+#include "logger.hpp"
+#include "tonemap.hpp"
+
+namespace thumbnails {
+
+enum class ImageFormat { Jpeg, WebP };
+
+struct Options {
+	std::string dir = "thumbnails";
+	ImageFormat format = ImageFormat::Jpeg;
+	int quality = 80;              // 0-100
+
+	bool poster = true;
+	double posterSeconds = -1;     // Negative picks a frame 10% into the video
+	int posterWidth = 0;           // 0 keeps the source width
+
+	int thumbnailCount = 0;
+	int thumbnailWidth = 320;
+
+	double spriteInterval = 0;     // Seconds between sprite tiles, 0 disables the sprite
+	int tileWidth = 160;
+	int columns = 10;
+	int rows = 10;                 // More sheets are started once one is full
+};
+
+class Extractor {
+public:
+	// durationSeconds <= 0 means unknown, then only the sprite and an explicit poster time work
+	Extractor(const Options& options, double durationSeconds, const geometry::Transform& orientation,
+	          const tonemap::Source& color, uint64_t jobId = 0)
+		: options(options), duration(durationSeconds), orientation(orientation), color(color), jobId(jobId) {
+		std::error_code error;
+		std::filesystem::create_directories(options.dir, error);
+
+		if (options.poster) {
+			double at = options.posterSeconds;
+			if (at < 0) {
+				at = duration > 0 ? duration * 0.1 : 0;
+			}
+			targets.push_back({at, -1});
+		}
+		if (options.thumbnailCount > 0) {
+			if (duration > 0) {
+				// Centered in equal slices, so neither the first black frame nor the last one is picked
+				for (int i = 0; i < options.thumbnailCount; i++) {
+					targets.push_back({duration * (i + 0.5) / options.thumbnailCount, i});
+				}
+			} else {
+				logger::warning(logger::Stage::Pipeline, jobId, logger::NoFrame, "Unknown duration, no thumbnails");
+			}
+		}
+		std::sort(targets.begin(), targets.end(), [](const Target& a, const Target& b) {
+			return a.seconds < b.seconds;
+		});
+	}
+
+	~Extractor() {
+		av_frame_free(&sheet);
+		av_frame_free(&image);
+		av_frame_free(&stored);
+		av_frame_free(&wide);
+		av_frame_free(&mapped);
+		sws_freeContext(sws);
+		sws_freeContext(imageSws);
+	}
+
+	Extractor(const Extractor&) = delete;
+	Extractor& operator=(const Extractor&) = delete;
+
+	// Cheap check for the decode loop, true when the frame at seconds fills a target
+	bool wants(double seconds) const {
+		return (next < targets.size() && targets[next].seconds <= seconds) ||
+		       (options.spriteInterval > 0 && tiles * options.spriteInterval <= seconds);
+	}
+
+	// Nothing left that a later frame could fill
+	bool done() const {
+		return next == targets.size() && options.spriteInterval <= 0;
+	}
+
+	bool offer(const AVFrame* frame, double seconds) {
+		while (next < targets.size() && targets[next].seconds <= seconds) {
+			const Target& target = targets[next++];
+			const bool isPoster = target.index < 0;
+			const int width = isPoster ? (options.posterWidth > 0 ? options.posterWidth : displayedWidth(frame)) : options.thumbnailWidth;
+
+			char name[64];
+			if (isPoster) {
+				snprintf(name, sizeof(name), "poster%s", extension());
+			} else {
+				snprintf(name, sizeof(name), "thumb.%03d%s", target.index, extension());
+			}
+			if (!writeScaled(frame, width, name)) {
+				return false;
+			}
+		}
+
+		while (options.spriteInterval > 0 && tiles * options.spriteInterval <= seconds) {
+			if (!addTile(frame)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Writes the last sprite sheet and the VTT index
+	bool finish() {
+		if (next < targets.size()) {
+			logger::warning(logger::Stage::Pipeline, jobId, logger::NoFrame, "%zu poster/thumbnail times were past the last frame",
+			                targets.size() - next);
+		}
+		if (options.spriteInterval <= 0 || tiles == 0) {
+			return true;
+		}
+		if (tiles % tilesPerSheet() != 0 && !writeSheet()) {
+			return false;
+		}
+		return writeIndex();
+	}
+
+private:
+	struct Target {
+		double seconds;
+		int index;  // Thumbnail number, -1 for the poster
+	};
+
+	const Options options;
+	const double duration;
+	const geometry::Transform orientation;
+	const tonemap::Source color;
+	const uint64_t jobId;
+	tonemap::ToneMapper toneMapper;
+
+	std::vector<Target> targets;
+	size_t next = 0;
+
+	int tiles = 0;
+	int tileHeight = 0;
+	AVFrame* sheet = nullptr;
+	AVFrame* image = nullptr;
+	AVFrame* stored = nullptr;      // Scaled, stored orientation
+	AVFrame* wide = nullptr;        // HDR scaled to 10-bit 4:2:0, before tone mapping
+	AVFrame* mapped = nullptr;      // After tone mapping
+	SwsContext* sws = nullptr;
+	SwsContext* imageSws = nullptr; // Tone mapped to the image format, HDR only
+
+	const char* extension() const {
+		return options.format == ImageFormat::WebP ? ".webp" : ".jpg";
+	}
+
+	// mjpeg wants the full-range variant, libwebp plain yuv420p
+	AVPixelFormat imageFormat() const {
+		return options.format == ImageFormat::WebP ? AV_PIX_FMT_YUV420P : AV_PIX_FMT_YUVJ420P;
+	}
+
+	int tilesPerSheet() const {
+		return std::max(options.columns, 1) * std::max(options.rows, 1);
+	}
+
+	int displayedWidth(const AVFrame* frame) const {
+		return orientation.swapsAxes() ? frame->height : frame->width;
+	}
+
+	int displayedHeight(const AVFrame* frame) const {
+		return orientation.swapsAxes() ? frame->width : frame->height;
+	}
+
+	int evenHeight(const AVFrame* frame, int width) const {
+		return std::max(2, (int)((int64_t)displayedHeight(frame) * width / displayedWidth(frame)) & ~1);
+	}
+
+	static AVFrame* allocate(AVFrame*& target, AVPixelFormat format, int width, int height) {
+		if (target && target->format == format && target->width == width && target->height == height) {
+			return target;
+		}
+		av_frame_free(&target);
+		target = av_frame_alloc();
+		if (!target) {
+			return nullptr;
+		}
+		target->format = format;
+		target->width = width;
+		target->height = height;
+		if (av_frame_get_buffer(target, 0) < 0) {
+			av_frame_free(&target);
+		}
+		return target;
+	}
+
+	AVFrame* allocImage(AVFrame*& target, int width, int height) {
+		return allocate(target, imageFormat(), width, height);
+	}
+
+	// Scales frame upright into a width x height rectangle of dst at (x, y), all even
+	bool scaleInto(const AVFrame* frame, AVFrame* dst, int x, int y, int width, int height) {
+		const int storedWidth = orientation.swapsAxes() ? height : width;
+		const int storedHeight = orientation.swapsAxes() ? width : height;
+		if (!allocImage(stored, storedWidth, storedHeight) || !scaleStored(frame)) {
+			logger::error(logger::Stage::Pipeline, jobId, logger::NoFrame, "Could not scale frame for thumbnails");
+			return false;
+		}
+
+		for (int i = 0; i < 3; i++) {
+			const int shift = i == 0 ? 0 : 1;
+			place(stored->data[i], stored->linesize[i], dst->data[i] + (ptrdiff_t)(y >> shift) * dst->linesize[i] + (x >> shift),
+			      dst->linesize[i], width >> shift, height >> shift);
+		}
+		return true;
+	}
+
+	// Into stored at its size. HDR is scaled to 10 bits first so the tone mapper only sees
+	// image pixels, its BT.709 output then goes to the image format.
+	bool scaleStored(const AVFrame* frame) {
+		if (color.transfer == tonemap::Transfer::Sdr) {
+			sws = sws_getCachedContext(sws, frame->width, frame->height, (AVPixelFormat)frame->format,
+			                           stored->width, stored->height, imageFormat(), SWS_BILINEAR, nullptr, nullptr, nullptr);
+			if (!sws) {
+				return false;
+			}
+			sws_scale(sws, frame->data, frame->linesize, 0, frame->height, stored->data, stored->linesize);
+			return true;
+		}
+
+		if (!allocate(wide, AV_PIX_FMT_YUV420P10LE, stored->width, stored->height) ||
+		    !allocate(mapped, AV_PIX_FMT_YUV420P, stored->width, stored->height)) {
+			return false;
+		}
+		sws = sws_getCachedContext(sws, frame->width, frame->height, (AVPixelFormat)frame->format,
+		                           stored->width, stored->height, AV_PIX_FMT_YUV420P10LE, SWS_BILINEAR, nullptr, nullptr, nullptr);
+		imageSws = sws_getCachedContext(imageSws, stored->width, stored->height, AV_PIX_FMT_YUV420P,
+		                                stored->width, stored->height, imageFormat(), SWS_POINT, nullptr, nullptr, nullptr);
+		if (!sws || !imageSws) {
+			return false;
+		}
+		if (!toneMapper.configured(color)) {
+			toneMapper.configure(color);
+		}
+		sws_scale(sws, frame->data, frame->linesize, 0, frame->height, wide->data, wide->linesize);
+		toneMapper.process(wide, mapped);
+		sws_scale(imageSws, mapped->data, mapped->linesize, 0, mapped->height, stored->data, stored->linesize);
+		return true;
+	}
+
+	// One plane turned upright, width x height displayed. Displayed (x, y) comes from stored (sx, sy).
+	void place(const uint8_t* src, int srcStride, uint8_t* dst, int dstStride, int width, int height) const {
+		if (orientation.identity()) {
+			for (int y = 0; y < height; y++) {
+				memcpy(dst + (ptrdiff_t)y * dstStride, src + (ptrdiff_t)y * srcStride, width);
+			}
+			return;
+		}
+		for (int y = 0; y < height; y++) {
+			uint8_t* out = dst + (ptrdiff_t)y * dstStride;
+			for (int x = 0; x < width; x++) {
+				const int mirrored = orientation.hflip ? width - 1 - x : x;
+				int sx = mirrored, sy = y;
+				if (orientation.rotation == 90) {
+					sx = y;
+					sy = width - 1 - mirrored;
+				} else if (orientation.rotation == 180) {
+					sx = width - 1 - mirrored;
+					sy = height - 1 - y;
+				} else if (orientation.rotation == 270) {
+					sx = height - 1 - y;
+					sy = mirrored;
+				}
+				out[x] = src[(ptrdiff_t)sy * srcStride + sx];
+			}
+		}
+	}
+
+	bool writeScaled(const AVFrame* frame, int width, const char* name) {
+		width = std::max(2, width & ~1);
+		const int height = evenHeight(frame, width);
+		if (!allocImage(image, width, height) || !scaleInto(frame, image, 0, 0, width, height)) {
+			return false;
+		}
+		return encode(image, name);
+	}
+
+	bool addTile(const AVFrame* frame) {
+		const int width = std::max(2, options.tileWidth & ~1);
+		if (tileHeight == 0) {
+			tileHeight = evenHeight(frame, width);
+		}
+		const int column = (tiles % tilesPerSheet()) % std::max(options.columns, 1);
+		const int row = (tiles % tilesPerSheet()) / std::max(options.columns, 1);
+
+		if (!allocImage(sheet, width * std::max(options.columns, 1), tileHeight * std::max(options.rows, 1))) {
+			return false;
+		}
+		if (column == 0 && row == 0) {
+			// Unused tiles of the last sheet stay black
+			memset(sheet->data[0], 16, (size_t)sheet->linesize[0] * sheet->height);
+			memset(sheet->data[1], 128, (size_t)sheet->linesize[1] * (sheet->height / 2));
+			memset(sheet->data[2], 128, (size_t)sheet->linesize[2] * (sheet->height / 2));
+		}
+		if (!scaleInto(frame, sheet, column * width, row * tileHeight, width, tileHeight)) {
+			return false;
+		}
+
+		tiles++;
+		if (tiles % tilesPerSheet() == 0) {
+			return writeSheet();
+		}
+		return true;
+	}
+
+	std::string sheetName(int sheetIndex) const {
+		char name[64];
+		snprintf(name, sizeof(name), "sprite.%03d%s", sheetIndex, extension());
+		return name;
+	}
+
+	bool writeSheet() {
+		return encode(sheet, sheetName((tiles - 1) / tilesPerSheet()).c_str());
+	}
+
+	static std::string timestamp(double seconds) {
+		const int64_t ms = (int64_t)(seconds * 1000 + 0.5);
+		char text[32];
+		snprintf(text, sizeof(text), "%02lld:%02lld:%02lld.%03lld", (long long)(ms / 3600000), (long long)(ms / 60000 % 60),
+		         (long long)(ms / 1000 % 60), (long long)(ms % 1000));
+		return text;
+	}
+
+	bool writeIndex() const {
+		const std::filesystem::path path = std::filesystem::path(options.dir) / "sprite.vtt";
+		std::ofstream file(path, std::ios::trunc);
+		if (!file) {
+			logger::error(logger::Stage::Pipeline, jobId, logger::NoFrame, "Could not write %s", path.c_str());
+			return false;
+		}
+
+		const int width = std::max(2, options.tileWidth & ~1);
+		const int columns = std::max(options.columns, 1);
+		file << "WEBVTT\n";
+		for (int i = 0; i < tiles; i++) {
+			const double start = i * options.spriteInterval;
+			double end = start + options.spriteInterval;
+			if (i == tiles - 1 && duration > start) {
+				end = duration;
+			}
+			const int tile = i % tilesPerSheet();
+			file << "\n" << timestamp(start) << " --> " << timestamp(end) << "\n"
+			     << sheetName(i / tilesPerSheet()) << "#xywh=" << (tile % columns) * width << "," << (tile / columns) * tileHeight
+			     << "," << width << "," << tileHeight << "\n";
+		}
+		return (bool)file;
+	}
+
+	// One-shot still image encode, the packet is the whole file
+	bool encode(const AVFrame* frame, const char* name) {
+		const std::filesystem::path path = std::filesystem::path(options.dir) / name;
+		const AVCodec* codec = avcodec_find_encoder(options.format == ImageFormat::WebP ? AV_CODEC_ID_WEBP : AV_CODEC_ID_MJPEG);
+		if (!codec) {
+			logger::error(logger::Stage::Encode, jobId, logger::NoFrame, "No encoder for %s", name);
+			return false;
+		}
+
+		AVCodecContext* ctx = avcodec_alloc_context3(codec);
+		AVPacket* pkt = av_packet_alloc();
+		if (!ctx || !pkt) {
+			avcodec_free_context(&ctx);
+			av_packet_free(&pkt);
+			return false;
+		}
+		ctx->width = frame->width;
+		ctx->height = frame->height;
+		ctx->pix_fmt = imageFormat();
+		ctx->time_base = AVRational{1, 1};
+		if (options.format == ImageFormat::WebP) {
+			av_opt_set_int(ctx->priv_data, "quality", options.quality, 0);
+		} else {
+			// Map 0-100 onto the mjpeg qscale range, 2 is best and 31 worst
+			ctx->flags |= AV_CODEC_FLAG_QSCALE;
+			ctx->global_quality = FF_QP2LAMBDA * (31 - std::clamp(options.quality, 0, 100) * 29 / 100);
+			ctx->color_range = AVCOL_RANGE_JPEG;
+		}
+
+		bool ok = avcodec_open2(ctx, codec, nullptr) >= 0;
+		if (ok) {
+			AVFrame* input = av_frame_clone(frame);
+			ok = input != nullptr;
+			if (ok) {
+				input->pts = 0;
+				input->quality = ctx->global_quality;
+				ok = avcodec_send_frame(ctx, input) >= 0 && avcodec_send_frame(ctx, nullptr) >= 0 &&
+				     avcodec_receive_packet(ctx, pkt) >= 0;
+				av_frame_free(&input);
+			}
+		}
+
+		if (ok) {
+			std::ofstream file(path, std::ios::binary | std::ios::trunc);
+			file.write((const char*)pkt->data, pkt->size);
+			ok = (bool)file;
+		}
+		if (!ok) {
+			logger::error(logger::Stage::Encode, jobId, logger::NoFrame, "Could not write %s", path.c_str());
+		}
+
+		av_packet_free(&pkt);
+		avcodec_free_context(&ctx);
+		return ok;
+	}
+};
+
+/*
+
+Extract Keyframes
+Standalone fast mode for when no transcode is needed. Only keyframe packets reach the
+decoder (AVDISCARD_NONKEY drops the rest inside it as well) and lowres asks decoders
+that support it (mjpeg, h263 and friends) for a 1/2^lowres size picture. Targets get
+the first keyframe at or after their time.
+
+*/
+
+inline bool extractKeyframes(const std::string& inputPath, const Options& options, int lowres = 0, uint64_t jobId = 0) {
+	AVFormatContext* format = nullptr;
+	if (avformat_open_input(&format, inputPath.c_str(), nullptr, nullptr) != 0) {
+		logger::error(logger::Stage::Demux, jobId, logger::NoFrame, "Could not open %s", inputPath.c_str());
+		return false;
+	}
+	if (avformat_find_stream_info(format, nullptr) < 0) {
+		avformat_close_input(&format);
+		return false;
+	}
+
+	const int streamIndex = av_find_best_stream(format, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+	if (streamIndex < 0) {
+		logger::error(logger::Stage::Demux, jobId, logger::NoFrame, "No video stream in %s", inputPath.c_str());
+		avformat_close_input(&format);
+		return false;
+	}
+
+	AVStream* stream = format->streams[streamIndex];
+	for (unsigned i = 0; i < format->nb_streams; i++) {
+		if ((int)i != streamIndex) {
+			format->streams[i]->discard = AVDISCARD_ALL;
+		}
+	}
+
+	const AVCodec* decoder = avcodec_find_decoder(stream->codecpar->codec_id);
+	AVCodecContext* ctx = decoder ? avcodec_alloc_context3(decoder) : nullptr;
+	if (!ctx || avcodec_parameters_to_context(ctx, stream->codecpar) < 0) {
+		logger::error(logger::Stage::Decode, jobId, logger::NoFrame, "Decoder not found");
+		avcodec_free_context(&ctx);
+		avformat_close_input(&format);
+		return false;
+	}
+	ctx->skip_frame = AVDISCARD_NONKEY;
+	ctx->lowres = std::clamp(lowres, 0, (int)decoder->max_lowres);
+	if (avcodec_open2(ctx, decoder, nullptr) < 0) {
+		logger::error(logger::Stage::Decode, jobId, logger::NoFrame, "Failed to open decoder");
+		avcodec_free_context(&ctx);
+		avformat_close_input(&format);
+		return false;
+	}
+
+	const tonemap::Source color = tonemap::Source::of(ctx, stream);
+
+	double duration = 0;
+	if (stream->duration != AV_NOPTS_VALUE) {
+		duration = stream->duration * av_q2d(stream->time_base);
+	} else if (format->duration != AV_NOPTS_VALUE) {
+		duration = format->duration / (double)AV_TIME_BASE;
+	}
+	const int64_t start = stream->start_time == AV_NOPTS_VALUE ? 0 : stream->start_time;
+
+	const AVPacketSideData* matrix = av_packet_side_data_get(stream->codecpar->coded_side_data,
+	                                                         stream->codecpar->nb_coded_side_data, AV_PKT_DATA_DISPLAYMATRIX);
+	const geometry::Transform orientation =
+		geometry::Transform::fromDisplayMatrix(matrix && matrix->size >= 9 * sizeof(int32_t) ? (const int32_t*)matrix->data : nullptr);
+
+	Extractor extractor(options, duration, orientation, color, jobId);
+	AVPacket* packet = av_packet_alloc();
+	AVFrame* frame = av_frame_alloc();
+	bool ok = packet && frame;
+	bool draining = false;
+	while (ok && !extractor.done()) {
+		if (!draining) {
+			if (av_read_frame(format, packet) < 0) {
+				draining = true;
+				avcodec_send_packet(ctx, nullptr);
+			} else if (packet->stream_index != streamIndex || !(packet->flags & AV_PKT_FLAG_KEY)) {
+				av_packet_unref(packet);
+				continue;
+			} else {
+				avcodec_send_packet(ctx, packet);
+				av_packet_unref(packet);
+			}
+		}
+
+		int ret;
+		while ((ret = avcodec_receive_frame(ctx, frame)) >= 0) {
+			const double seconds = (frame->best_effort_timestamp - start) * av_q2d(stream->time_base);
+			if (extractor.wants(seconds) && !extractor.offer(frame, seconds)) {
+				ok = false;
+			}
+			av_frame_unref(frame);
+		}
+		if (draining && ret == AVERROR_EOF) {
+			break;
+		}
+	}
+	ok = ok && extractor.finish();
+
+	av_frame_free(&frame);
+	av_packet_free(&packet);
+	avcodec_free_context(&ctx);
+	avformat_close_input(&format);
+	return ok;
+}
+
+} // namespace thumbnails
+
+#endif // THUMBNAILS_HPP
@@ -0,0 +1,465 @@
+#ifndef TONEMAP_HPP
+#define TONEMAP_HPP
+
+/*
+
+Tone Map
+10-bit to 8-bit conversion with HDR to SDR tone mapping, through one precomputed 3D LUT.
+
+Recent iPhones record HEVC Main10 HLG. Letting the pixel format conversion drop it to
+8 bits keeps the HDR transfer and BT.2020 primaries and the result looks washed out,
+and zscale + tonemap is far too slow on the CPU. All of the color math
+
+	Y'CbCr 2020 -> R'G'B' -> linear (PQ EOTF or HLG inverse OETF + OOTF)
+	            -> BT.2390 EETF on luminance -> BT.2020 to BT.709 primaries
+	            -> BT.1886 inverse EOTF -> Y'CbCr 709 8-bit
+
+is evaluated once per node of a 33x33x33 grid over the 10-bit code values. Per pixel
+that leaves a trilinear interpolation in fixed point, with AVX2 gathers where the CPU
+has them. Luma is interpolated per pixel, chroma per 2x2 block at the block's mean luma.
+It runs on the already scaled frame, so its cost is per output pixel.
+
+*/
+
+extern "C" {
+	#include <libavcodec/avcodec.h>
+	#include <libavformat/avformat.h>
+	#include <libavutil/frame.h>
+	#include <libavutil/mastering_display_metadata.h>
+}
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TONEMAP_X86 1
+#endif
+
+namespace tonemap {
+
+enum class Transfer { Sdr, PQ, HLG };
+
+// Kernel variants, the best one the CPU has is picked unless told otherwise
+enum class Isa { Scalar, Avx2 };
+
+inline const char* isaName(Isa isa) {
+	return isa == Isa::Avx2 ? "avx2" : "scalar";
+}
+
+inline const char* transferName(Transfer transfer) {
+	switch (transfer) {
+		case Transfer::PQ: return "pq";
+		case Transfer::HLG: return "hlg";
+		default: return "sdr";
+	}
+}
+
+struct Source {
+	Transfer transfer = Transfer::Sdr;
+	bool bt2020 = false;
+	double peakNits = 1000;   // Brightest pixel the grade uses, PQ only
+
+	bool operator==(const Source& other) const {
+		return transfer == other.transfer && bt2020 == other.bt2020 && peakNits == other.peakNits;
+	}
+
+	// From the decoder's color tags and the stream's light level metadata
+	static Source of(const AVCodecContext* decoder, const AVStream* stream) {
+		Source source;
+		if (decoder->color_trc == AVCOL_TRC_SMPTE2084) {
+			source.transfer = Transfer::PQ;
+		} else if (decoder->color_trc == AVCOL_TRC_ARIB_STD_B67) {
+			source.transfer = Transfer::HLG;
+		}
+		source.bt2020 = decoder->color_primaries == AVCOL_PRI_BT2020 || decoder->colorspace == AVCOL_SPC_BT2020_NCL;
+
+		const AVPacketSideData* data = av_packet_side_data_get(stream->codecpar->coded_side_data,
+		                                                       stream->codecpar->nb_coded_side_data, AV_PKT_DATA_CONTENT_LIGHT_LEVEL);
+		if (data && data->size >= sizeof(AVContentLightMetadata)) {
+			const AVContentLightMetadata* light = (const AVContentLightMetadata*)data->data;
+			if (light->MaxCLL > 0) {
+				source.peakNits = light->MaxCLL;
+			}
+		}
+		return source;
+	}
+};
+
+class ToneMapper {
+public:
+	bool configured(const Source& other) const {
+		return built && source == other;
+	}
+
+	void configure(const Source& other) {
+		source = other;
+		build();
+		built = true;
+	}
+
+	// yuv420p10le in, yuv420p out, same size. Luma rows [rowStart, rowEnd), rowStart even.
+	void process(const AVFrame* in, AVFrame* out, int rowStart, int rowEnd) const {
+		const int width = in->width;
+		const int chromaWidth = (width + 1) / 2;
+		const int lastRow = in->height - 1;
+
+		for (int y = rowStart; y < rowEnd; y++) {
+			const uint16_t* luma = row16(in, 0, y);
+			const uint16_t* cb = row16(in, 1, y / 2);
+			const uint16_t* cr = row16(in, 2, y / 2);
+			lumaRow(luma, cb, cr, out->data[0] + (ptrdiff_t)y * out->linesize[0], width);
+
+			if (y % 2 == 0) {
+				const uint16_t* below = row16(in, 0, std::min(y + 1, lastRow));
+				chromaRow(luma, below, cb, cr, out->data[1] + (ptrdiff_t)(y / 2) * out->linesize[1],
+				          out->data[2] + (ptrdiff_t)(y / 2) * out->linesize[2], width, chromaWidth);
+			}
+		}
+	}
+
+	void process(const AVFrame* in, AVFrame* out) const {
+		process(in, out, 0, in->height);
+	}
+
+	static bool available(Isa variant) {
+#ifdef TONEMAP_X86
+		return variant == Isa::Scalar || hasAvx2();
+#else
+		return variant == Isa::Scalar;
+#endif
+	}
+
+	// For benchmarks, false when the CPU lacks it
+	bool setIsa(Isa variant) {
+		if (!available(variant)) {
+			return false;
+		}
+		isa = variant;
+		return true;
+	}
+
+	Isa kernel() const {
+		return isa;
+	}
+
+	// The full color math per pixel without the LUT, same chroma siting. Slow, for checking
+	// how far the interpolation is from the exact result.
+	void reference(const AVFrame* in, AVFrame* out) const {
+		const int width = in->width;
+		const int lastRow = in->height - 1;
+		for (int y = 0; y < in->height; y++) {
+			const uint16_t* luma = row16(in, 0, y);
+			const uint16_t* cb = row16(in, 1, y / 2);
+			const uint16_t* cr = row16(in, 2, y / 2);
+			uint8_t* outY = out->data[0] + (ptrdiff_t)y * out->linesize[0];
+			for (int x = 0; x < width; x++) {
+				double pixel[3];
+				evaluate(luma[x], cb[x / 2], cr[x / 2], pixel);
+				outY[x] = (uint8_t)std::lround(std::clamp(pixel[0], 0.0, 255.0));
+			}
+			if (y % 2 != 0) {
+				continue;
+			}
+			const uint16_t* below = row16(in, 0, std::min(y + 1, lastRow));
+			for (int x = 0; x < (width + 1) / 2; x++) {
+				const int right = std::min(2 * x + 1, width - 1);
+				const int mean = (luma[2 * x] + luma[right] + below[2 * x] + below[right] + 2) >> 2;
+				double pixel[3];
+				evaluate(mean, cb[x], cr[x], pixel);
+				out->data[1][(ptrdiff_t)(y / 2) * out->linesize[1] + x] = (uint8_t)std::lround(std::clamp(pixel[1], 0.0, 255.0));
+				out->data[2][(ptrdiff_t)(y / 2) * out->linesize[2] + x] = (uint8_t)std::lround(std::clamp(pixel[2], 0.0, 255.0));
+			}
+		}
+	}
+
+private:
+	static constexpr int Nodes = 33;        // Every 32 code values, 1024 included
+	static constexpr int Shift = 5;
+	static constexpr int ValueBits = 6;     // LUT entries are 8-bit codes * 64
+
+	Source source;
+	bool built = false;
+	Isa isa = available(Isa::Avx2) ? Isa::Avx2 : Isa::Scalar;
+
+	// One extra entry so the 32-bit AVX2 gathers never read past the end
+	std::vector<int16_t> lutY = std::vector<int16_t>(Nodes * Nodes * Nodes + 1);
+	std::vector<int16_t> lutU = std::vector<int16_t>(Nodes * Nodes * Nodes + 1);
+	std::vector<int16_t> lutV = std::vector<int16_t>(Nodes * Nodes * Nodes + 1);
+
+	static const uint16_t* row16(const AVFrame* frame, int plane, int y) {
+		return (const uint16_t*)(frame->data[plane] + (ptrdiff_t)y * frame->linesize[plane]);
+	}
+
+	/*
+
+	LUT construction, all in double precision
+
+	*/
+
+	static double pqEotf(double e) {
+		const double m1 = 2610.0 / 16384, m2 = 2523.0 / 4096 * 128;
+		const double c1 = 3424.0 / 4096, c2 = 2413.0 / 4096 * 32, c3 = 2392.0 / 4096 * 32;
+		const double p = std::pow(std::max(e, 0.0), 1 / m2);
+		return 10000 * std::pow(std::max(p - c1, 0.0) / (c2 - c3 * p), 1 / m1);
+	}
+
+	static double pqInverse(double nits) {
+		const double m1 = 2610.0 / 16384, m2 = 2523.0 / 4096 * 128;
+		const double c1 = 3424.0 / 4096, c2 = 2413.0 / 4096 * 32, c3 = 2392.0 / 4096 * 32;
+		const double y = std::pow(std::max(nits, 0.0) / 10000, m1);
+		return std::pow((c1 + c2 * y) / (1 + c3 * y), m2);
+	}
+
+	static double signedPow(double x, double power) {
+		return std::copysign(std::pow(std::fabs(x), power), x);
+	}
+
+	static double hlgInverseOetf(double e) {
+		const double a = 0.17883277, b = 1 - 4 * a, c = 0.5 - a * std::log(4 * a);
+		return e <= 0.5 ? e * e / 3 : (std::exp((e - c) / a) + b) / 12;
+	}
+
+	// BT.2390 EETF in PQ space, maps [0, sourcePeak] nits onto [0, targetPeak]
+	static double eetf(double nits, double sourcePeak, double targetPeak) {
+		const double peak = pqInverse(sourcePeak);
+		const double e1 = std::min(pqInverse(nits) / peak, 1.0);  // Above the stated peak clips to it
+		const double maxLum = pqInverse(targetPeak) / peak;
+		const double ks = 1.5 * maxLum - 0.5;
+		double e2 = e1;
+		if (e1 > ks) {
+			const double t = (e1 - ks) / (1 - ks);
+			const double t2 = t * t, t3 = t2 * t;
+			e2 = (2 * t3 - 3 * t2 + 1) * ks + (t3 - 2 * t2 + t) * (1 - ks) + (-2 * t3 + 3 * t2) * maxLum;
+		}
+		return pqEotf(e2 * peak);
+	}
+
+	// 10-bit code values in, 8-bit code values out
+	void evaluate(double codeY, double codeU, double codeV, double out[3]) const {
+		const double y = (codeY - 64) / 876;
+		const double cb = (codeU - 512) / 896;
+		const double cr = (codeV - 512) / 896;
+
+		const double kr = source.bt2020 ? 0.2627 : 0.2126;
+		const double kb = source.bt2020 ? 0.0593 : 0.0722;
+		const double kg = 1 - kr - kb;
+		double rgb[3];
+		rgb[0] = y + 2 * (1 - kr) * cr;
+		rgb[2] = y + 2 * (1 - kb) * cb;
+		rgb[1] = (y - kr * rgb[0] - kb * rgb[2]) / kg;
+
+		// Linear light, 1.0 is SDR white at 100 nits. SDR keeps what is outside the nominal
+		// range so that plain 10-bit BT.709 comes out as a straight bit depth reduction.
+		const double sdrWhite = 100;
+		if (source.transfer == Transfer::Sdr) {
+			for (double& c : rgb) {
+				c = signedPow(c, 2.4);
+			}
+		} else {
+			for (double& c : rgb) {
+				c = std::clamp(c, 0.0, 1.0);
+			}
+			double peak = source.peakNits;
+			if (source.transfer == Transfer::PQ) {
+				for (double& c : rgb) {
+					c = pqEotf(c);
+				}
+			} else {
+				// HLG system gamma 1.2 for a 1000 nit display
+				for (double& c : rgb) {
+					c = hlgInverseOetf(c);
+				}
+				const double sceneY = 0.2627 * rgb[0] + 0.6780 * rgb[1] + 0.0593 * rgb[2];
+				const double gain = 1000 * std::pow(std::max(sceneY, 1e-6), 0.2);
+				for (double& c : rgb) {
+					c *= gain;
+				}
+				peak = 1000;
+			}
+
+			// Tone map luminance and keep the color ratios
+			const double nits = 0.2627 * rgb[0] + 0.6780 * rgb[1] + 0.0593 * rgb[2];
+			const double mapped = nits > 0 ? eetf(nits, std::max(peak, sdrWhite), sdrWhite) : 0;
+			for (double& c : rgb) {
+				c = nits > 0 ? c * mapped / nits / sdrWhite : 0;
+			}
+		}
+
+		if (source.bt2020) {
+			const double r = 1.6605 * rgb[0] - 0.5876 * rgb[1] - 0.0728 * rgb[2];
+			const double g = -0.1246 * rgb[0] + 1.1329 * rgb[1] - 0.0083 * rgb[2];
+			const double b = -0.0182 * rgb[0] - 0.1006 * rgb[1] + 1.1187 * rgb[2];
+			rgb[0] = r;
+			rgb[1] = g;
+			rgb[2] = b;
+		}
+
+		for (double& c : rgb) {
+			c = signedPow(c, 1 / 2.4);
+		}
+
+		const double outY = 0.2126 * rgb[0] + 0.7152 * rgb[1] + 0.0722 * rgb[2];
+		out[0] = 16 + 219 * outY;
+		out[1] = 128 + 224 * (rgb[2] - outY) / (2 * (1 - 0.0722));
+		out[2] = 128 + 224 * (rgb[0] - outY) / (2 * (1 - 0.2126));
+	}
+
+	void build() {
+		for (int i = 0; i < Nodes; i++) {
+			for (int j = 0; j < Nodes; j++) {
+				for (int k = 0; k < Nodes; k++) {
+					double out[3];
+					evaluate(i << Shift, j << Shift, k << Shift, out);
+					const int index = (i * Nodes + j) * Nodes + k;
+					lutY[index] = (int16_t)std::lround(std::clamp(out[0], 0.0, 255.0) * (1 << ValueBits));
+					lutU[index] = (int16_t)std::lround(std::clamp(out[1], 0.0, 255.0) * (1 << ValueBits));
+					lutV[index] = (int16_t)std::lround(std::clamp(out[2], 0.0, 255.0) * (1 << ValueBits));
+				}
+			}
+		}
+	}
+
+	/*
+
+	Per pixel, scalar and AVX2 produce identical results
+
+	*/
+
+	static uint8_t interpolate(const int16_t* lut, int y, int u, int v) {
+		y = std::min(y, 1023);
+		u = std::min(u, 1023);
+		v = std::min(v, 1023);
+		const int fy = y & 31, fu = u & 31, fv = v & 31;
+		const int16_t* c = lut + ((y >> Shift) * Nodes + (u >> Shift)) * Nodes + (v >> Shift);
+
+		const int dU = Nodes, dY = Nodes * Nodes;
+		const int a00 = c[0] * (32 - fv) + c[1] * fv;
+		const int a01 = c[dU] * (32 - fv) + c[dU + 1] * fv;
+		const int a10 = c[dY] * (32 - fv) + c[dY + 1] * fv;
+		const int a11 = c[dY + dU] * (32 - fv) + c[dY + dU + 1] * fv;
+		const int b0 = a00 * (32 - fu) + a01 * fu;
+		const int b1 = a10 * (32 - fu) + a11 * fu;
+		const int r = b0 * (32 - fy) + b1 * fy;
+		return (uint8_t)((r + (1 << (14 + ValueBits))) >> (15 + ValueBits));
+	}
+
+	void lumaRow(const uint16_t* luma, const uint16_t* cb, const uint16_t* cr, uint8_t* out, int width) const {
+		int x = 0;
+#ifdef TONEMAP_X86
+		if (isa == Isa::Avx2) {
+			x = lumaRowAvx2(luma, cb, cr, out, width);
+		}
+#endif
+		for (; x < width; x++) {
+			out[x] = interpolate(lutY.data(), luma[x], cb[x / 2], cr[x / 2]);
+		}
+	}
+
+	void chromaRow(const uint16_t* top, const uint16_t* bottom, const uint16_t* cb, const uint16_t* cr,
+	               uint8_t* outU, uint8_t* outV, int width, int chromaWidth) const {
+		int x = 0;
+#ifdef TONEMAP_X86
+		if (isa == Isa::Avx2) {
+			x = chromaRowAvx2(top, bottom, cb, cr, outU, outV, width);
+		}
+#endif
+		for (; x < chromaWidth; x++) {
+			const int right = std::min(2 * x + 1, width - 1);
+			const int y = (top[2 * x] + top[right] + bottom[2 * x] + bottom[right] + 2) >> 2;
+			outU[x] = interpolate(lutU.data(), y, cb[x], cr[x]);
+			outV[x] = interpolate(lutV.data(), y, cb[x], cr[x]);
+		}
+	}
+
+#ifdef TONEMAP_X86
+	static bool hasAvx2() {
+		static const bool supported = __builtin_cpu_supports("avx2");
+		return supported;
+	}
+
+	__attribute__((target("avx2")))
+	static __m256i interpolate8(const int16_t* lut, __m256i y, __m256i u, __m256i v) {
+		const __m256i max = _mm256_set1_epi32(1023);
+		const __m256i mask = _mm256_set1_epi32(31);
+		const __m256i full = _mm256_set1_epi32(32);
+		y = _mm256_min_epi32(y, max);
+		u = _mm256_min_epi32(u, max);
+		v = _mm256_min_epi32(v, max);
+
+		const __m256i fy = _mm256_and_si256(y, mask);
+		const __m256i fu = _mm256_and_si256(u, mask);
+		const __m256i fv = _mm256_and_si256(v, mask);
+		const __m256i index = _mm256_add_epi32(
+			_mm256_mullo_epi32(_mm256_add_epi32(_mm256_mullo_epi32(_mm256_srli_epi32(y, Shift), _mm256_set1_epi32(Nodes)),
+			                                    _mm256_srli_epi32(u, Shift)), _mm256_set1_epi32(Nodes)),
+			_mm256_srli_epi32(v, Shift));
+
+		const int dU = Nodes, dY = Nodes * Nodes;
+		const __m256i a00 = lerp(gather(lut, index), gather(lut + 1, index), fv, full);
+		const __m256i a01 = lerp(gather(lut + dU, index), gather(lut + dU + 1, index), fv, full);
+		const __m256i a10 = lerp(gather(lut + dY, index), gather(lut + dY + 1, index), fv, full);
+		const __m256i a11 = lerp(gather(lut + dY + dU, index), gather(lut + dY + dU + 1, index), fv, full);
+		const __m256i r = lerp(lerp(a00, a01, fu, full), lerp(a10, a11, fu, full), fy, full);
+		return _mm256_srai_epi32(_mm256_add_epi32(r, _mm256_set1_epi32(1 << (14 + ValueBits))), 15 + ValueBits);
+	}
+
+	// Gathers read 32 bits, the low half is the entry
+	__attribute__((target("avx2")))
+	static __m256i gather(const int16_t* lut, __m256i index) {
+		const __m256i raw = _mm256_i32gather_epi32((const int*)lut, index, 2);
+		return _mm256_srai_epi32(_mm256_slli_epi32(raw, 16), 16);
+	}
+
+	__attribute__((target("avx2")))
+	static __m256i lerp(__m256i a, __m256i b, __m256i f, __m256i full) {
+		return _mm256_add_epi32(_mm256_mullo_epi32(a, _mm256_sub_epi32(full, f)), _mm256_mullo_epi32(b, f));
+	}
+
+	__attribute__((target("avx2")))
+	static void store8(uint8_t* out, __m256i values) {
+		const __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(values), _mm256_extracti128_si256(values, 1));
+		_mm_storel_epi64((__m128i*)out, _mm_packus_epi16(words, words));
+	}
+
+	// Returns how many pixels it did, the scalar loop finishes the row
+	__attribute__((target("avx2")))
+	int lumaRowAvx2(const uint16_t* luma, const uint16_t* cb, const uint16_t* cr, uint8_t* out, int width) const {
+		const __m256i duplicate = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+		int x = 0;
+		for (; x + 8 <= width; x += 8) {
+			const __m256i y = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(luma + x)));
+			const __m256i u = _mm256_permutevar8x32_epi32(
+				_mm256_castsi128_si256(_mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)(cb + x / 2)))), duplicate);
+			const __m256i v = _mm256_permutevar8x32_epi32(
+				_mm256_castsi128_si256(_mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)(cr + x / 2)))), duplicate);
+			store8(out + x, interpolate8(lutY.data(), y, u, v));
+		}
+		return x;
+	}
+
+	__attribute__((target("avx2")))
+	int chromaRowAvx2(const uint16_t* top, const uint16_t* bottom, const uint16_t* cb, const uint16_t* cr,
+	                  uint8_t* outU, uint8_t* outV, int width) const {
+		const __m256i ones = _mm256_set1_epi16(1);
+		int x = 0;
+		for (; 2 * x + 16 <= width; x += 8) {
+			// 10-bit sums of two rows fit in 16 bits, madd adds the horizontal pairs
+			const __m256i rows = _mm256_add_epi16(_mm256_loadu_si256((const __m256i*)(top + 2 * x)),
+			                                      _mm256_loadu_si256((const __m256i*)(bottom + 2 * x)));
+			const __m256i y = _mm256_srli_epi32(_mm256_add_epi32(_mm256_madd_epi16(rows, ones), _mm256_set1_epi32(2)), 2);
+			const __m256i u = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(cb + x)));
+			const __m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(cr + x)));
+			store8(outU + x, interpolate8(lutU.data(), y, u, v));
+			store8(outV + x, interpolate8(lutV.data(), y, u, v));
+		}
+		return x;
+	}
+#endif
+};
+
+} // namespace tonemap
+
+#endif // TONEMAP_HPP